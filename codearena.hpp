@@ -0,0 +1,300 @@
+#pragma once
+
+// Copyright 2026 Can Joshua Lehmann
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <iostream>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <cassert>
+#include <cinttypes>
+#include <cstring>
+#include <optional>
+#include <algorithm>
+
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace metajit {
+  // Allocates executable memory for generated code.
+  // Each region is backed by a memfd which is mapped twice: once writable and
+  // once executable, so no page is ever writable and executable at the same time.
+  class CodeArena {
+  public:
+    static constexpr size_t REGION_SIZE = 4 * 1024 * 1024; // 4 MiB
+    static constexpr size_t DEFAULT_ALIGN = 16;
+
+    struct Allocation {
+      uint8_t* rw = nullptr;
+      uint8_t* rx = nullptr;
+      size_t size = 0;
+
+      Allocation() {}
+      Allocation(uint8_t* _rw, uint8_t* _rx, size_t _size):
+        rw(_rw), rx(_rx), size(_size) {}
+
+      operator bool() const { return rx != nullptr; }
+    };
+
+    struct Stats {
+      size_t regions = 0;
+      size_t mapped = 0;
+      size_t used = 0;
+      size_t peak = 0;
+      size_t allocs = 0;
+      size_t frees = 0;
+      size_t recycled_regions = 0;
+
+      double occupancy() const {
+        return mapped == 0 ? 0.0 : double(used) / double(mapped);
+      }
+
+      void write(std::ostream& stream) const {
+        stream << "regions: " << regions << '\n';
+        stream << "mapped: " << mapped << '\n';
+        stream << "used: " << used << '\n';
+        stream << "peak: " << peak << '\n';
+        stream << "occupancy: " << occupancy() << '\n';
+        stream << "allocs: " << allocs << '\n';
+        stream << "frees: " << frees << '\n';
+        stream << "recycled regions: " << recycled_regions << '\n';
+      }
+    };
+  private:
+    struct Region {
+      int fd = -1;
+      uint8_t* rw = nullptr;
+      uint8_t* rx = nullptr;
+      size_t size = 0;
+      size_t top = 0;
+      size_t live = 0;
+      std::map<size_t, size_t> free_list; // offset -> size
+    };
+
+    struct Entry {
+      size_t region = 0;
+      size_t offset = 0;
+      size_t size = 0;
+    };
+
+    size_t _region_size = REGION_SIZE;
+    size_t _align = DEFAULT_ALIGN;
+    std::vector<Region> _regions;
+    std::unordered_map<uintptr_t, Entry> _entries; // rx address -> entry
+    Stats _stats;
+
+    static size_t align_up(size_t value, size_t align) {
+      return (value + align - 1) / align * align;
+    }
+
+    static size_t page_size() {
+      static size_t size = sysconf(_SC_PAGESIZE);
+      return size;
+    }
+
+    [[noreturn]]
+    static void fail(const char* what) {
+      std::cerr << "CodeArena: " << what << " failed: ";
+      std::cerr << strerrorname_np(errno) << " " << strerror(errno) << std::endl;
+      exit(1);
+    }
+
+    size_t map_region(size_t min_size) {
+      Region region;
+      region.size = align_up(std::max(min_size, _region_size), page_size());
+
+      region.fd = memfd_create("metajit-code", MFD_CLOEXEC);
+      if (region.fd == -1) {
+        fail("memfd_create");
+      }
+      if (ftruncate(region.fd, region.size) == -1) {
+        fail("ftruncate");
+      }
+
+      void* rw = mmap(nullptr, region.size, PROT_READ | PROT_WRITE, MAP_SHARED, region.fd, 0);
+      if (rw == MAP_FAILED) {
+        fail("mmap");
+      }
+      void* rx = mmap(nullptr, region.size, PROT_READ | PROT_EXEC, MAP_SHARED, region.fd, 0);
+      if (rx == MAP_FAILED) {
+        fail("mmap");
+      }
+      region.rw = (uint8_t*) rw;
+      region.rx = (uint8_t*) rx;
+
+      _regions.push_back(std::move(region));
+      _stats.regions++;
+      _stats.mapped += _regions.back().size;
+      return _regions.size() - 1;
+    }
+
+    // Returns a range to the region, merging it with adjacent free ranges
+    void release(Region& region, size_t offset, size_t size) {
+      if (size == 0) {
+        return;
+      }
+
+      auto next = region.free_list.lower_bound(offset);
+      if (next != region.free_list.end() && offset + size == next->first) {
+        size += next->second;
+        next = region.free_list.erase(next);
+      }
+      if (next != region.free_list.begin()) {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == offset) {
+          offset = prev->first;
+          size += prev->second;
+          region.free_list.erase(prev);
+        }
+      }
+
+      if (offset + size == region.top) {
+        region.top = offset;
+      } else {
+        region.free_list[offset] = size;
+      }
+    }
+
+    std::optional<size_t> alloc_in(Region& region, size_t size, size_t align) {
+      for (auto it = region.free_list.begin(); it != region.free_list.end(); it++) {
+        auto [offset, free_size] = *it;
+        size_t start = align_up(offset, align);
+        if (start + size <= offset + free_size) {
+          region.free_list.erase(it);
+          release(region, offset, start - offset);
+          release(region, start + size, offset + free_size - start - size);
+          return start;
+        }
+      }
+
+      size_t start = align_up(region.top, align);
+      if (start + size <= region.size) {
+        region.top = start + size;
+        return start;
+      }
+
+      return {};
+    }
+  public:
+    CodeArena(size_t region_size = REGION_SIZE, size_t align = DEFAULT_ALIGN):
+        _region_size(region_size), _align(align) {
+      assert(align > 0 && (align & (align - 1)) == 0);
+    }
+
+    CodeArena(const CodeArena&) = delete;
+    CodeArena& operator=(const CodeArena&) = delete;
+
+    ~CodeArena() {
+      for (Region& region : _regions) {
+        munmap(region.rw, region.size);
+        munmap(region.rx, region.size);
+        close(region.fd);
+      }
+    }
+
+    // Arena used by code generators when no arena is given explicitly
+    static CodeArena& global() {
+      static CodeArena arena;
+      return arena;
+    }
+
+    size_t align() const { return _align; }
+
+    Allocation alloc(size_t size, size_t align = 0) {
+      if (align == 0) {
+        align = _align;
+      }
+      assert((align & (align - 1)) == 0 && align <= page_size());
+      size = std::max(size, size_t(1));
+
+      std::optional<size_t> offset;
+      size_t index = _regions.size();
+      for (size_t it = _regions.size(); it-- > 0 && !offset.has_value(); ) {
+        offset = alloc_in(_regions[it], size, align);
+        index = it;
+      }
+      if (!offset.has_value()) {
+        index = map_region(size);
+        offset = alloc_in(_regions[index], size, align);
+        assert(offset.has_value());
+      }
+
+      Region& region = _regions[index];
+      region.live += size;
+      _entries[(uintptr_t) (region.rx + *offset)] = Entry { index, *offset, size };
+
+      _stats.allocs++;
+      _stats.used += size;
+      _stats.peak = std::max(_stats.peak, _stats.used);
+
+      return Allocation(region.rw + *offset, region.rx + *offset, size);
+    }
+
+    // Gives back the unused tail of an allocation
+    void shrink(Allocation& allocation, size_t size) {
+      size = std::max(size, size_t(1));
+      auto it = _entries.find((uintptr_t) allocation.rx);
+      assert(it != _entries.end());
+      Entry& entry = it->second;
+      assert(size <= entry.size);
+
+      Region& region = _regions[entry.region];
+      release(region, entry.offset + size, entry.size - size);
+      region.live -= entry.size - size;
+      _stats.used -= entry.size - size;
+
+      entry.size = size;
+      allocation.size = size;
+    }
+
+    void free(void* code) {
+      auto it = _entries.find((uintptr_t) code);
+      assert(it != _entries.end());
+      Entry entry = it->second;
+      _entries.erase(it);
+
+      Region& region = _regions[entry.region];
+      // Trap if stale code is executed
+      memset(region.rw + entry.offset, 0xcc, entry.size);
+
+      release(region, entry.offset, entry.size);
+      region.live -= entry.size;
+      if (region.live == 0) {
+        region.top = 0;
+        region.free_list.clear();
+        _stats.recycled_regions++;
+      }
+
+      _stats.frees++;
+      _stats.used -= entry.size;
+    }
+
+    void free(const Allocation& allocation) {
+      free(allocation.rx);
+    }
+
+    bool contains(const void* code) const {
+      for (const Region& region : _regions) {
+        if ((const uint8_t*) code >= region.rx && (const uint8_t*) code < region.rx + region.size) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    Stats stats() const { return _stats; }
+  };
+}
@@ -503,9 +503,9 @@ namespace metajit {
       // emit an LLVM Freeze instruction to deal with the possibility of the
       // argument being a poison value. the result of this method must not be
       // poison.
-      if (dynamic_cast<PromoteInst*>(inst)) {
+      if (dyn_cast<PromoteInst>(inst)) {
         return _builder.build_const(Type::Bool, 1);
-      } else if (dynamic_cast<AssumeConstInst*>(inst)) {
+      } else if (dyn_cast<AssumeConstInst>(inst)) {
         return _builder.build_const(Type::Bool, 1);
       } else if (dynmatch(LoadInst, load, inst)) {
         if (load->flags().has(LoadFlags::Pure)) {
@@ -569,7 +569,7 @@ namespace metajit {
       } else {
         if (inst->has_side_effect() ||
             inst->is_terminator() ||
-            dynamic_cast<CommentInst*>(inst)) {
+            dyn_cast<CommentInst>(inst)) {
           return _builder.build_const(Type::Bool, 0);
         }
 
@@ -600,7 +600,7 @@ namespace metajit {
           
           if (is_int_or_bool(use.inst->type()) &&
               // Promote is always constant, but needs this instruction to perform the check
-              !dynamic_cast<PromoteInst*>(use.inst)) {
+              !dyn_cast<PromoteInst>(use.inst)) {
             use_used = _builder.fold_and(
               use_used,
               _builder.fold_not(is_const(use.inst, true))
@@ -659,7 +659,7 @@ namespace metajit {
 
     Value* emit_build_inst(Inst* inst) {
       if (_config.comments &&
-          !dynamic_cast<CommentInst*>(inst)) {
+          !dyn_cast<CommentInst>(inst)) {
         std::ostringstream comment_stream;
         inst->write_arg(comment_stream);
         comment_stream << " = ";
@@ -814,7 +814,7 @@ namespace metajit {
             emit_deps.push_back(emit_groups.at(arg));
           }
         }
-        if (inst->has_side_effect() || dynamic_cast<LoadInst*>(inst)) {
+        if (inst->has_side_effect() || dyn_cast<LoadInst>(inst)) {
           emit_deps.push_back(last_emit_group);
         }
 
@@ -823,8 +823,8 @@ namespace metajit {
         });
 
         std::vector<ActionGroup*> const_deps;
-        if (!dynamic_cast<PromoteInst*>(inst) &&
-            !dynamic_cast<AssumeConstInst*>(inst)) {
+        if (!dyn_cast<PromoteInst>(inst) &&
+            !dyn_cast<AssumeConstInst>(inst)) {
           const_deps.push_back(emit_group);
           for (Value* arg : inst->args()) {
             if (const_groups.find(arg) != const_groups.end()) {
@@ -838,7 +838,7 @@ namespace metajit {
         });
 
         std::vector<ActionGroup*> build_deps = {const_group, used_group, last_build_group};
-        if (dynamic_cast<PromoteInst*>(inst)) {
+        if (dyn_cast<PromoteInst>(inst)) {
           build_deps.push_back(emit_group);
           if (const_groups.find(inst->arg(0)) != const_groups.end()) {
             build_deps.push_back(const_groups.at(inst->arg(0)));
@@ -850,7 +850,7 @@ namespace metajit {
 
         emit_groups[inst] = emit_group;
         
-        if (inst->has_side_effect() || dynamic_cast<LoadInst*>(inst)) {
+        if (inst->has_side_effect() || dyn_cast<LoadInst>(inst)) {
           last_emit_group = emit_group;
         }
 
@@ -872,7 +872,7 @@ namespace metajit {
         }
 
         always_used[inst] = false;
-        if (inst->has_side_effect() || dynamic_cast<CommentInst*>(inst)) {
+        if (inst->has_side_effect() || dyn_cast<CommentInst>(inst)) {
           always_used[inst] = true;
         } else {
           for (Uses::Use use : _uses.at(inst)) {
@@ -78,7 +78,7 @@ class BuildBuildInstPlugin:
         code += f"  llvm::LLVMContext& context = builder.GetInsertBlock()->getModule()->getContext();\n"
         for inst in ir.insts:
             name = inst.format_name(ir)
-            code += f"  if ({name}* i = dynamic_cast<{name}*>(inst)) {{\n"
+            code += f"  if ({name}* i = dyn_cast<{name}>(inst)) {{\n"
             code += f"    std::vector<llvm::Value*> build_args;\n"
             code += f"    build_args.push_back(jitir_builder);\n"
 
@@ -176,7 +176,7 @@ class InstTrailingConstructorPlugin:
 
         arg_init = f"lwir::Span<Value*>::trailing(this, {arg_count})" + arg_init
 
-        init_list = [f"{base}({inst.type}, {arg_init})"] + init_list
+        init_list = [f"{base}(OPCODE, {inst.type}, {arg_init})"] + init_list
         init_list = ", ".join(init_list)
         
         ctor_args = ", ".join(inst.format_formal_args(ir))
@@ -189,6 +189,24 @@ class InstTrailingConstructorPlugin:
         return code
 
 
+class InstOpcodePlugin:
+    def run(self, inst, ir):
+        code = f"  static constexpr Opcode OPCODE = Opcode::{inst.name};\n"
+        code += "\n"
+        code += f"  static bool classof(const Value* value) {{\n"
+        code += f"    return value->is_inst() && static_cast<const Inst*>(value)->opcode() == OPCODE;\n"
+        code += f"  }}\n"
+        code += "\n"
+        return code
+
+class InstListPlugin:
+    def run(self, ir):
+        lines = ["#define jitir_insts(inst)"]
+        for inst in ir.insts:
+            lines.append(f"  inst({inst.name}, {inst.format_name(ir)})")
+        return {"inst_list": " \\\n".join(lines) + "\n"}
+
+
 class InstReadPlugin:
     def run(self, ir):
         code = "Value* read_opcode(std::string opcode) {\n"
@@ -313,7 +331,7 @@ class ClonePlugin:
         code = ""
         for inst in ir.insts:
             name = inst.format_name(ir)
-            code += f"if (dynamic_cast<{name}*>(inst)) {{\n"
+            code += f"if (inst->opcode() == Opcode::{inst.name}) {{\n"
             code += f"  {name}* clone = builder.{inst.format_builder_name(ir)}("
             args = []
             value_index = 0
@@ -552,6 +570,12 @@ jitir = IR(
             type_checks = [],
             doc = "Return from section."
         ),
+        Inst("SideExit",
+            args = [Arg("id", Type("uint32_t"), setter=True)],
+            type = "Type::Void",
+            type_checks = ["id != 0"],
+            doc = "Return from section through a numbered side exit. Returns id to the caller, Exit returns 0."
+        ),
         Inst("Comment",
             args = [Arg("text", Type("const char*"), setter=True)],
             type = "Type::Void",
@@ -567,6 +591,7 @@ lwir(
     ir = jitir,
     plugins = [
         InstPlugin([
+            InstOpcodePlugin(),
             InstTrailingConstructorPlugin(),
             InstGetterPlugin(),
             InstSetterPlugin(),
@@ -575,6 +600,7 @@ lwir(
             InstEqualsPlugin(),
             InstHashPlugin()
         ]),
+        InstListPlugin(),
         AllocatorBuilderPlugin(),
         ClonePlugin(),
         CAPIPlugin(
@@ -668,7 +694,7 @@ class GenExtPlugin:
         func += "                              GenExtSymbols& syms) {\n"
         for inst in ir.insts:
             name = inst.format_name(ir)
-            func += f"  if ({name}* i = dynamic_cast<{name}*>(inst)) {{\n"
+            func += f"  if ({name}* i = dyn_cast<{name}>(inst)) {{\n"
             func += f"    std::vector<Value*> build_args;\n"
             func += f"    build_args.push_back(jitir_builder);\n"
 
@@ -30,75 +30,232 @@
 #include <fstream>
 #include <algorithm>
 #include <chrono>
+#include <type_traits>
 
 #include "../lwir.cpp/lwir_utils.hpp"
 
-#define dynmatch(Type, name, value) Type* name = dynamic_cast<Type*>(value)
+#define dynmatch(Type, name, value) Type* name = ::metajit::dyn_cast<Type>(value)
 
 using float32_t = float;
 using float64_t = double;
 
 namespace metajit {
   class ArenaAllocator {
+  public:
+    struct Stats {
+      size_t allocated = 0; // Bytes returned by alloc since the last dealloc_all
+      size_t wasted = 0; // Alignment padding and skipped chunk tails
+      size_t retained = 0; // Bytes held in chunks, including large allocations
+      size_t chunks = 0;
+      size_t large_allocs = 0;
+      size_t mallocs = 0;
+      size_t released = 0; // Bytes freed or returned to the pool by dealloc_all
+
+      void write(std::ostream& stream) const {
+        stream << "allocated: " << allocated << '\n';
+        stream << "wasted: " << wasted << '\n';
+        stream << "retained: " << retained << '\n';
+        stream << "chunks: " << chunks << '\n';
+        stream << "large_allocs: " << large_allocs << '\n';
+        stream << "mallocs: " << mallocs << '\n';
+        stream << "released: " << released << '\n';
+      }
+    };
   private:
     struct Chunk {
       Chunk* next = nullptr;
+      size_t size = 0;
       uint8_t data[0];
+
+      Chunk(size_t _size): size(_size) {}
+
+      size_t usable_size() const { return size - sizeof(Chunk); }
     };
 
     static constexpr size_t CHUNK_SIZE = 1024 * 1024; // 1 MiB
-    static constexpr size_t USABLE_SIZE = CHUNK_SIZE - sizeof(Chunk);
+    static constexpr size_t SIZE_CLASSES = 7; // Chunks grow up to 64 MiB
+    static constexpr size_t LARGE_SIZE = CHUNK_SIZE / 4;
+    static constexpr size_t HIGH_WATER_MARK = 16 * CHUNK_SIZE;
+    static constexpr size_t POOL_LIMIT = 64 * CHUNK_SIZE;
+
+    // Recycles chunks of arenas destroyed on the same thread, so that
+    // short lived arenas do not need to call malloc in steady state.
+    // The state is trivially destructible, so arenas outliving the
+    // thread's destructors can still release their chunks.
+    class Pool {
+    private:
+      static inline thread_local Chunk* _free[SIZE_CLASSES] = {};
+      static inline thread_local size_t _size = 0;
+      static inline thread_local bool _closed = false;
+
+      struct Cleanup {
+        ~Cleanup() {
+          for (Chunk*& chunk : _free) {
+            while (chunk) {
+              Chunk* next = chunk->next;
+              free(chunk);
+              chunk = next;
+            }
+          }
+          _size = 0;
+          _closed = true;
+        }
+      };
+    public:
+      static Chunk* take(size_t size_class) {
+        Chunk* chunk = _free[size_class];
+        if (chunk) {
+          _free[size_class] = chunk->next;
+          _size -= chunk->size;
+          chunk->next = nullptr;
+        }
+        return chunk;
+      }
+
+      // Returns false if the chunk must be freed by the caller
+      static bool give(Chunk* chunk, size_t size_class) {
+        if (_closed || _size + chunk->size > POOL_LIMIT) {
+          return false;
+        }
+        static thread_local Cleanup cleanup;
+        (void) cleanup;
+
+        chunk->next = _free[size_class];
+        _free[size_class] = chunk;
+        _size += chunk->size;
+        return true;
+      }
+    };
 
     Chunk* _first = nullptr;
     Chunk* _current = nullptr;
+    Chunk* _large = nullptr;
 
     size_t _left = 0;
     uint8_t* _ptr = nullptr;
 
+    Stats _stats;
+
     inline size_t align_pad(void* ptr, size_t align) {
       size_t delta = (uintptr_t) ptr % align;
       return delta ? align - delta : 0;
     }
+
+    static size_t chunk_size(size_t size_class) {
+      return CHUNK_SIZE << size_class;
+    }
+
+    static size_t size_class(const Chunk* chunk) {
+      for (size_t it = 0; it < SIZE_CLASSES; it++) {
+        if (chunk->size == chunk_size(it)) {
+          return it;
+        }
+      }
+      return SIZE_CLASSES;
+    }
+
+    Chunk* new_chunk(size_t size) {
+      Chunk* chunk = (Chunk*) malloc(size);
+      assert(chunk);
+      _stats.mallocs++;
+      return new (chunk) Chunk(size);
+    }
+
+    Chunk* acquire_chunk(size_t size_class) {
+      Chunk* chunk = Pool::take(size_class);
+      if (!chunk) {
+        chunk = new_chunk(chunk_size(size_class));
+      }
+      _stats.chunks++;
+      _stats.retained += chunk->size;
+      return chunk;
+    }
+
+    void release_chunk(Chunk* chunk) {
+      _stats.chunks--;
+      _stats.retained -= chunk->size;
+      _stats.released += chunk->size;
+      size_t cls = size_class(chunk);
+      if (cls >= SIZE_CLASSES || !Pool::give(chunk, cls)) {
+        free(chunk);
+      }
+    }
+
+    void enter(Chunk* chunk) {
+      _current = chunk;
+      _ptr = chunk->data;
+      _left = chunk->usable_size();
+    }
+
+    void* alloc_large(size_t size, size_t align) {
+      Chunk* chunk = new_chunk(sizeof(Chunk) + size + align);
+      chunk->next = _large;
+      _large = chunk;
+      _stats.large_allocs++;
+      _stats.retained += chunk->size;
+
+      size_t align_padding = align_pad(chunk->data, align);
+      _stats.allocated += size;
+      _stats.wasted += align_padding;
+      return chunk->data + align_padding;
+    }
+
+    void* alloc_slow(size_t size, size_t align) {
+      if (size > LARGE_SIZE) {
+        return alloc_large(size, align);
+      }
+
+      _stats.wasted += _left;
+
+      // Reuse chunks retained by dealloc_all before growing
+      while (_current->next) {
+        enter(_current->next);
+        if (align_pad(_ptr, align) + size <= _left) {
+          return alloc(size, align);
+        }
+        _stats.wasted += _left;
+      }
+
+      size_t cls = std::min(size_class(_current) + 1, SIZE_CLASSES - 1);
+      Chunk* chunk = acquire_chunk(cls);
+      _current->next = chunk;
+      enter(chunk);
+      return alloc(size, align);
+    }
   public:
     ArenaAllocator() {
-      _first = (Chunk*) malloc(CHUNK_SIZE);
-      new (_first) Chunk();
-      _current = _first;
+      _first = acquire_chunk(0);
+      enter(_first);
     }
 
+    ArenaAllocator(const ArenaAllocator&) = delete;
+    ArenaAllocator& operator=(const ArenaAllocator&) = delete;
+
     ~ArenaAllocator() {
+      free_large();
       Chunk* chunk = _first;
       while (chunk) {
         Chunk* next = chunk->next;
-        free(chunk);
+        release_chunk(chunk);
         chunk = next;
       }
     }
 
-    void* alloc(size_t size, size_t align) {
-      assert(size <= USABLE_SIZE);
+    const Stats& stats() const { return _stats; }
 
+    void* alloc(size_t size, size_t align) {
       size_t align_padding = align_pad(_ptr, align);
 
-      if (__builtin_expect(_left - align_padding < size, 0)) {
-        if (_current->next) {
-          _current = _current->next;
-        } else {
-          Chunk* chunk = (Chunk*) malloc(CHUNK_SIZE);
-          new (chunk) Chunk();
-          _current->next = chunk;
-          _current = chunk;  
-        }
-        _left = USABLE_SIZE;
-        _ptr = _current->data;
-        align_padding = align_pad(_ptr, align);
+      if (__builtin_expect(align_padding + size > _left, 0)) {
+        return alloc_slow(size, align);
       }
 
       _ptr += align_padding;
-      _left -= align_padding;
       void* ptr = (void*) _ptr;
       _ptr += size;
-      _left -= size; 
+      _left -= align_padding + size;
+      _stats.allocated += size;
+      _stats.wasted += align_padding;
       return ptr;
     }
 
@@ -107,20 +264,47 @@ namespace metajit {
       return (T*) alloc(sizeof(T), alignof(T));
     }
 
+    // Keeps chunks up to the high water mark for reuse and releases the rest
     void dealloc_all() {
-      _current = _first;
-      _ptr = _first->data;
-      _left = USABLE_SIZE;
+      free_large();
+
+      size_t kept = _first->size;
+      Chunk* chunk = _first;
+      while (chunk->next) {
+        if (kept + chunk->next->size > HIGH_WATER_MARK) {
+          Chunk* cold = chunk->next;
+          chunk->next = cold->next;
+          release_chunk(cold);
+        } else {
+          kept += chunk->next->size;
+          chunk = chunk->next;
+        }
+      }
+
+      enter(_first);
+      _stats.allocated = 0;
+      _stats.wasted = 0;
     }
 
     void zero_all() {
+      free_large();
       Chunk* chunk = _first;
       while (chunk) {
-        std::memset(chunk->data, 0, USABLE_SIZE);
+        std::memset(chunk->data, 0, chunk->usable_size());
         chunk = chunk->next;
       }
       dealloc_all();
     }
+  private:
+    void free_large() {
+      while (_large) {
+        Chunk* next = _large->next;
+        _stats.retained -= _large->size;
+        _stats.released += _large->size;
+        free(_large);
+        _large = next;
+      }
+    }
   };
 
   // WARNING: Does not deallocate, only use for testing
@@ -304,6 +488,11 @@ namespace metajit {
     Natural, // Topological sort except for backedges in natural loops
     Topological // Full topological sort
   };
+
+  enum class BlockLayout {
+    Default,
+    ColdTail // Blocks ending in a side exit are placed after all other blocks
+  };
 }
 
 std::ostream& operator<<(std::ostream& stream, metajit::Type type) {
@@ -348,15 +537,31 @@ std::ostream& operator<<(std::ostream& stream, metajit::BlockOrdering ordering)
 }
 
 namespace metajit {
+  /* ${inst_list} */
+
+  enum class Opcode : uint8_t {
+    #define inst(name, class_name) name,
+    jitir_insts(inst)
+    #undef inst
+  };
+
+  enum class ValueKind : uint8_t {
+    Const, Poison, Symbol, Arg, Inst
+  };
+
   class Value {
   private:
+    ValueKind _kind;
     Type _type;
   public:
-    Value(Type type): _type(type) {}
+    Value(ValueKind kind, Type type): _kind(kind), _type(type) {}
     virtual ~Value() {}
 
+    ValueKind kind() const { return _kind; }
     Type type() const { return _type; }
 
+    static bool classof(const Value*) { return true; }
+
     virtual void write_arg(PrettyStream& stream) const = 0;
     virtual void write_arg_json(std::ostream& stream) const = 0;
 
@@ -368,20 +573,45 @@ namespace metajit {
     virtual bool equals(const Value* other) const = 0;
     virtual size_t hash() const = 0;
 
-    virtual bool is_inst() const { return false; }
-    virtual bool is_named() const { return false; }
+    bool is_inst() const { return _kind == ValueKind::Inst; }
+    bool is_named() const { return _kind == ValueKind::Arg || _kind == ValueKind::Inst; }
   };
 
+  // Checked casts using the kind and opcode tags instead of RTTI.
+  // Every subclass of Value provides a static classof predicate.
+  template <class T>
+  bool isa(const Value* value) {
+    return std::remove_const_t<T>::classof(value);
+  }
+
+  template <class T, class V>
+  T* cast(V* value) {
+    using Base = std::conditional_t<std::is_const_v<V>, const Value, Value>;
+    assert(value && isa<T>(value));
+    return static_cast<T*>(static_cast<Base*>(value));
+  }
+
+  template <class T, class V>
+  T* dyn_cast(V* value) {
+    using Base = std::conditional_t<std::is_const_v<V>, const Value, Value>;
+    if (value == nullptr || !isa<T>(value)) {
+      return nullptr;
+    }
+    return static_cast<T*>(static_cast<Base*>(value));
+  }
+
   class Const final: public Value {
   private:
     uint64_t _value = 0;
   public:
-    Const(Type type, uint64_t value): Value(type), _value(value) {
+    Const(Type type, uint64_t value): Value(ValueKind::Const, type), _value(value) {
       assert(type != Type::Void);
       assert((value & ~type_mask(type)) == 0);
     }
     uint64_t value() const { return _value; }
 
+    static bool classof(const Value* value) { return value->kind() == ValueKind::Const; }
+
     void write_arg(PrettyStream& stream) const override {
       stream << Highlight::Constant << _value << ":" << type() << Highlight::None;
     }
@@ -395,7 +625,7 @@ namespace metajit {
     }
 
     bool equals(const Value* other) const override {
-      if (typeid(*this) != typeid(*other)) {
+      if (other->kind() != ValueKind::Const) {
         return false;
       }
 
@@ -411,10 +641,12 @@ namespace metajit {
 
   class Poison final: public Value {
   public:
-    Poison(Type type): Value(type) {
+    Poison(Type type): Value(ValueKind::Poison, type) {
       assert(type != Type::Void);
     }
 
+    static bool classof(const Value* value) { return value->kind() == ValueKind::Poison; }
+
     void write_arg(PrettyStream& stream) const override {
       stream << Highlight::Constant << "poison:" << type() << Highlight::None;
     }
@@ -427,7 +659,7 @@ namespace metajit {
     }
 
     bool equals(const Value* other) const override {
-      if (typeid(*this) != typeid(*other)) {
+      if (other->kind() != ValueKind::Poison) {
         return false;
       }
 
@@ -445,10 +677,12 @@ namespace metajit {
   private:
     lwir::Span<const char> _symbol;
   public:
-    Symbol(Type type, const lwir::Span<const char>& symbol): Value(type), _symbol(symbol) {
+    Symbol(Type type, const lwir::Span<const char>& symbol): Value(ValueKind::Symbol, type), _symbol(symbol) {
       assert(type != Type::Void);
     }
 
+    static bool classof(const Value* value) { return value->kind() == ValueKind::Symbol; }
+
     const lwir::Span<const char>& symbol() const { return _symbol; }
 
     void write_arg(PrettyStream& stream) const override {
@@ -464,7 +698,7 @@ namespace metajit {
     }
 
     bool equals(const Value* other) const override {
-      if (typeid(*this) != typeid(*other)) {
+      if (other->kind() != ValueKind::Symbol) {
         return false;
       }
 
@@ -483,22 +717,93 @@ namespace metajit {
     }
   };
 
+  // Constants and poison values are interned, so equal values share one object
   class Context {
+  public:
+    static constexpr size_t TYPE_COUNT = size_t(Type::Ptr) + 1;
+    static constexpr uint64_t SMALL_CONST_COUNT = 16;
   private:
     Allocator _allocator;
+
+    Const* _small_consts[TYPE_COUNT][SMALL_CONST_COUNT] = {};
+    Poison* _poisons[TYPE_COUNT] = {};
+
+    // Open addressing table with linear probing, the size is a power of two
+    std::vector<Const*> _consts;
+    size_t _const_count = 0;
+
+    static size_t hash_const(Type type, uint64_t value) {
+      uint64_t hash = (value ^ (uint64_t(type) << 56)) * 0x9e3779b97f4a7c15;
+      return hash ^ (hash >> 32);
+    }
+
+    void grow_consts() {
+      std::vector<Const*> consts(std::max(_consts.size() * 2, size_t(64)), nullptr);
+      size_t mask = consts.size() - 1;
+      for (Const* constant : _consts) {
+        if (constant) {
+          size_t it = hash_const(constant->type(), constant->value()) & mask;
+          while (consts[it]) {
+            it = (it + 1) & mask;
+          }
+          consts[it] = constant;
+        }
+      }
+      _consts = std::move(consts);
+    }
+
+    Const* alloc_const(Type type, uint64_t value) {
+      return new (_allocator.alloc<Const>()) Const(type, value);
+    }
   public:
     Context() {}
 
     Allocator& allocator() { return _allocator; }
 
     Const* build_const(Type type, uint64_t value) {
-      return new (_allocator.alloc<Const>()) Const(type, value & type_mask(type));
+      value &= type_mask(type);
+      if (value < SMALL_CONST_COUNT) {
+        return build_small_const(type, value);
+      }
+
+      if ((_const_count + 1) * 2 > _consts.size()) {
+        grow_consts();
+      }
+
+      size_t mask = _consts.size() - 1;
+      for (size_t it = hash_const(type, value) & mask; ; it = (it + 1) & mask) {
+        Const* constant = _consts[it];
+        if (!constant) {
+          constant = alloc_const(type, value);
+          _consts[it] = constant;
+          _const_count++;
+          return constant;
+        } else if (constant->type() == type && constant->value() == value) {
+          return constant;
+        }
+      }
+    }
+
+    // Value must already be masked to the type and smaller than SMALL_CONST_COUNT
+    Const* build_small_const(Type type, uint64_t value) {
+      assert(value < SMALL_CONST_COUNT && (value & ~type_mask(type)) == 0);
+      Const*& constant = _small_consts[size_t(type)][value];
+      if (!constant) {
+        constant = alloc_const(type, value);
+      }
+      return constant;
     }
 
     Poison* build_poison(Type type) {
-      return new (_allocator.alloc<Poison>()) Poison(type);
+      Poison*& poison = _poisons[size_t(type)];
+      if (!poison) {
+        poison = new (_allocator.alloc<Poison>()) Poison(type);
+      }
+      return poison;
     }
 
+    size_t const_count() const { return _const_count; }
+
     const char* alloc_string(const std::string& string) {
       char* data = (char*) _allocator.alloc(string.size() + 1, alignof(char));
       std::copy(string.data(), string.data() + string.size(), data);
@@ -525,7 +830,9 @@ namespace metajit {
   private:
     size_t _name = 0;
   public:
-    NamedValue(Type type): Value(type) {}
+    NamedValue(ValueKind kind, Type type): Value(kind, type) {}
+
+    static bool classof(const Value* value) { return value->is_named(); }
 
     size_t name() const { return _name; }
     void set_name(size_t name) { _name = name; }
@@ -539,18 +846,19 @@ namespace metajit {
     }
 
     using Value::write_arg;
-
-    bool is_named() const override {
-      return true;
-    }
   };
 
   class Inst: public NamedValue, public lwir::LinkedListItem<Inst> {
   private:
+    Opcode _opcode;
     lwir::Span<Value*> _args;
   public:
-    Inst(Type type, const lwir::Span<Value*>& args):
-      NamedValue(type), _args(args) {}
+    Inst(Opcode opcode, Type type, const lwir::Span<Value*>& args):
+      NamedValue(ValueKind::Inst, type), _opcode(opcode), _args(args) {}
+
+    Opcode opcode() const { return _opcode; }
+
+    static bool classof(const Value* value) { return value->is_inst(); }
 
     const lwir::Span<Value*>& args() const { return _args; }
     void set_args(const lwir::Span<Value*>& args) { _args = args; }
@@ -628,8 +936,6 @@ namespace metajit {
     bool has_side_effect() const;
     bool is_terminator() const;
     std::vector<Block*> successor_blocks() const;
-
-    bool is_inst() const override { return true; }
   };
 
   class Arg: public NamedValue {
@@ -637,10 +943,12 @@ namespace metajit {
     size_t _index = 0;
   public:
     Arg(Type type, size_t index):
-      NamedValue(type), _index(index) {}
+      NamedValue(ValueKind::Arg, type), _index(index) {}
 
     size_t index() const { return _index; }
 
+    static bool classof(const Value* value) { return value->kind() == ValueKind::Arg; }
+
     void write_json(std::ostream& stream) const {
       stream << "{";
       stream << "\"kind\": \"Arg\", ";
@@ -651,7 +959,7 @@ namespace metajit {
     }
 
     bool equals(const Value* other) const override {
-      if (typeid(*this) != typeid(*other)) {
+      if (other->kind() != ValueKind::Arg) {
         return false;
       }
 
@@ -680,6 +988,7 @@ namespace metajit {
     lwir::Span<Arg*> _args;
     lwir::LinkedList<Inst> _insts;
     size_t _name = 0;
+    bool _names_dirty = true;
   public:
     Block() {}
     Block(const lwir::Span<Arg*>& args): _args(args) {}
@@ -696,20 +1005,41 @@ namespace metajit {
     bool empty() const { return _insts.empty(); }
 
     const lwir::Span<Arg*>& args() const { return _args; }
-    void set_args(const lwir::Span<Arg*>& args) { _args = args; }
+
+    void set_args(const lwir::Span<Arg*>& args) {
+      _args = args;
+      _names_dirty = true;
+    }
 
     Arg* arg(size_t index) const { return _args.at(index); }
-    void set_arg(size_t index, Arg* arg) { _args[index] = arg; }
+
+    void set_arg(size_t index, Arg* arg) {
+      _args[index] = arg;
+      _names_dirty = true;
+    }
 
     size_t name() const { return _name; }
     void set_name(size_t name) { _name = name; }
 
+    // Removing values keeps the remaining names unique and ordered, so only
+    // insertions require renaming.
+    bool names_dirty() const { return _names_dirty; }
+    void invalidate_names() { _names_dirty = true; }
+
     void insert_before(Inst* before, Inst* inst) {
       _insts.insert_before(before, inst);
+      _names_dirty = true;
+    }
+
+    void add(Inst* inst) {
+      _insts.add(inst);
+      _names_dirty = true;
     }
 
-    void add(Inst* inst) { _insts.add(inst); }
-    void add(Inst* first, Inst* last) { _insts.add(first, last); }
+    void add(Inst* first, Inst* last) {
+      _insts.add(first, last);
+      _names_dirty = true;
+    }
     
     void remove(Inst* inst) { _insts.remove(inst); }
     void remove(Inst* first, Inst* last) { _insts.remove(first, last); }
@@ -725,6 +1055,8 @@ namespace metajit {
       for (Inst* inst : _insts) {
         inst->set_name(next_name++);
       }
+
+      _names_dirty = false;
     }
 
     void write_header(PrettyStream& stream) {
@@ -949,15 +1281,46 @@ namespace metajit {
 
   /* ${insts} */
 
+  // Calls fn with the instruction cast to its concrete class
+  template <class Fn>
+  decltype(auto) visit_inst(Inst* inst, Fn&& fn) {
+    switch (inst->opcode()) {
+      #define inst(name, class_name) case Opcode::name: return fn(static_cast<class_name*>(inst));
+      jitir_insts(inst)
+      #undef inst
+    }
+    assert(false && "Unknown opcode");
+    __builtin_unreachable();
+  }
+
+  inline bool has_side_effect(Opcode opcode) {
+    switch (opcode) {
+      case Opcode::Store:
+      case Opcode::Call:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  inline bool is_terminator(Opcode opcode) {
+    switch (opcode) {
+      case Opcode::Branch:
+      case Opcode::Jump:
+      case Opcode::Exit:
+      case Opcode::SideExit:
+        return true;
+      default:
+        return false;
+    }
+  }
+
   bool Inst::has_side_effect() const {
-    return dynamic_cast<const StoreInst*>(this) ||
-           dynamic_cast<const CallInst*>(this);
+    return metajit::has_side_effect(_opcode);
   }
 
   bool Inst::is_terminator() const {
-    return dynamic_cast<const BranchInst*>(this) ||
-           dynamic_cast<const JumpInst*>(this) ||
-           dynamic_cast<const ExitInst*>(this);
+    return metajit::is_terminator(_opcode);
   }
 
   std::vector<Block*> Inst::successor_blocks() const {
@@ -1005,6 +1368,8 @@ namespace metajit {
     BlockOrdering _ordering = BlockOrdering::Natural;
     size_t _block_count = 0;
     size_t _name_count = 0;
+    bool _names_dirty = true;
+    size_t _name_generation = 0;
   public:
     Section(Context& context, Allocator& allocator):
       _context(context), _allocator(allocator) {}
@@ -1026,26 +1391,63 @@ namespace metajit {
     size_t block_count() const { return _block_count; }
     size_t name_count() const { return _name_count; }
 
-    void add(Block* block) { _blocks.add(block); }
-    void remove(Block* block) { _blocks.remove(block); }
+    size_t name_generation() const { return _name_generation; }
+
+    void add(Block* block) {
+      _blocks.add(block);
+      _names_dirty = true;
+    }
+
+    // Leaves a gap in the block names, so the next autoname() renames
+    void remove(Block* block) {
+      _blocks.remove(block);
+      _names_dirty = true;
+    }
 
     void insert_before(Block* before, Block* block) {
       _blocks.insert_before(before, block);
+      _names_dirty = true;
     }
 
+    bool names_dirty() const {
+      if (_names_dirty) {
+        return true;
+      }
+      for (Block* block : _blocks) {
+        if (block->names_dirty()) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void invalidate_names() { _names_dirty = true; }
+
+    // Only renames if blocks were inserted or removed, or values were inserted
+    // since the last call.
+    // Names and name_count() stay stable otherwise, so NameMaps remain valid.
     void autoname() {
+      if (names_dirty()) {
+        rename();
+      }
+    }
+
+    void rename() {
       _name_count = 0;
       _block_count = 0;
       for (Block* block : _blocks) {
         block->set_name(_block_count++);
         block->autoname(_name_count);
       }
+      _names_dirty = false;
+      _name_generation++;
     }
 
-    void order_blocks(BlockOrdering target_ordering = BlockOrdering::Natural);
+    void order_blocks(BlockOrdering target_ordering = BlockOrdering::Natural,
+                      BlockLayout layout = BlockLayout::Default);
 
     void write(PrettyStream& stream, InfoWriter* info_writer = nullptr) {
-      autoname();
+      rename(); // Removed values would leave gaps in the output
       
       stream << "section {\n";
       for (Block* block : _blocks) {
@@ -1060,7 +1462,7 @@ namespace metajit {
     }
 
     void write_json(std::ostream& stream) {
-      autoname();
+      rename();
 
       stream << "{";
       stream << "\"blocks\": [";
@@ -1243,10 +1645,10 @@ namespace metajit {
       return _section->context().build_const(type, value);
     }
 
+    // Value must already be masked to the type
     Const* build_const_fast(Type type, uint64_t value) {
-      Const* constant = _section->allocator().alloc<Const>();
-      new (constant) Const(type, value);
-      return constant;
+      assert((value & ~type_mask(type)) == 0);
+      return _section->context().build_const(type, value);
     }
 
     #define define_build_const(name) \
@@ -1453,7 +1855,7 @@ namespace metajit {
   public:
 
     Value* fold_add(Value* a, Value* b) {
-      if (dynamic_cast<Const*>(a)) {
+      if (dyn_cast<Const>(a)) {
         std::swap(a, b);
       }
 
@@ -1496,7 +1898,7 @@ namespace metajit {
     }
 
     Value* fold_mul(Value* a, Value* b) {
-      if (dynamic_cast<Const*>(a)) {
+      if (dyn_cast<Const>(a)) {
         std::swap(a, b);
       }
 
@@ -1543,7 +1945,7 @@ namespace metajit {
     }
 
     Value* fold_and(Value* a, Value* b) {
-      if (dynamic_cast<Const*>(a)) {
+      if (dyn_cast<Const>(a)) {
         std::swap(a, b);
       }
 
@@ -1587,7 +1989,7 @@ namespace metajit {
     }
 
     Value* fold_or(Value* a, Value* b) {
-      if (dynamic_cast<Const*>(a)) {
+      if (dyn_cast<Const>(a)) {
         std::swap(a, b);
       }
 
@@ -1621,7 +2023,7 @@ namespace metajit {
     }
   
     Value* fold_xor(Value* a, Value* b) {
-      if (dynamic_cast<Const*>(a)) {
+      if (dyn_cast<Const>(a)) {
         std::swap(a, b);
       }
 
@@ -1645,7 +2047,7 @@ namespace metajit {
     }
 
     Value* fold_eq(Value* a, Value* b) {
-      if (dynamic_cast<Const*>(a)) {
+      if (dyn_cast<Const>(a)) {
         std::swap(a, b);
       }
 
@@ -2051,6 +2453,46 @@ namespace metajit {
     auto end() { return _data.end(); }
   };
 
+  // Fixed size set of dense indices, used by liveness analyses
+  class BitVector {
+  private:
+    std::vector<uint64_t> _words;
+    size_t _size = 0;
+  public:
+    BitVector() {}
+    BitVector(size_t size): _words((size + 63) / 64, 0), _size(size) {}
+
+    void assign(size_t size, bool value) {
+      _size = size;
+      _words.assign((size + 63) / 64, value ? ~uint64_t(0) : 0);
+    }
+
+    void set(size_t idx) { _words[idx / 64] |= uint64_t(1) << (idx % 64); }
+    void clear(size_t idx) { _words[idx / 64] &= ~(uint64_t(1) << (idx % 64)); }
+    bool test(size_t idx) const { return (_words[idx / 64] >> (idx % 64)) & 1; }
+
+    void or_with(const BitVector& other) {
+      for (size_t w = 0; w < _words.size(); w++) {
+        _words[w] |= other._words[w];
+      }
+    }
+
+    // Calls fn with the index of each set bit in ascending order
+    template <class Fn>
+    void for_each(const Fn& fn) const {
+      for (size_t w = 0; w < _words.size(); w++) {
+        uint64_t word = _words[w];
+        while (word != 0) {
+          fn(w * 64 + __builtin_ctzll(word));
+          word &= word - 1;
+        }
+      }
+    }
+
+    bool operator==(const BitVector& other) const { return _words == other._words; }
+    bool operator!=(const BitVector& other) const { return _words != other._words; }
+  };
+
   // A chain is a sequence of blocks where each block is the idom of the next one.
   // Chains essentially form extended basic blocks. Note that traces are chains.
   class Chain {
@@ -2078,6 +2520,33 @@ namespace metajit {
   };
 
   class TraceBuilder: public Builder {
+  public:
+    // Values which must be written back to the interpreter state when
+    // leaving the trace through a side exit.
+    struct Snapshot {
+      struct Entry {
+        Value* ptr = nullptr;
+        uint64_t offset = 0;
+        AliasingGroup aliasing = 0;
+        Value* value = nullptr;
+      };
+
+      std::vector<Entry> entries;
+
+      Snapshot() {}
+
+      void add(Value* ptr, Value* value, AliasingGroup aliasing, uint64_t offset) {
+        entries.push_back(Entry { ptr, offset, aliasing, value });
+      }
+
+      size_t size() const { return entries.size(); }
+    };
+
+    struct SideExit {
+      uint32_t id = 0;
+      Block* block = nullptr;
+      Snapshot snapshot;
+    };
   private:
     // We perform optimizations during trace generation
     
@@ -2121,6 +2590,7 @@ namespace metajit {
     ExpandingVector<Value*> _exact_memory;
 
     std::unordered_map<Value*, bool> _guards;
+    std::vector<SideExit> _side_exits;
 
     bool could_alias(LoadInst* load, Value* ptr, Type type, AliasingGroup aliasing, uint64_t offset) {
       if (load->aliasing() != aliasing) {
@@ -2350,7 +2820,11 @@ namespace metajit {
       return block;
     }
 
-    void build_guard(Value* value, bool expected) {
+    const std::vector<SideExit>& side_exits() const { return _side_exits; }
+
+    // Returns the id of the side exit taken if the guard fails, or 0 if the
+    // guard is known to hold.
+    uint32_t build_guard(Value* value, bool expected, const Snapshot& snapshot = Snapshot()) {
       assert(value->type() == Type::Bool);
 
       if (XorInst* xor_inst = is_not(value)) {
@@ -2367,7 +2841,7 @@ namespace metajit {
 
       if (known_value.has_value()) {
         if (known_value.value() == expected) {
-          return; // Always true
+          return 0; // Always true
         } else {
           // Always false
           assert(false && "Unreachable code due to guard");
@@ -2387,9 +2861,17 @@ namespace metajit {
       build_branch(value, a, b);
       
       move_to_end(failure);
-      build_exit();
+      // The exit stub bypasses store forwarding, the trace state at the guard
+      // is unrelated to what is written back.
+      for (const Snapshot::Entry& entry : snapshot.entries) {
+        Builder::build_store(entry.ptr, entry.value, entry.aliasing, entry.offset);
+      }
+      uint32_t id = _side_exits.size() + 1;
+      build_side_exit(id);
+      _side_exits.push_back(SideExit { id, failure, snapshot });
 
       move_to_end(success);
+      return id;
     }
 
     void init_store(Value* ptr, Value* value, AliasingGroup aliasing, uint64_t offset) {
@@ -2803,7 +3285,7 @@ namespace metajit {
           }
         } else {
           if (dynmatch(Inst, inst, value)) {
-            if (!inst->has_side_effect() && !inst->is_terminator() && !dynamic_cast<CommentInst*>(inst)) {
+            if (!inst->has_side_effect() && !inst->is_terminator() && !dyn_cast<CommentInst>(inst)) {
               error("Instructions without side effects must be named");
             }
             if (inst->has_side_effect() && inst->type() != Type::Void) {
@@ -2820,6 +3302,154 @@ namespace metajit {
     }
   };
 
+  // Compact read-only copy of a section for analyses. Values are referred to
+  // by 32-bit ids: instructions by their position in a contiguous array,
+  // block arguments and constants through tagged ids into side tables.
+  // Attributes are read from the original instruction through inst().
+  // It is a temporary copy next to the pointer IR: X86CodeGen builds one per
+  // run for memory_deps, isel and layout_allocas, LLVMCodeGen does not use it.
+  class FrozenSection {
+  public:
+    using Id = uint32_t;
+
+    static constexpr uint32_t TAG_SHIFT = 30;
+    static constexpr uint32_t TAG_INST = 0;
+    static constexpr uint32_t TAG_ARG = 1;
+    static constexpr uint32_t TAG_VALUE = 2;
+    static constexpr uint32_t INDEX_MASK = (uint32_t(1) << TAG_SHIFT) - 1;
+
+    struct FrozenInst {
+      static constexpr size_t INLINE_ARGS = 3;
+
+      Opcode opcode;
+      uint8_t type;
+      uint16_t arg_count;
+      // Larger argument lists store their offset into the operand pool in args[0]
+      Id args[INLINE_ARGS];
+
+      Type value_type() const { return Type(type); }
+    };
+
+    static_assert(sizeof(FrozenInst) == 16);
+
+    struct FrozenBlock {
+      Block* block = nullptr;
+      uint32_t first_arg = 0;
+      uint32_t arg_count = 0;
+      uint32_t first_inst = 0;
+      uint32_t inst_count = 0;
+    };
+  private:
+    Section* _section;
+
+    std::vector<FrozenInst> _insts;
+    std::vector<Id> _operands;
+    std::vector<FrozenBlock> _blocks;
+
+    std::vector<Inst*> _inst_values;
+    std::vector<Arg*> _arg_values;
+    std::vector<Value*> _values;
+  public:
+    FrozenSection(Section* section): _section(section) {
+      section->autoname();
+
+      // Args and instructions share the name space
+      std::vector<Id> ids(section->name_count());
+      _blocks.reserve(section->block_count());
+      _insts.reserve(section->name_count());
+      _inst_values.reserve(section->name_count());
+
+      for (Block* block : *section) {
+        FrozenBlock frozen_block;
+        frozen_block.block = block;
+        frozen_block.first_arg = _arg_values.size();
+        frozen_block.arg_count = block->args().size();
+        for (Arg* arg : block->args()) {
+          ids[arg->name()] = make_id(TAG_ARG, _arg_values.size());
+          _arg_values.push_back(arg);
+        }
+
+        frozen_block.first_inst = _insts.size();
+        for (Inst* inst : *block) {
+          ids[inst->name()] = make_id(TAG_INST, _insts.size());
+          _inst_values.push_back(inst);
+          _insts.emplace_back();
+        }
+        frozen_block.inst_count = _insts.size() - frozen_block.first_inst;
+        _blocks.push_back(frozen_block);
+      }
+
+      // Constants and poison values are interned, but symbols are not
+      std::unordered_map<Value*, Id> value_ids;
+      for (size_t index = 0; index < _insts.size(); index++) {
+        Inst* inst = _inst_values[index];
+        FrozenInst& frozen = _insts[index];
+        assert(inst->arg_count() <= UINT16_MAX);
+        frozen.opcode = inst->opcode();
+        frozen.type = uint8_t(inst->type());
+        frozen.arg_count = inst->arg_count();
+
+        Id* args = frozen.args;
+        if (inst->arg_count() > FrozenInst::INLINE_ARGS) {
+          frozen.args[0] = _operands.size();
+          _operands.resize(_operands.size() + inst->arg_count());
+          args = _operands.data() + frozen.args[0];
+        }
+
+        for (size_t it = 0; it < inst->arg_count(); it++) {
+          Value* arg = inst->arg(it);
+          if (arg->is_named()) {
+            args[it] = ids[((NamedValue*) arg)->name()];
+          } else if (value_ids.find(arg) != value_ids.end()) {
+            args[it] = value_ids.at(arg);
+          } else {
+            Id id = make_id(TAG_VALUE, _values.size());
+            _values.push_back(arg);
+            value_ids[arg] = id;
+            args[it] = id;
+          }
+        }
+      }
+    }
+
+    static Id make_id(uint32_t tag, size_t index) {
+      assert(index <= INDEX_MASK);
+      return (tag << TAG_SHIFT) | uint32_t(index);
+    }
+
+    static uint32_t id_tag(Id id) { return id >> TAG_SHIFT; }
+    static uint32_t id_index(Id id) { return id & INDEX_MASK; }
+    static bool is_inst(Id id) { return id_tag(id) == TAG_INST; }
+
+    Section* section() const { return _section; }
+
+    size_t inst_count() const { return _insts.size(); }
+    size_t block_count() const { return _blocks.size(); }
+
+    const std::vector<FrozenInst>& insts() const { return _insts; }
+    const FrozenInst& at(size_t index) const { return _insts[index]; }
+
+    const std::vector<FrozenBlock>& blocks() const { return _blocks; }
+    const FrozenBlock& block(size_t index) const { return _blocks[index]; }
+
+    lwir::Span<const Id> args(const FrozenInst& inst) const {
+      if (inst.arg_count > FrozenInst::INLINE_ARGS) {
+        return lwir::Span<const Id>(_operands.data() + inst.args[0], inst.arg_count);
+      }
+      return lwir::Span<const Id>(inst.args, inst.arg_count);
+    }
+
+    Inst* inst(size_t index) const { return _inst_values[index]; }
+
+    Value* value(Id id) const {
+      switch (id_tag(id)) {
+        case TAG_INST: return _inst_values[id_index(id)];
+        case TAG_ARG: return _arg_values[id_index(id)];
+        default: return _values[id_index(id)];
+      }
+    }
+  };
+
   template <class Self>
   class Pass {
   private:
@@ -2847,7 +3477,7 @@ namespace metajit {
           if (used[inst] ||
               inst->has_side_effect() ||
               inst->is_terminator() ||
-              dynamic_cast<CommentInst*>(inst)) {
+              dyn_cast<CommentInst>(inst)) {
             used[inst] = true;
             for (Value* arg : inst->args()) {
               if (arg->is_inst()) {
@@ -2996,7 +3626,7 @@ namespace metajit {
                 unused[store] = false;
               }
             }
-          } else if (dynamic_cast<CallInst*>(inst)) {
+          } else if (dyn_cast<CallInst>(inst)) {
             // Calls may observe memory from all exact groups.
             for (StoreInst*& store : last_store) {
               if (store) {
@@ -3357,9 +3987,9 @@ namespace metajit {
       }
 
       static Bits eval(Inst* inst, NameMap<Bits>& values) {
-        if (dynamic_cast<FreezeInst*>(inst) ||
-            dynamic_cast<PromoteInst*>(inst) ||
-            dynamic_cast<AssumeConstInst*>(inst)) {
+        if (dyn_cast<FreezeInst>(inst) ||
+            dyn_cast<PromoteInst>(inst) ||
+            dyn_cast<AssumeConstInst>(inst)) {
           return at(values, inst->arg(0));
         } else if (dynmatch(SelectInst, select, inst)) {
           Bits cond = at(values, select->cond());
@@ -3687,6 +4317,8 @@ namespace metajit {
     // Program Counter
     Block* _block = nullptr;
     Inst* _inst = nullptr;
+
+    uint32_t _exit_id = 0;
   public:
     Interpreter(Section* section, const std::vector<Bits>& entry_args):
         _section(section) {
@@ -3705,6 +4337,8 @@ namespace metajit {
     Section* section() const { return _section; }
     Block* block() const { return _block; }
     Inst* inst() const { return _inst; }
+    // Id of the side exit taken, or 0 after a normal exit
+    uint32_t exit_id() const { return _exit_id; }
 
     enum class Event {
       None, Exit, EnterBlock
@@ -3743,118 +4377,142 @@ namespace metajit {
     }
 
     Event step() {
-      if (dynmatch(LoadInst, load, _inst)) {
-        Bits ptr_bits = at(load->ptr());
-        assert(!ptr_bits.is_poison);
-        uint8_t* ptr = (uint8_t*) ptr_bits.value + load->offset();
-        _values[load] = Bits::load(ptr, load->type());
-      } else if (dynmatch(StoreInst, store, _inst)) {
-        Bits ptr_bits = at(store->ptr());
-        Bits value_bits = at(store->value());
-        assert(!ptr_bits.is_poison);
-        uint8_t* ptr = (uint8_t*) ptr_bits.value + store->offset();
-        value_bits.store(ptr);
-        _values[store] = Bits();
-      } else if (dynmatch(AllocaInst, alloca_inst, _inst)) {
-        Bits size_bits = at(alloca_inst->size());
-        assert(!size_bits.is_poison);
-
-        size_t size = size_bits.value;
-        assert(size > 0 && "Alloca size must be non-zero");
-
-        uint8_t* allocation = new uint8_t[size];
-        _alloca_storage.push_back(allocation);
-        _values[alloca_inst] = Bits::constant(Type::Ptr, (uint64_t) (uintptr_t) allocation);
-      } else if (dynmatch(JumpInst, jump, _inst)) {
-        std::vector<Bits> args;
-        for (Value* arg : jump->args()) {
-          args.push_back(at(arg));
-        }
-        enter(jump->block(), args);
-        return Event::EnterBlock;
-      } else if (dynmatch(BranchInst, branch, _inst)) {
-        Bits cond = at(branch->cond());
-        assert(!cond.is_poison);
-        if (cond.value != 0) {
-          enter(branch->true_block(), {});
-        } else {
-          enter(branch->false_block(), {});
-        }
-        return Event::EnterBlock;
-      } else if (dynmatch(ExitInst, exit, _inst)) {
-        return Event::Exit;
-      } else if (dynamic_cast<PromoteInst*>(_inst) ||
-                 dynamic_cast<AssumeConstInst*>(_inst)) {
-        _values[_inst] = at(_inst->arg(0));
-      } else if (dynmatch(SelectInst, select, _inst)) {
-        Bits cond = at(select->cond());
-        Bits a = at(select->arg(1));
-        Bits b = at(select->arg(2));
-        _values[_inst] = cond.select(a, b);
-      } else if (dynmatch(ResizeUInst, resize_u, _inst)) {
-        Bits a = at(resize_u->arg(0));
-        _values[_inst] = a.resize_u(resize_u->type());
-      } else if (dynmatch(ResizeSInst, resize_u, _inst)) {
-        Bits a = at(resize_u->arg(0));
-        _values[_inst] = a.resize_s(resize_u->type());
-      } else if (dynmatch(ResizeXInst, resize_x, _inst)) {
-        Bits a = at(resize_x->arg(0));
-        _values[_inst] = a.resize_x(resize_x->type());
-      } else if (dynmatch(PtrToIntInst, ptr_to_int, _inst)) {
-        Bits a = at(ptr_to_int->arg(0));
-        _values[_inst] = a.ptr_to_int(ptr_to_int->type());
-      } else if (dynmatch(FreezeInst, freeze, _inst)) {
-        Bits a = at(freeze->arg(0));
-        // Poison is refined to a non-poison value, we choose zero in this case
-        if (a.is_poison) {
-          _values[_inst] = Bits::constant(a.type, 0);
-        } else {
-          _values[_inst] = a;
+      switch (_inst->opcode()) {
+        case Opcode::Load: {
+          LoadInst* load = (LoadInst*) _inst;
+          Bits ptr_bits = at(load->ptr());
+          assert(!ptr_bits.is_poison);
+          uint8_t* ptr = (uint8_t*) ptr_bits.value + load->offset();
+          _values[load] = Bits::load(ptr, load->type());
+          break;
         }
-      } else if (dynmatch(CommentInst, comment, _inst)) {
-        // Ignore comments
-      }
+        case Opcode::Store: {
+          StoreInst* store = (StoreInst*) _inst;
+          Bits ptr_bits = at(store->ptr());
+          Bits value_bits = at(store->value());
+          assert(!ptr_bits.is_poison);
+          uint8_t* ptr = (uint8_t*) ptr_bits.value + store->offset();
+          value_bits.store(ptr);
+          _values[store] = Bits();
+          break;
+        }
+        case Opcode::Alloca: {
+          AllocaInst* alloca_inst = (AllocaInst*) _inst;
+          Bits size_bits = at(alloca_inst->size());
+          assert(!size_bits.is_poison);
+
+          size_t size = size_bits.value;
+          assert(size > 0 && "Alloca size must be non-zero");
 
-      #define binop(name, expr) \
-        else if (dynamic_cast<name*>(_inst)) { \
-          Bits a = at(_inst->arg(0)); \
-          Bits b = at(_inst->arg(1)); \
-          _values[_inst] = expr; \
+          uint8_t* allocation = new uint8_t[size];
+          _alloca_storage.push_back(allocation);
+          _values[alloca_inst] = Bits::constant(Type::Ptr, (uint64_t) (uintptr_t) allocation);
+          break;
         }
-      
-      binop(AddPtrInst, a + b)
-      binop(AddInst, a + b)
-      binop(SubInst, a - b)
-      binop(MulInst, a * b)
-      binop(DivSInst, a.div_s(b))
-      binop(DivUInst, a.div_u(b))
-      binop(ModSInst, a.mod_s(b))
-      binop(ModUInst, a.mod_u(b))
-
-      binop(AndInst, a & b)
-      binop(OrInst, a | b)
-      binop(XorInst, a ^ b)
-      
-      binop(ShlInst, a.shl(b))
-      binop(ShrUInst, a.shr_u(b))
-      binop(ShrSInst, a.shr_s(b))
+        case Opcode::Jump: {
+          JumpInst* jump = (JumpInst*) _inst;
+          std::vector<Bits> args;
+          for (Value* arg : jump->args()) {
+            args.push_back(at(arg));
+          }
+          enter(jump->block(), args);
+          return Event::EnterBlock;
+        }
+        case Opcode::Branch: {
+          BranchInst* branch = (BranchInst*) _inst;
+          Bits cond = at(branch->cond());
+          assert(!cond.is_poison);
+          if (cond.value != 0) {
+            enter(branch->true_block(), {});
+          } else {
+            enter(branch->false_block(), {});
+          }
+          return Event::EnterBlock;
+        }
+        case Opcode::Exit:
+          _exit_id = 0;
+          return Event::Exit;
+        case Opcode::SideExit:
+          _exit_id = ((SideExitInst*) _inst)->id();
+          return Event::Exit;
+        case Opcode::Promote:
+        case Opcode::AssumeConst:
+          _values[_inst] = at(_inst->arg(0));
+          break;
+        case Opcode::Select: {
+          SelectInst* select = (SelectInst*) _inst;
+          Bits cond = at(select->cond());
+          Bits a = at(select->arg(1));
+          Bits b = at(select->arg(2));
+          _values[_inst] = cond.select(a, b);
+          break;
+        }
+        case Opcode::ResizeU:
+          _values[_inst] = at(_inst->arg(0)).resize_u(_inst->type());
+          break;
+        case Opcode::ResizeS:
+          _values[_inst] = at(_inst->arg(0)).resize_s(_inst->type());
+          break;
+        case Opcode::ResizeX:
+          _values[_inst] = at(_inst->arg(0)).resize_x(_inst->type());
+          break;
+        case Opcode::PtrToInt:
+          _values[_inst] = at(_inst->arg(0)).ptr_to_int(_inst->type());
+          break;
+        case Opcode::Freeze: {
+          Bits a = at(_inst->arg(0));
+          // Poison is refined to a non-poison value, we choose zero in this case
+          if (a.is_poison) {
+            _values[_inst] = Bits::constant(a.type, 0);
+          } else {
+            _values[_inst] = a;
+          }
+          break;
+        }
+        case Opcode::Comment:
+          break; // Ignore comments
 
-      binop(EqInst, a.eq(b))
-      binop(LtSInst, a.lt_s(b))
-      binop(LtUInst, a.lt_u(b))
+        #define binop(name, expr) \
+          case Opcode::name: { \
+            Bits a = at(_inst->arg(0)); \
+            Bits b = at(_inst->arg(1)); \
+            _values[_inst] = expr; \
+            break; \
+          }
+        
+        binop(AddPtr, a + b)
+        binop(Add, a + b)
+        binop(Sub, a - b)
+        binop(Mul, a * b)
+        binop(DivS, a.div_s(b))
+        binop(DivU, a.div_u(b))
+        binop(ModS, a.mod_s(b))
+        binop(ModU, a.mod_u(b))
+
+        binop(And, a & b)
+        binop(Or, a | b)
+        binop(Xor, a ^ b)
+        
+        binop(Shl, a.shl(b))
+        binop(ShrU, a.shr_u(b))
+        binop(ShrS, a.shr_s(b))
 
-      binop(AddFInst, a.add_f(b))
-      binop(SubFInst, a.sub_f(b))
-      binop(MulFInst, a.mul_f(b))
-      binop(DivFInst, a.div_f(b))
+        binop(Eq, a.eq(b))
+        binop(LtS, a.lt_s(b))
+        binop(LtU, a.lt_u(b))
 
-      binop(LtFUInst, a.lt_f_u(b))
-      binop(LtFOInst, a.lt_f_o(b))
+        binop(AddF, a.add_f(b))
+        binop(SubF, a.sub_f(b))
+        binop(MulF, a.mul_f(b))
+        binop(DivF, a.div_f(b))
 
-      #undef binop
-    
-      else {
-        assert(false && "Unsupported instruction in interpreter");
+        binop(LtFU, a.lt_f_u(b))
+        binop(LtFO, a.lt_f_o(b))
+
+        #undef binop
+
+        default:
+          assert(false && "Unsupported instruction in interpreter");
       }
 
       _inst = _inst->next();
@@ -3984,7 +4642,7 @@ namespace metajit {
               use(or_inst->arg(0), _values[inst]);
             }
             use(or_inst->arg(1), _values[inst]);
-          } else if (dynamic_cast<XorInst*>(inst)) {
+          } else if (dyn_cast<XorInst>(inst)) {
             // Element-wise instructions
             for (Value* arg : inst->args()) {
               use(arg, _values[inst]);
@@ -3995,9 +4653,9 @@ namespace metajit {
             }
             use(select->arg(1), _values[inst]);
             use(select->arg(2), _values[inst]);
-          } else if (dynamic_cast<AddInst*>(inst) ||
-                     dynamic_cast<SubInst*>(inst) ||
-                     dynamic_cast<MulInst*>(inst)) {
+          } else if (dyn_cast<AddInst>(inst) ||
+                     dyn_cast<SubInst>(inst) ||
+                     dyn_cast<MulInst>(inst)) {
             uint64_t used = _values[inst].used;
             for (size_t it = 1; it < 64; it *= 2) {
               used |= used >> it;
@@ -4005,15 +4663,15 @@ namespace metajit {
             for (Value* arg : inst->args()) {
               use(arg, used);
             }
-          } else if (dynamic_cast<ShrUInst*>(inst) ||
-                     dynamic_cast<ShrSInst*>(inst)) {
+          } else if (dyn_cast<ShrUInst>(inst) ||
+                     dyn_cast<ShrSInst>(inst)) {
             if (dynmatch(Const, const_b, inst->arg(1))) {
               if (const_b->value() < type_size(inst->type()) * 8) {
                 Bits result = _values[inst];
-                if (dynamic_cast<ShrUInst*>(inst)) {
+                if (dyn_cast<ShrUInst>(inst)) {
                   use(inst->arg(0), result.shr_u_arg_0(const_b->value()));
                 } else {
-                  assert (dynamic_cast<ShrSInst*>(inst));
+                  assert (dyn_cast<ShrSInst>(inst));
                   use(inst->arg(0), result.shr_s_arg_0(const_b->value()));
                 }
               } else {
@@ -4174,9 +4832,9 @@ namespace metajit {
               return or_inst->arg(1);
             }
           } else if (dynmatch(ResizeUInst, resize_u, inst)) {
-            if (dynamic_cast<ResizeXInst*>(resize_u->arg(0)) ||
-                dynamic_cast<ResizeUInst*>(resize_u->arg(0)) ||
-                dynamic_cast<ResizeSInst*>(resize_u->arg(0))) {
+            if (dyn_cast<ResizeXInst>(resize_u->arg(0)) ||
+                dyn_cast<ResizeUInst>(resize_u->arg(0)) ||
+                dyn_cast<ResizeSInst>(resize_u->arg(0))) {
 
               // ResizeU(ResizeX/U/S(arg)) => arg if all upper bits of arg are known
               // to be zero and the source type is equal to the target type
@@ -4222,8 +4880,8 @@ namespace metajit {
                 return or_inst->arg(0);
               }
             }
-          } else if (dynamic_cast<ResizeUInst*>(inst) ||
-                     dynamic_cast<ResizeSInst*>(inst)) {
+          } else if (dyn_cast<ResizeUInst>(inst) ||
+                     dyn_cast<ResizeSInst>(inst)) {
             UsedBits::Bits used = used_bits.at(inst);
             uint64_t mask = type_mask(inst->type()) & type_mask(inst->arg(0)->type());
             if ((used.used & ~mask) == 0) {
@@ -4244,7 +4902,7 @@ namespace metajit {
       Lookup(Value* _value): value(_value) {}
 
       bool operator==(const Lookup& other) const {
-        return value->equals(other.value);
+        return value == other.value || value->equals(other.value);
       }
     };
 
@@ -4292,7 +4950,7 @@ namespace metajit {
               }
             }
             valid_loads[store->aliasing()] = remaining_loads;
-          } else if (dynamic_cast<CallInst*>(inst)) {
+          } else if (dyn_cast<CallInst>(inst)) {
             // Calls can invalidate any cached memory-derived value.
             for (auto& [group, loads] : valid_loads) {
               for (LoadInst* load : loads) {
@@ -4304,8 +4962,8 @@ namespace metajit {
 
           if (inst->has_side_effect() ||
               inst->is_terminator() ||
-              dynamic_cast<CommentInst*>(inst) ||
-              dynamic_cast<AllocaInst*>(inst)) {
+              dyn_cast<CommentInst>(inst) ||
+              dyn_cast<AllocaInst>(inst)) {
             inst_it++;
             continue;
           }
@@ -4386,7 +5044,7 @@ namespace metajit {
 
       for (Block* block : *loop->chain()) {
         for (Inst* inst : *block) {
-          if (dynamic_cast<CallInst*>(inst)) {
+          if (dyn_cast<CallInst>(inst)) {
             // Conservative: calls can touch memory backing promoted aliases.
             return;
           }
@@ -4482,7 +5140,7 @@ namespace metajit {
             if (store->aliasing() < 0) {
               stores[-store->aliasing()] = 1;
             }
-          } else if (dynamic_cast<CallInst*>(inst)) {
+          } else if (dyn_cast<CallInst>(inst)) {
             has_unknown_memory_write = true;
           }
         }
@@ -4497,8 +5155,8 @@ namespace metajit {
 
           if (inst->has_side_effect() ||
               inst->is_terminator() ||
-              dynamic_cast<StoreInst*>(inst) ||
-              dynamic_cast<CommentInst*>(inst)) {
+              dyn_cast<StoreInst>(inst) ||
+              dyn_cast<CommentInst>(inst)) {
             inst_it++;
             continue;
           }
@@ -4697,10 +5355,10 @@ namespace metajit {
       assert(_section->ordering() >= BlockOrdering::Dominator);
       _compute_incoming(incoming);
 
+      removed.resize(_section->block_count(), false);
+      scheduled.resize(_section->block_count(), true);
       for (Block* block : *_section) {
         todo.push(block);
-        removed.push_back(false);
-        scheduled.push_back(true);
       }
 
       while (todo.size() > 0) {
@@ -4942,9 +5600,9 @@ namespace metajit {
             // inside the generating extension may be const even though
             // not all arguments are const. This means they need to be
             // in a separate group.
-            if (dynamic_cast<AndInst*>(inst) ||
-                dynamic_cast<OrInst*>(inst) ||
-                dynamic_cast<SelectInst*>(inst)) {
+            if (dyn_cast<AndInst>(inst) ||
+                dyn_cast<OrInst>(inst) ||
+                dyn_cast<SelectInst>(inst)) {
               if (group != ALWAYS) {
                 group = _next_group;
               }
@@ -4995,11 +5653,19 @@ namespace metajit {
       return at(value) == ALWAYS;
     }
 
+    // Names may have gaps after removals, so only live values are counted
     size_t count_static() const {
       size_t count = 0;
-      for (size_t name = 0; name < _section->name_count(); name++) {
-        if (_groups.at_name(name) == ALWAYS) {
-          count++;
+      for (Block* block : *_section) {
+        for (Arg* arg : block->args()) {
+          if (_groups.at(arg) == ALWAYS) {
+            count++;
+          }
+        }
+        for (Inst* inst : *block) {
+          if (_groups.at(inst) == ALWAYS) {
+            count++;
+          }
         }
       }
       return count;
@@ -5025,6 +5691,24 @@ namespace metajit {
     NameMap<bool> _can_trace_inst;
     NameMap<bool> _can_trace_const;
 
+    // Names may have gaps after removals, so only live values are counted
+    size_t count_live(const NameMap<bool>& map) const {
+      size_t count = 0;
+      for (Block* block : *_section) {
+        for (Arg* arg : block->args()) {
+          if (map.at(arg)) {
+            count++;
+          }
+        }
+        for (Inst* inst : *block) {
+          if (map.at(inst)) {
+            count++;
+          }
+        }
+      }
+      return count;
+    }
+
     void used_by(NamedValue* value, NamedValue* by) {
       if (_can_trace_inst.at(by)) {
         if (_binding_time_groups.at(by) != _binding_time_groups.at(value) ||
@@ -5044,8 +5728,8 @@ namespace metajit {
         }
       }
 
-      if (dynamic_cast<PromoteInst*>(by) ||
-          (dynamic_cast<AssumeConstInst*>(by) && !is_int_or_bool(value->type()))) {
+      if (dyn_cast<PromoteInst>(by) ||
+          (dyn_cast<AssumeConstInst>(by) && !is_int_or_bool(value->type()))) {
         _can_trace_inst[value] = true;
         _can_trace_const[value] = true;
       }
@@ -5063,9 +5747,9 @@ namespace metajit {
         for (Inst* inst : block->rev_range()) {
           if (inst->has_side_effect() ||
               inst->is_terminator() ||
-              dynamic_cast<PromoteInst*>(inst) ||
-              dynamic_cast<AssumeConstInst*>(inst) ||
-              dynamic_cast<CommentInst*>(inst)) {
+              dyn_cast<PromoteInst>(inst) ||
+              dyn_cast<AssumeConstInst>(inst) ||
+              dyn_cast<CommentInst>(inst)) {
             _can_trace_inst[inst] = true;
             _can_trace_const[inst] = true;
           }
@@ -5101,25 +5785,8 @@ namespace metajit {
       return can_trace_const(value) || can_trace_inst(value);
     }
 
-    size_t count_trace_const() const {
-      size_t count = 0;
-      for (size_t name = 0; name < _section->name_count(); name++) {
-        if (_can_trace_const.at_name(name)) {
-          count++;
-        }
-      }
-      return count;
-    }
-
-    size_t count_trace_inst() const {
-      size_t count = 0;
-      for (size_t name = 0; name < _section->name_count(); name++) {
-        if (_can_trace_inst.at_name(name)) {
-          count++;
-        }
-      }
-      return count;
-    }
+    size_t count_trace_const() const { return count_live(_can_trace_const); }
+    size_t count_trace_inst() const { return count_live(_can_trace_inst); }
 
     void write(std::ostream& stream) {
       InfoWriter info_writer([&](std::ostream& stream, Inst* inst) {
@@ -5211,7 +5878,8 @@ namespace metajit {
       stream << "digraph {\n";
       for (Block* block : *_section) {
         stream << "  b" << block->name() << " [shape=box";
-        if (block->terminator() && dynamic_cast<ExitInst*>(block->terminator())) {
+        if (block->terminator() && (dyn_cast<ExitInst>(block->terminator()) ||
+                                     dyn_cast<SideExitInst>(block->terminator()))) {
           stream << ", peripheries=2";
         }
         stream << "];\n";
@@ -5247,6 +5915,7 @@ namespace metajit {
     std::vector<Block*> _ordered;
     std::unordered_set<Block*> _visited;
     BlockOrdering _target_ordering;
+    BlockLayout _layout;
     bool _seen_loop = false;
 
     // Dominator ordering: pre-order traversal of dominator tree
@@ -5297,12 +5966,27 @@ namespace metajit {
       std::reverse(_ordered.begin(), _ordered.end());
     }
 
+    // Side exit blocks have no successors, so moving them to the end
+    // preserves all orderings.
+    void sink_cold_blocks() {
+      std::stable_partition(_ordered.begin(), _ordered.end(), [](Block* block) {
+        return !is_cold(block);
+      });
+    }
+
   public:
-    OrderBlocks(Section* section, BlockOrdering target_ordering = BlockOrdering::Natural):
+    static bool is_cold(Block* block) {
+      return dyn_cast<SideExitInst>(block->terminator());
+    }
+
+    OrderBlocks(Section* section,
+                BlockOrdering target_ordering = BlockOrdering::Natural,
+                BlockLayout layout = BlockLayout::Default):
         Pass(section),
         _section(section),
         _dt(section),
-        _target_ordering(target_ordering) {
+        _target_ordering(target_ordering),
+        _layout(layout) {
 
       assert(target_ordering >= BlockOrdering::Dominator);
 
@@ -5313,6 +5997,10 @@ namespace metajit {
         order_natural();
       }
 
+      if (_layout == BlockLayout::ColdTail) {
+        sink_cold_blocks();
+      }
+
       std::vector<Block*> all_blocks;
       for (Block* block : *_section) {
         all_blocks.push_back(block);
@@ -5337,9 +6025,9 @@ namespace metajit {
     }
   };
 
-  void Section::order_blocks(BlockOrdering target_ordering) {
-    if (_ordering < target_ordering) {
-      OrderBlocks::run(this, target_ordering);
+  void Section::order_blocks(BlockOrdering target_ordering, BlockLayout layout) {
+    if (_ordering < target_ordering || layout != BlockLayout::Default) {
+      OrderBlocks::run(this, target_ordering, layout);
     }
   }
 
@@ -5952,33 +6640,6 @@ namespace metajit {
 
   class Mem2Reg: public Pass<Mem2Reg> {
   private:
-    class BitVector {
-    private:
-      std::vector<uint64_t> _words;
-      size_t _size = 0;
-    public:
-      BitVector() {}
-      BitVector(size_t size): _words((size + 63) / 64, 0), _size(size) {}
-
-      void assign(size_t size, bool value) {
-        _size = size;
-        _words.assign((size + 63) / 64, value ? ~uint64_t(0) : 0);
-      }
-
-      void set(size_t idx) { _words[idx / 64] |= uint64_t(1) << (idx % 64); }
-      void clear(size_t idx) { _words[idx / 64] &= ~(uint64_t(1) << (idx % 64)); }
-      bool test(size_t idx) const { return (_words[idx / 64] >> (idx % 64)) & 1; }
-
-      void or_with(const BitVector& other) {
-        for (size_t w = 0; w < _words.size(); w++) {
-          _words[w] |= other._words[w];
-        }
-      }
-
-      bool operator==(const BitVector& other) const { return _words == other._words; }
-      bool operator!=(const BitVector& other) const { return _words != other._words; }
-    };
-
     struct BlockData {
       BitVector live; // Live allocas at entry, one bit per alloca index
       std::vector<Value*> values_at_entry; // Values at entry, indexed by alloca index (nullptr = unknown)
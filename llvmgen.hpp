@@ -312,7 +312,9 @@ namespace metajit {
 
         return _builder.CreateBr(_blocks.at(jump->block()));
       } else if (dynmatch(ExitInst, exit, inst)) {
-        return _builder.CreateRetVoid();
+        return _builder.CreateRet(_builder.getInt32(0));
+      } else if (dynmatch(SideExitInst, side_exit, inst)) {
+        return _builder.CreateRet(_builder.getInt32(side_exit->id()));
       } else {
         assert(false && "Unknown terminator");
         return nullptr;
@@ -338,7 +340,7 @@ namespace metajit {
       }
 
       _function = llvm::Function::Create(
-        llvm::FunctionType::get(llvm::Type::getVoidTy(_context), args, false),
+        llvm::FunctionType::get(llvm::Type::getInt32Ty(_context), args, false),
         llvm::Function::ExternalLinkage,
         name,
         module
@@ -250,7 +250,8 @@ namespace metajit {
                                            bool optimize_section_for_interpreter = false,
                                            bool verify_x86 = true,
                                            bool verify_interpreter = true,
-                                           bool verify_aot = true) {
+                                           bool verify_aot = true,
+                                           bool verify_linear_scan = true) {
       
       
       section->autoname();
@@ -290,8 +291,9 @@ namespace metajit {
         std::make_unique<llvm::LLVMContext>()
       )));
 
-      using LLVMFunc = void(*)(uint8_t*);
-      using X86Func = void(* [[clang::preserve_none]])(uint8_t*);
+      // Generated functions return the id of the side exit taken
+      using LLVMFunc = uint32_t(*)(uint8_t*);
+      using X86Func = uint32_t(* [[clang::preserve_none]])(uint8_t*);
       LLVMFunc llvm_func = ExitOnErr(jit->lookup("llvm_func")).toPtr<LLVMFunc>();
 
       X86Func x86_func = nullptr;
@@ -320,6 +322,20 @@ namespace metajit {
         aot_func = (X86Func) aot_x86cg.deploy();
       }
 
+      X86Func linear_scan_func = nullptr;
+      if (verify_linear_scan) {
+        // Without optional extensions, so the fallback paths of isel stay covered
+        X86CodeGen linear_scan_x86cg(section, { Reg::phys(12) }, X86CodeGen::Mode::LinearScan, X86Features());
+        
+        if (!output_path.empty()) {
+          std::ofstream stream(output_path + "_linear_scan_x86.asm");
+          linear_scan_x86cg.write(stream);
+          linear_scan_x86cg.save(output_path + "_linear_scan_x86.bin");
+        }
+
+        linear_scan_func = (X86Func) linear_scan_x86cg.deploy();
+      }
+
       Section* folded_section = nullptr;
       if (optimize_section_for_interpreter) {
         folded_section = copy_and_fold(section);
@@ -327,6 +343,7 @@ namespace metajit {
       uint8_t* llvm_data = new uint8_t[data.data_size()]();
       uint8_t* x86_data = new uint8_t[data.data_size()]();
       uint8_t* aot_data = new uint8_t[data.data_size()]();
+      uint8_t* linear_scan_data = new uint8_t[data.data_size()]();
       uint8_t* interp_data = new uint8_t[data.data_size()]();
       uint8_t* interp_data2 = new uint8_t[data.data_size()]();
 
@@ -334,13 +351,19 @@ namespace metajit {
         data.gen(llvm_data);
         std::copy(llvm_data, llvm_data + data.data_size(), x86_data);
         std::copy(llvm_data, llvm_data + data.data_size(), aot_data);
+        std::copy(llvm_data, llvm_data + data.data_size(), linear_scan_data);
         std::copy(llvm_data, llvm_data + data.data_size(), interp_data);
         std::copy(llvm_data, llvm_data + data.data_size(), interp_data2);
 
-        llvm_func(llvm_data);
+        uint32_t llvm_exit = llvm_func(llvm_data);
+        uint32_t x86_exit = 0;
+        uint32_t interp_exit = 0;
+        uint32_t aot_exit = 0;
+        uint32_t linear_scan_exit = 0;
+        uint32_t interp_exit2 = 0;
 
         if (verify_x86) {
-          x86_func(x86_data);
+          x86_exit = x86_func(x86_data);
         }
 
         if (verify_interpreter) {
@@ -356,10 +379,15 @@ namespace metajit {
               __FILE__
             );
           }
+          interp_exit = interpreter.exit_id();
         }
 
         if (verify_aot) {
-          aot_func(aot_data);
+          aot_exit = aot_func(aot_data);
+        }
+
+        if (verify_linear_scan) {
+          linear_scan_exit = linear_scan_func(linear_scan_data);
         }
 
         if (optimize_section_for_interpreter) {
@@ -375,6 +403,31 @@ namespace metajit {
               __FILE__
             );
           }
+          interp_exit2 = interpreter.exit_id();
+        }
+
+        if ((verify_x86 && llvm_exit != x86_exit) ||
+            (verify_interpreter && llvm_exit != interp_exit) ||
+            (verify_aot && llvm_exit != aot_exit) ||
+            (verify_linear_scan && llvm_exit != linear_scan_exit) ||
+            (optimize_section_for_interpreter && llvm_exit != interp_exit2)) {
+          std::ostringstream stream;
+          stream << "Inputs:\n";
+          data.write_inputs(stream, llvm_data);
+          stream << "Exit Ids:";
+          stream << " LLVM=" << llvm_exit;
+          if (verify_x86) { stream << " x86=" << x86_exit; }
+          if (verify_interpreter) { stream << " Interpreter=" << interp_exit; }
+          if (verify_aot) { stream << " AOT=" << aot_exit; }
+          if (verify_linear_scan) { stream << " LinearScan=" << linear_scan_exit; }
+          if (optimize_section_for_interpreter) { stream << " Folded=" << interp_exit2; }
+          stream << "\n";
+          throw unittest::AssertionError(
+            "Exit id mismatch",
+            __LINE__,
+            __FILE__,
+            stream.str()
+          );
         }
         
         for (const TestData::Output& output : data.outputs()) {
@@ -383,6 +436,7 @@ namespace metajit {
             if ((verify_x86 && llvm_data[output.offset + it] != x86_data[output.offset + it]) ||
                 (verify_interpreter && llvm_data[output.offset + it] != interp_data[output.offset + it]) ||
                 (verify_aot && llvm_data[output.offset + it] != aot_data[output.offset + it]) ||
+                (verify_linear_scan && llvm_data[output.offset + it] != linear_scan_data[output.offset + it]) ||
                 (optimize_section_for_interpreter && llvm_data[output.offset + it] != interp_data2[output.offset + it])) {
               is_equal = false;
               break;
@@ -406,6 +460,10 @@ namespace metajit {
               stream << "AOT x86 Output:\n";
               data.write_outputs(stream, aot_data);
             }
+            if (verify_linear_scan) {
+              stream << "Linear Scan x86 Output:\n";
+              data.write_outputs(stream, linear_scan_data);
+            }
             if (optimize_section_for_interpreter) {
               stream << "Folded Interpreter Output:\n";
               data.write_outputs(stream, interp_data2);
@@ -484,6 +542,7 @@ namespace metajit {
       bool _verify_x86 = true;
       bool _verify_interpreter = true;
       bool _verify_aot = true;
+      bool _verify_linear_scan = true;
     public:
       DiffTest(const std::string& name, const std::string& output_path):
         unittest::BaseTest<DiffTest>(name), _output_path(output_path) {}
@@ -503,6 +562,11 @@ namespace metajit {
         return std::move(*this);
       }
 
+      DiffTest&& linear_scan(bool verify_linear_scan) && {
+        _verify_linear_scan = verify_linear_scan;
+        return std::move(*this);
+      }
+
       void run(const std::function<void(Builder&, TestData&)>& body) && {
         unittest::BaseTest<DiffTest>::run([&]() {
           Context context;
@@ -529,7 +593,8 @@ namespace metajit {
             false,
             _verify_x86,
             _verify_interpreter,
-            _verify_aot
+            _verify_aot,
+            _verify_linear_scan
           );
 
           delete section;
@@ -46,6 +46,55 @@ int main(int argc, char** argv) {
 
   });
 
+  // Conditions which are fused into the branch
+  auto branch_cond = [&](const std::string& name, const std::function<Value*(Builder&, TestData&)>& build_cond) {
+    suite.diff_test("branch_" + name).run([&](Builder& builder, TestData& data) {
+      Block* a = builder.build_block();
+      Block* b = builder.build_block();
+      Block* cont = builder.build_block({Type::Int64});
+
+      Value* cond = build_cond(builder, data);
+      Value* value_a = data.input(Type::Int64);
+      Value* value_b = data.input(Type::Int64);
+
+      builder.build_branch(cond, a, b);
+
+      builder.move_to_end(a);
+      builder.build_jump(cont, {value_a});
+
+      builder.move_to_end(b);
+      builder.build_jump(cont, {value_b});
+
+      builder.move_to_end(cont);
+      data.output(cont->arg(0));
+    });
+  };
+
+  branch_cond("eq", [](Builder& builder, TestData& data) {
+    return builder.build_eq(data.input(RandomRange(Type::Int32, 0, 3)), data.input(RandomRange(Type::Int32, 0, 3)));
+  });
+  branch_cond("lt_s_const_lhs", [](Builder& builder, TestData& data) {
+    return builder.build_lt_s(builder.build_const(Type::Int64, 5), data.input(RandomRange(Type::Int64, 0, 10)));
+  });
+  branch_cond("lt_u_const_lhs", [](Builder& builder, TestData& data) {
+    return builder.build_lt_u(builder.build_const(Type::Int16, 100), data.input(Type::Int16));
+  });
+  branch_cond("not_lt_s", [](Builder& builder, TestData& data) {
+    Value* cond = builder.build_lt_s(data.input(Type::Int8), data.input(Type::Int8));
+    return builder.build_xor(cond, builder.build_const(Type::Bool, 1));
+  });
+  branch_cond("test", [](Builder& builder, TestData& data) {
+    Value* masked = builder.build_and(data.input(Type::Int64), builder.build_const(Type::Int64, 0x100));
+    return builder.build_eq(masked, builder.build_const(Type::Int64, 0));
+  });
+  branch_cond("lt_f_o", [](Builder& builder, TestData& data) {
+    return builder.build_lt_f_o(data.input(Type::Float64), data.input(Type::Float64));
+  });
+  branch_cond("not_lt_f_u", [](Builder& builder, TestData& data) {
+    Value* cond = builder.build_lt_f_u(data.input(Type::Float32), data.input(Type::Float32));
+    return builder.build_xor(cond, builder.build_const(Type::Bool, 1));
+  });
+
   suite.diff_test("sum_to").run([](Builder& builder, TestData& data) {
     Block* loop_header = builder.build_block({Type::Int64, Type::Int64}); // (i, sum)
     Block* loop_body = builder.build_block();
@@ -154,6 +203,83 @@ int main(int argc, char** argv) {
     data.output(loop_header->arg(2));
   });
 
+  suite.diff_test("rotate_loop").run([](Builder& builder, TestData& data) {
+    // Block arguments are permuted in a cycle on every iteration
+    Block* loop_header = builder.build_block({Type::Int64, Type::Int64, Type::Int64, Type::Int64}); // (i, a, b, c)
+    Block* loop_body = builder.build_block();
+    Block* loop_end = builder.build_block();
+
+    Value* n = data.input(RandomRange(Type::Int64, 0, 8));
+    Value* a = data.input(Type::Int64);
+    Value* b = data.input(Type::Int64);
+    Value* c = data.input(Type::Int64);
+
+    builder.build_jump(loop_header, {builder.build_const(Type::Int64, 0), a, b, c});
+
+    builder.move_to_end(loop_header);
+    Value* i = loop_header->arg(0);
+    builder.build_branch(builder.build_lt_s(i, n), loop_body, loop_end);
+
+    builder.move_to_end(loop_body);
+    builder.build_jump(loop_header, {
+      builder.build_add(i, builder.build_const(Type::Int64, 1)),
+      loop_header->arg(2),
+      loop_header->arg(3),
+      builder.build_sub(loop_header->arg(1), i)
+    });
+
+    builder.move_to_end(loop_end);
+    data.output(loop_header->arg(1));
+    data.output(loop_header->arg(2));
+    data.output(loop_header->arg(3));
+  });
+
+  // Branches over filler code and a loop. Depending on the amount of filler,
+  // jumps across the aligned loop header fall on either side of the rel8
+  // range, so some of them are only pushed out of range by its padding.
+  for (size_t filler : {8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30, 64}) {
+    suite.diff_test("long_branch_" + std::to_string(filler)).run([filler](Builder& builder, TestData& data) {
+      Block* body = builder.build_block();
+      Block* loop_header = builder.build_block({Type::Int64, Type::Int64}); // (i, sum)
+      Block* loop_body = builder.build_block();
+      Block* loop_end = builder.build_block();
+      Block* skip = builder.build_block();
+      Block* cont = builder.build_block({Type::Int64});
+
+      Value* cond = data.input(Type::Bool);
+      Value* n = data.input(RandomRange(Type::Int64, 0, 8));
+      Value* x = data.input(Type::Int64);
+
+      builder.build_branch(cond, body, skip);
+
+      builder.move_to_end(body);
+      Value* value = x;
+      for (size_t it = 0; it < filler; it++) {
+        value = builder.build_xor(builder.build_add(value, x), n);
+      }
+      builder.build_jump(loop_header, {builder.build_const(Type::Int64, 0), value});
+
+      builder.move_to_end(loop_header);
+      Value* i = loop_header->arg(0);
+      builder.build_branch(builder.build_lt_s(i, n), loop_body, loop_end);
+
+      builder.move_to_end(loop_body);
+      builder.build_jump(loop_header, {
+        builder.build_add(i, builder.build_const(Type::Int64, 1)),
+        builder.build_add(loop_header->arg(1), i)
+      });
+
+      builder.move_to_end(loop_end);
+      builder.build_jump(cont, {loop_header->arg(1)});
+
+      builder.move_to_end(skip);
+      builder.build_jump(cont, {x});
+
+      builder.move_to_end(cont);
+      data.output(cont->arg(0));
+    });
+  }
+
   suite.diff_test("multi_arg_merge_failure").run([](Builder& builder, TestData& data) {
     // Fill registers to force specific assignments
     Block* header = builder.build_block({
@@ -196,6 +322,316 @@ int main(int argc, char** argv) {
     data.output(s);
   });
 
+  suite.diff_test("side_exit").run([](Builder& builder, TestData& data) {
+    Block* a = builder.build_block();
+    Block* b = builder.build_block();
+
+    Value* cond = data.input(Type::Bool);
+    Value* value_a = data.input(Type::Int64);
+    Value* value_b = data.input(Type::Int32);
+
+    builder.build_branch(cond, a, b);
+
+    builder.move_to_end(a);
+    data.output(value_a);
+    builder.build_side_exit(3);
+
+    builder.move_to_end(b);
+    data.output(value_b);
+  });
+
+  suite.diff_test("guard_snapshot").run([](Builder& builder, TestData& data) {
+    Value* cond = data.input(RandomRange(Type::Int32, 0, 3));
+    Value* value = data.input(Type::Int64);
+    size_t slot = data.alloc_output(Type::Int64);
+
+    TraceBuilder trace(builder.section());
+    trace.move_to_end(builder.block());
+
+    TraceBuilder::Snapshot snapshot;
+    snapshot.add(builder.entry_arg(0), value, AliasingGroup(0), slot);
+    Value* is_zero = trace.build_eq(cond, trace.build_const(Type::Int32, 0));
+    unittest_assert(trace.build_guard(is_zero, false, snapshot) == 1);
+    unittest_assert(trace.build_guard(is_zero, false, snapshot) == 0);
+    unittest_assert(trace.side_exits().size() == 1);
+
+    builder.move_to_end(trace.block());
+    Value* sum = builder.build_add(value, builder.build_const(Type::Int64, 1));
+    builder.build_store(builder.entry_arg(0), sum, AliasingGroup(0), slot);
+  });
+
+  suite.test("trace_linking").run([]() {
+    Context context;
+    Allocator allocator;
+
+    // Adds value to the counter at offset and leaves through exit_id
+    auto build_trace = [&](uint64_t offset, uint64_t value, uint32_t exit_id) {
+      Section* section = new Section(context, allocator);
+      Builder builder(section);
+      builder.move_to_end(builder.build_block({Type::Ptr}));
+      Value* data = builder.entry_arg(0);
+      Value* counter = builder.build_load(data, Type::Int64, LoadFlags::None, AliasingGroup(0), offset);
+      Value* sum = builder.build_add(counter, builder.build_const(Type::Int64, value));
+      builder.build_store(data, sum, AliasingGroup(0), offset);
+      if (exit_id == 0) {
+        builder.build_exit();
+      } else {
+        builder.build_side_exit(exit_id);
+      }
+      return section;
+    };
+
+    Section* section_a = build_trace(0, 1, 5);
+    Section* section_b = build_trace(8, 2, 0);
+    X86CodeGen codegen_a(section_a, { Reg::phys(12) }, X86CodeGen::Mode::JIT, X86Features::host(), true);
+    X86CodeGen codegen_b(section_b, { Reg::phys(12) }, X86CodeGen::Mode::JIT, X86Features::host(), true);
+
+    using Func = uint32_t(* [[clang::preserve_none]])(uint8_t*);
+    uint64_t data[2] = { 0, 0 };
+
+    X86TraceLinker linker;
+    X86TraceLinker::Trace* trace_a = linker.install(1, codegen_a);
+    Func func_a = (Func) trace_a->entry();
+    unittest_assert(func_a((uint8_t*) data) == 5);
+
+    // Target is not compiled yet
+    linker.link(trace_a, 5, 2);
+    unittest_assert(func_a((uint8_t*) data) == 5);
+    unittest_assert(data[0] == 2 && data[1] == 0);
+
+    linker.install(2, codegen_b);
+    unittest_assert(func_a((uint8_t*) data) == 0);
+    unittest_assert(data[0] == 3 && data[1] == 2);
+
+    linker.invalidate(2);
+    unittest_assert(func_a((uint8_t*) data) == 5);
+    unittest_assert(data[0] == 4 && data[1] == 2);
+
+    delete section_a;
+    delete section_b;
+  });
+
+  suite.test("bridge").run([]() {
+    Context context;
+    Allocator allocator;
+    using Func = uint32_t(* [[clang::preserve_none]])(uint8_t*);
+
+    // data[0] += 1 if data[2] == 0, otherwise leave through a guard
+    // which writes back data[1] = data[2]
+    Section* section = new Section(context, allocator);
+    TraceBuilder trace(section);
+    trace.move_to_end(trace.build_block({Type::Ptr}));
+    Value* data = trace.entry_arg(0);
+    Value* mode = trace.build_load(data, Type::Int64, LoadFlags::None, AliasingGroup(0), 16);
+    TraceBuilder::Snapshot snapshot;
+    snapshot.add(data, mode, AliasingGroup(0), 8);
+    uint32_t guard = trace.build_guard(trace.build_eq(mode, trace.build_const(Type::Int64, 0)), true, snapshot);
+    Value* counter = trace.build_load(data, Type::Int64, LoadFlags::None, AliasingGroup(0), 0);
+    trace.build_store(data, trace.build_add(counter, trace.build_const(Type::Int64, 1)), AliasingGroup(0), 0);
+    trace.build_exit();
+
+    // Bridge recorded from the guard's state: data[1] += 10
+    Section* bridge_section = new Section(context, allocator);
+    Builder bridge(bridge_section);
+    bridge.move_to_end(bridge.build_block({Type::Ptr}));
+    Value* slot = bridge.build_load(bridge.entry_arg(0), Type::Int64, LoadFlags::None, AliasingGroup(0), 8);
+    bridge.build_store(bridge.entry_arg(0), bridge.build_add(slot, bridge.build_const(Type::Int64, 10)), AliasingGroup(0), 8);
+    bridge.build_exit();
+
+    X86CodeGen codegen(section, { Reg::phys(12) }, X86CodeGen::Mode::JIT, X86Features::host(), true);
+    X86CodeGen bridge_codegen(bridge_section, { Reg::phys(12) }, X86CodeGen::Mode::JIT, X86Features::host(), true);
+
+    X86TraceLinker linker(CodeArena::global(), 3);
+    X86TraceLinker::Trace* root = linker.install(1, codegen);
+    Func func = (Func) root->entry();
+
+    uint64_t values[3] = { 0, 0, 7 };
+    size_t dispatched = 0;
+    for (size_t it = 0; it < 5; it++) {
+      uint32_t exit_id = func((uint8_t*) values);
+      if (exit_id != 0) {
+        unittest_assert(exit_id == guard);
+        unittest_assert(values[1] == 7);
+        dispatched++;
+        if (linker.count_exit(root, exit_id)) {
+          linker.attach_bridge(root, exit_id, 2, bridge_codegen);
+        }
+      } else {
+        unittest_assert(values[1] == 17);
+      }
+    }
+    unittest_assert(dispatched == 3);
+    unittest_assert(values[0] == 0);
+    unittest_assert(linker.trace(2)->parent == root);
+
+    delete section;
+    delete bridge_section;
+  });
+
+  suite.test("object_file").run([]() {
+    Context context;
+    Allocator allocator;
+
+    // Copies an external global into the data argument
+    Section* section = new Section(context, allocator);
+    Builder builder(section);
+    builder.move_to_end(builder.build_block({Type::Ptr}));
+    Value* global = context.build_symbol(Type::Ptr, "metajit_test_global");
+    Value* value = builder.build_load(global, Type::Int64, LoadFlags::None, AliasingGroup(0), 0);
+    builder.build_store(builder.entry_arg(0), value, AliasingGroup(1), 0);
+    builder.build_exit();
+
+    X86CodeGen codegen(section, { Reg::phys(12) }, X86CodeGen::Mode::AOT);
+    X86ObjectWriter writer;
+    writer.add("metajit_test_trace", codegen);
+    writer.add("metajit_test_trace_copy", codegen);
+    std::vector<uint8_t> object = writer.build();
+
+    const Elf64_Ehdr* ehdr = (const Elf64_Ehdr*) object.data();
+    unittest_assert(memcmp(ehdr->e_ident, ELFMAG, SELFMAG) == 0);
+    unittest_assert(ehdr->e_type == ET_REL && ehdr->e_machine == EM_X86_64);
+
+    const Elf64_Shdr* headers = (const Elf64_Shdr*) (object.data() + ehdr->e_shoff);
+    const Elf64_Shdr* rela_header = nullptr;
+    const Elf64_Shdr* symtab_header = nullptr;
+    for (size_t it = 0; it < ehdr->e_shnum; it++) {
+      if (headers[it].sh_type == SHT_RELA) { rela_header = &headers[it]; }
+      if (headers[it].sh_type == SHT_SYMTAB) { symtab_header = &headers[it]; }
+    }
+    unittest_assert(rela_header && symtab_header);
+
+    // One relocation per function, both against the same undefined symbol
+    unittest_assert(rela_header->sh_size == 2 * sizeof(Elf64_Rela));
+    const Elf64_Rela* relas = (const Elf64_Rela*) (object.data() + rela_header->sh_offset);
+    const Elf64_Sym* symbols = (const Elf64_Sym*) (object.data() + symtab_header->sh_offset);
+    const char* strtab = (const char*) (object.data() + headers[symtab_header->sh_link].sh_offset);
+    for (size_t it = 0; it < 2; it++) {
+      unittest_assert(ELF64_R_TYPE(relas[it].r_info) == R_X86_64_64);
+      const Elf64_Sym& symbol = symbols[ELF64_R_SYM(relas[it].r_info)];
+      unittest_assert(symbol.st_shndx == SHN_UNDEF);
+      unittest_assert(std::string(strtab + symbol.st_name) == "metajit_test_global");
+    }
+    unittest_assert(symtab_header->sh_size == 4 * sizeof(Elf64_Sym));
+    unittest_assert(std::string(strtab + symbols[1].st_name) == "metajit_test_trace");
+    unittest_assert(ELF64_ST_TYPE(symbols[1].st_info) == STT_FUNC);
+
+    delete section;
+  });
+
+  suite.test("jump_relaxation").run([]() {
+    X86Block blocks[3];
+    for (size_t it = 0; it < 3; it++) {
+      blocks[it].set_name(it);
+    }
+
+    // jmp b1; je b2; nop padding before the loop header at 16
+    std::vector<uint8_t> buffer(160, 0x90);
+    buffer[0] = 0xeb;
+    buffer[2] = 0x74;
+    std::vector<X86CodeGen::Label> labels(2);
+    labels[0].pos = 1;
+    labels[0].size = 1;
+    labels[0].ref = 2;
+    labels[0].to = &blocks[1];
+    labels[1].pos = 3;
+    labels[1].size = 1;
+    labels[1].ref = 4;
+    labels[1].to = &blocks[2];
+    std::vector<size_t> offsets = { 0, 132, 124 };
+
+    std::vector<bool> long_jumps;
+    unittest_assert(X86CodeGen::relax_jumps(buffer, labels, offsets, {}, long_jumps));
+    unittest_assert(long_jumps[0] && !long_jumps[1]);
+
+    // Relaxing the first jump moves the loop header padding from 1 to 14
+    // bytes, which pushes the second jump out of range
+    long_jumps.clear();
+    unittest_assert(X86CodeGen::relax_jumps(buffer, labels, offsets, { X86CodeGen::Align { 16, 1 } }, long_jumps));
+    unittest_assert(long_jumps[0] && long_jumps[1]);
+  });
+
+  suite.test("loop_alignment").run([]() {
+    Context context;
+    Allocator allocator;
+    using Func = uint32_t(* [[clang::preserve_none]])(uint8_t*);
+
+    size_t relaxed = 0;
+    for (size_t filler = 0; filler < 40; filler++) {
+      // data[2] = data[1] filler steps then summed with 0..data[0]-1,
+      // leaves through a side exit if data[0] is negative
+      Section* section = new Section(context, allocator);
+      Builder builder(section);
+      builder.move_to_end(builder.build_block({Type::Ptr}));
+      Block* cold = builder.build_block();
+      Block* body = builder.build_block();
+      Block* loop_header = builder.build_block({Type::Int64, Type::Int64}); // (i, sum)
+      Block* loop_body = builder.build_block();
+      Block* loop_end = builder.build_block();
+
+      Value* data = builder.entry_arg(0);
+      Value* n = builder.build_load(data, Type::Int64, LoadFlags::None, AliasingGroup(0), 0);
+      Value* x = builder.build_load(data, Type::Int64, LoadFlags::None, AliasingGroup(0), 8);
+      builder.build_branch(builder.build_lt_s(n, builder.build_const(Type::Int64, 0)), cold, body);
+
+      builder.move_to_end(cold);
+      builder.build_side_exit(1);
+
+      builder.move_to_end(body);
+      Value* value = x;
+      for (size_t it = 0; it < filler; it++) {
+        value = builder.build_xor(builder.build_add(value, x), n);
+      }
+      builder.build_jump(loop_header, {builder.build_const(Type::Int64, 0), value});
+
+      builder.move_to_end(loop_header);
+      Value* i = loop_header->arg(0);
+      builder.build_branch(builder.build_lt_s(i, n), loop_body, loop_end);
+
+      builder.move_to_end(loop_body);
+      builder.build_jump(loop_header, {
+        builder.build_add(i, builder.build_const(Type::Int64, 1)),
+        builder.build_add(loop_header->arg(1), i)
+      });
+
+      builder.move_to_end(loop_end);
+      builder.build_store(data, loop_header->arg(1), AliasingGroup(0), 16);
+      builder.build_exit();
+
+      BlockOrdering ordering = section->ordering();
+      X86CodeGen codegen(section, { Reg::phys(12) });
+
+      // The side exit is emitted behind the loop, the section is unchanged
+      unittest_assert(codegen.layout().back()->name() == cold->name());
+      unittest_assert(section->entry()->next() == cold);
+      unittest_assert(section->ordering() == ordering);
+
+      unittest_assert(codegen.loop_offsets().size() == 1);
+      unittest_assert(codegen.loop_offsets()[0] % X86CodeGen::LOOP_ALIGN == 0);
+      if (codegen.long_jump_count() > 0) {
+        relaxed++;
+      }
+
+      int64_t expected = 3;
+      for (size_t it = 0; it < filler; it++) {
+        expected = (expected + 3) ^ 5;
+      }
+      expected += 0 + 1 + 2 + 3 + 4;
+
+      Func func = (Func) codegen.deploy();
+      int64_t values[3] = { 5, 3, 0 };
+      unittest_assert(func((uint8_t*) values) == 0);
+      unittest_assert(values[2] == expected);
+
+      values[0] = -1;
+      unittest_assert(func((uint8_t*) values) == 1);
+
+      delete section;
+    }
+
+    // The larger fillers need long jumps
+    unittest_assert(relaxed > 0);
+  });
+
   suite.test("dominator_order_verify").run([]() {
     Context context;
     Allocator allocator;
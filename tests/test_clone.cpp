@@ -174,5 +174,81 @@ int main(int argc, char** argv) {
     );
   });
 
+  suite.test("opcode_casts").run([]() {
+    Context context;
+    Allocator allocator;
+    Section* section = new Section(context, allocator);
+    Builder builder(section);
+    builder.move_to_end(builder.build_block({Type::Int32, Type::Ptr}));
+
+    Value* sum = builder.build_add(builder.entry_arg(0), builder.build_const(Type::Int32, 1));
+    Value* store = builder.build_store(builder.entry_arg(1), sum, AliasingGroup(0), 0);
+
+    unittest_assert(isa<AddInst>(sum) && isa<Inst>(sum) && isa<NamedValue>(sum));
+    unittest_assert(!isa<SubInst>(sum) && !isa<Const>(sum) && !isa<Arg>(sum));
+    unittest_assert(isa<Arg>(builder.entry_arg(0)));
+    unittest_assert(isa<Const>(cast<AddInst>(sum)->arg(1)));
+    unittest_assert(dyn_cast<StoreInst>(store) == store);
+    unittest_assert(dyn_cast<StoreInst>((Value*) nullptr) == nullptr);
+    unittest_assert(cast<Inst>(store)->has_side_effect() && !cast<Inst>(store)->is_terminator());
+
+    // Every instruction is dispatched to its own class
+    for (Inst* inst : *section->entry()) {
+      Opcode opcode = visit_inst(inst, [](auto* inst) {
+        return std::remove_pointer_t<decltype(inst)>::OPCODE;
+      });
+      unittest_assert(opcode == inst->opcode());
+    }
+
+    delete section;
+  });
+
+  suite.test("interned_consts").run([]() {
+    Context context;
+    unittest_assert(context.build_const(Type::Int64, 5) == context.build_const(Type::Int64, 5));
+    unittest_assert(context.build_const(Type::Int64, 5) != context.build_const(Type::Int32, 5));
+    unittest_assert(context.build_const(Type::Int8, 0x105) == context.build_const(Type::Int8, 5));
+    unittest_assert(context.build_poison(Type::Ptr) == context.build_poison(Type::Ptr));
+
+    std::vector<Const*> consts;
+    for (uint64_t it = 0; it < 1000; it++) {
+      consts.push_back(context.build_const(Type::Int64, it * 12345));
+    }
+    for (uint64_t it = 0; it < 1000; it++) {
+      unittest_assert(context.build_const(Type::Int64, it * 12345) == consts[it]);
+    }
+
+    // The builder's fast path used by generating extensions is interned as well
+    Allocator allocator;
+    Section* section = new Section(context, allocator);
+    Builder builder(section);
+    unittest_assert(builder.build_const_fast(Type::Ptr, 0x7fff12345678) == context.build_const(Type::Ptr, 0x7fff12345678));
+    unittest_assert(builder.build_const_fast(Type::Int32, 3) == context.build_const(Type::Int32, 3));
+    delete section;
+  });
+
+  suite.test("arena_allocator").run([]() {
+    ArenaAllocator allocator;
+    for (size_t it = 0; it < 64 * 1024; it++) {
+      unittest_assert((uintptr_t) allocator.alloc(24, 8) % 8 == 0);
+    }
+
+    // Larger than a chunk
+    uint8_t* large = (uint8_t*) allocator.alloc(8 * 1024 * 1024, 64);
+    unittest_assert((uintptr_t) large % 64 == 0);
+    std::memset(large, 0xff, 8 * 1024 * 1024);
+    unittest_assert(allocator.stats().large_allocs == 1);
+    unittest_assert(allocator.stats().allocated == 64 * 1024 * 24 + 8 * 1024 * 1024);
+
+    allocator.dealloc_all();
+    unittest_assert(allocator.stats().allocated == 0);
+
+    // Chunks of destroyed arenas are reused
+    { ArenaAllocator warmup; }
+    ArenaAllocator recycled;
+    recycled.alloc(1024, 8);
+    unittest_assert(recycled.stats().mallocs == 0);
+  });
+
   return suite.finish();
 }
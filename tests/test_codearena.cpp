@@ -0,0 +1,121 @@
+// Copyright 2026 Can Joshua Lehmann
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "../../unittest.cpp/unittest.hpp"
+
+#include "../codearena.hpp"
+
+using namespace metajit;
+
+void test_execute(unittest::Suite& suite) {
+  suite.test("execute").run([]() {
+    CodeArena arena;
+    CodeArena::Allocation allocation = arena.alloc(16);
+
+    // mov eax, 42; ret
+    uint8_t code[] = { 0xb8, 42, 0, 0, 0, 0xc3 };
+    memcpy(allocation.rw, code, sizeof(code));
+
+    using Fn = uint32_t (*)();
+    Fn fn = (Fn) allocation.rx;
+    unittest_assert(fn() == 42);
+    unittest_assert(arena.contains(allocation.rx));
+  });
+}
+
+void test_align(unittest::Suite& suite) {
+  suite.test("align").run([]() {
+    CodeArena arena(CodeArena::REGION_SIZE, 64);
+    for (size_t it = 0; it < 16; it++) {
+      CodeArena::Allocation allocation = arena.alloc(it * 7 + 1);
+      unittest_assert((uintptr_t) allocation.rx % 64 == 0);
+    }
+    CodeArena::Allocation allocation = arena.alloc(10, 256);
+    unittest_assert((uintptr_t) allocation.rx % 256 == 0);
+  });
+}
+
+void test_shrink(unittest::Suite& suite) {
+  suite.test("shrink").run([]() {
+    CodeArena arena;
+    CodeArena::Allocation a = arena.alloc(1024);
+    arena.shrink(a, 10);
+    unittest_assert(a.size == 10);
+    unittest_assert(arena.stats().used == 10);
+
+    // The tail is reused by the next allocation
+    CodeArena::Allocation b = arena.alloc(10);
+    unittest_assert(b.rx == a.rx + 16);
+  });
+}
+
+void test_free(unittest::Suite& suite) {
+  suite.test("free").run([]() {
+    CodeArena arena;
+    CodeArena::Allocation a = arena.alloc(64);
+    CodeArena::Allocation b = arena.alloc(64);
+    CodeArena::Allocation c = arena.alloc(64);
+
+    arena.free(b);
+    unittest_assert(b.rw[0] == 0xcc);
+    CodeArena::Allocation d = arena.alloc(32);
+    unittest_assert(d.rx == b.rx);
+
+    arena.free(a);
+    arena.free(c);
+    arena.free(d);
+    unittest_assert(arena.stats().used == 0);
+    unittest_assert(arena.stats().recycled_regions == 1);
+
+    // Empty regions are recycled
+    CodeArena::Allocation e = arena.alloc(64);
+    unittest_assert(e.rx == a.rx);
+    unittest_assert(arena.stats().regions == 1);
+  });
+}
+
+void test_regions(unittest::Suite& suite) {
+  suite.test("regions").run([]() {
+    CodeArena arena(4096);
+    std::vector<CodeArena::Allocation> allocations;
+    for (size_t it = 0; it < 64; it++) {
+      allocations.push_back(arena.alloc(1000));
+    }
+    unittest_assert(arena.stats().regions > 1);
+    unittest_assert(arena.stats().occupancy() > 0.5);
+
+    // Oversized allocations get their own region
+    CodeArena::Allocation large = arena.alloc(3 * 4096);
+    unittest_assert(large.size == 3 * 4096);
+
+    for (const CodeArena::Allocation& allocation : allocations) {
+      arena.free(allocation);
+    }
+    arena.free(large);
+    unittest_assert(arena.stats().used == 0);
+    unittest_assert(arena.stats().frees == 65);
+  });
+}
+
+int main(int argc, char** argv) {
+  unittest::Suite suite(argc, argv);
+
+  test_execute(suite);
+  test_align(suite);
+  test_shrink(suite);
+  test_free(suite);
+  test_regions(suite);
+
+  return suite.finish();
+}
@@ -46,6 +46,18 @@ void test_binop(DiffTestSuite& suite) {
   binop(eq, false)
   binop(lt_u, false)
   binop(lt_s, false)
+
+  #define and_not_type(type, ones) \
+    suite.diff_test("and_not_" #type).run([](Builder& builder, TestData& data) { \
+      Value* inverted = builder.build_xor(data.input(Type::type), builder.build_const(Type::type, ones)); \
+      data.output(builder.build_and(data.input(Type::type), inverted)); \
+    });
+
+  and_not_type(Bool, 1)
+  and_not_type(Int8, 0xff)
+  and_not_type(Int16, 0xffff)
+  and_not_type(Int32, 0xffffffff)
+  and_not_type(Int64, 0xffffffffffffffff)
 }
 
 void test_shift(DiffTestSuite& suite) {
@@ -104,6 +116,8 @@ void test_select(DiffTestSuite& suite) {
   select_type(Int16)
   select_type(Int32)
   select_type(Int64)
+  select_type(Float32)
+  select_type(Float64)
 }
 
 void test_resize(DiffTestSuite& suite) {
@@ -285,6 +299,79 @@ void test_alloca(DiffTestSuite& suite) {
     Value* loaded = builder.build_load(ptr_off, Type::Int32, LoadFlags::None, AliasingGroup(0), 0);
     data.output(loaded);
   });
+
+  // Builds two allocas with disjoint live ranges, the address of the
+  // second one optionally escapes through memory. The third alloca used
+  // for escaping can still share storage with the first one.
+  auto build_disjoint_allocas = [](Builder& builder, TestData& data, bool escape) {
+    Value* a = builder.build_alloca(builder.build_const(Type::Int64, 8), 8);
+    builder.build_store(a, data.input(Type::Int64), AliasingGroup(1), 0);
+    data.output(builder.build_load(a, Type::Int64, LoadFlags::None, AliasingGroup(1), 0));
+
+    Value* b = builder.build_alloca(builder.build_const(Type::Int64, 8), 8);
+    Value* b_ptr = b;
+    if (escape) {
+      Value* slot = builder.build_alloca(builder.build_const(Type::Int64, 8), 8);
+      builder.build_store(slot, b, AliasingGroup(2), 0);
+      b_ptr = builder.build_load(slot, Type::Ptr, LoadFlags::None, AliasingGroup(2), 0);
+    }
+    builder.build_store(b, data.input(Type::Int64), AliasingGroup(1), 0);
+    data.output(builder.build_load(b_ptr, Type::Int64, LoadFlags::None, AliasingGroup(1), 0));
+  };
+
+  suite.diff_test("alloca_disjoint").run([&](Builder& builder, TestData& data) {
+    build_disjoint_allocas(builder, data, false);
+  });
+
+  suite.diff_test("alloca_disjoint_escaping").run([&](Builder& builder, TestData& data) {
+    build_disjoint_allocas(builder, data, true);
+  });
+
+  // The first alloca is carried around the loop, while the second one is
+  // only live within the loop body. They must not share storage.
+  suite.diff_test("alloca_loop_carried").run([](Builder& builder, TestData& data) {
+    Value* carried = builder.build_alloca(builder.build_const(Type::Int64, 8), 8);
+    builder.build_store(carried, data.input(Type::Int64), AliasingGroup(1), 0);
+
+    Block* loop = builder.build_block({Type::Int64});
+    Block* latch = builder.build_block();
+    Block* exit = builder.build_block();
+    builder.build_jump(loop, {builder.build_const(Type::Int64, 0)});
+
+    builder.move_to_end(loop);
+    Value* value = builder.build_load(carried, Type::Int64, LoadFlags::None, AliasingGroup(1), 0);
+    Value* next_value = builder.build_add(value, builder.build_const(Type::Int64, 3));
+    builder.build_store(carried, next_value, AliasingGroup(1), 0);
+    data.output(next_value);
+
+    Value* local = builder.build_alloca(builder.build_const(Type::Int64, 8), 8);
+    builder.build_store(local, builder.build_add(loop->arg(0), builder.build_const(Type::Int64, 1)), AliasingGroup(1), 0);
+    Value* counter = builder.build_load(local, Type::Int64, LoadFlags::None, AliasingGroup(1), 0);
+    Value* cond = builder.build_lt_u(counter, builder.build_const(Type::Int64, 4));
+    builder.build_branch(cond, latch, exit);
+
+    builder.move_to_end(latch);
+    builder.build_jump(loop, {counter});
+
+    builder.move_to_end(exit);
+  });
+
+  suite.test("alloca_frame_sharing").run([&]() {
+    for (bool escape : { false, true }) {
+      Context context;
+      Allocator allocator;
+      Section* section = new Section(context, allocator);
+      Builder builder(section);
+      builder.move_to_end(builder.build_block({Type::Ptr}));
+      TestData data(builder);
+      build_disjoint_allocas(builder, data, escape);
+      builder.build_exit();
+
+      X86CodeGen codegen(section, { Reg::phys(12) });
+      unittest_assert(codegen.frame_size() == (escape ? 16 : 8));
+      delete section;
+    }
+  });
 }
 
 void test_call(DiffTestSuite& suite) {
@@ -454,14 +541,31 @@ void test_call(DiffTestSuite& suite) {
     Value* observed = builder.build_load(out_ptr, Type::Int32, LoadFlags::None, AliasingGroup(0), 0);
     data.output(observed);
   });
+
+  // More values are live across the calls than there are callee-saved registers
+  suite.diff_test("call_default_live_across").aot(false).interpreter(false).run([](Builder& builder, TestData& data) {
+    std::vector<Value*> values;
+    for (size_t it = 0; it < 8; it++) {
+      values.push_back(data.input(Type::Int64));
+    }
+
+    Value* callee = builder.build_const(Type::Ptr, (uint64_t)(void*) test_call_default_target_2);
+    Value* result = builder.build_call(callee, Type::Int64, std::vector<Value*>({values[0], values[1]}), CallConv::Default);
+    result = builder.build_call(callee, Type::Int64, std::vector<Value*>({result, values[2]}), CallConv::Default);
+
+    for (Value* value : values) {
+      result = builder.build_add(result, value);
+    }
+    data.output(result);
+  });
 }
 
 void test_binop_f(DiffTestSuite& suite) {
   #define binop_f_type(name, type) \
-    suite.diff_test(#name "_" #type).x86(false).aot(false).run([](Builder& builder, TestData& data) { \
+    suite.diff_test(#name "_" #type).run([](Builder& builder, TestData& data) { \
       data.output(builder.build_##name(data.input(Type::type), data.input(Type::type))); \
     }); \
-    suite.diff_test(#name "_" #type "_imm").x86(false).aot(false).run([](Builder& builder, TestData& data) { \
+    suite.diff_test(#name "_" #type "_imm").run([](Builder& builder, TestData& data) { \
       data.output(builder.build_##name(data.input(Type::type), RandomRange(Type::type).gen_const(builder))); \
     });
   
@@ -478,6 +582,236 @@ void test_binop_f(DiffTestSuite& suite) {
   binop_f(lt_f_o)
 }
 
+void test_int_float_conv(DiffTestSuite& suite) {
+  #define int_to_float_s_type(from_type, to_type) \
+    suite.diff_test("int_to_float_s_" #from_type "_to_" #to_type).interpreter(false).run([](Builder& builder, TestData& data) { \
+      data.output(builder.build_int_to_float_s(data.input(Type::from_type), Type::to_type)); \
+    });
+
+  // Round trip through the float type, so the converted values are always in range
+  #define float_to_int_s_type(from_type, to_type) \
+    suite.diff_test("float_to_int_s_" #from_type "_to_" #to_type).interpreter(false).run([](Builder& builder, TestData& data) { \
+      Value* value = builder.build_int_to_float_s(data.input(Type::to_type), Type::from_type); \
+      data.output(builder.build_float_to_int_s(value, Type::to_type)); \
+    });
+
+  int_to_float_s_type(Int8, Float32)
+  int_to_float_s_type(Int16, Float32)
+  int_to_float_s_type(Int32, Float32)
+  int_to_float_s_type(Int64, Float32)
+  int_to_float_s_type(Int8, Float64)
+  int_to_float_s_type(Int16, Float64)
+  int_to_float_s_type(Int32, Float64)
+  int_to_float_s_type(Int64, Float64)
+
+  float_to_int_s_type(Float32, Int8)
+  float_to_int_s_type(Float32, Int16)
+  float_to_int_s_type(Float64, Int8)
+  float_to_int_s_type(Float64, Int16)
+  float_to_int_s_type(Float64, Int32)
+}
+
+void test_operand_folding(DiffTestSuite& suite) {
+  #define sib_load_type(type, size, shift) \
+    suite.diff_test("sib_load_shl_" #type).run([](Builder& builder, TestData& data) { \
+      Value* array = builder.build_alloca(builder.build_const(Type::Int64, 4 * size), size); \
+      for (size_t it = 0; it < 4; it++) { \
+        builder.build_store(array, data.input(Type::type), AliasingGroup(1), it * size); \
+      } \
+      Value* index = data.input(RandomRange(Type::Int64, 0, 3)); \
+      Value* offset = builder.build_shl(index, builder.build_const(Type::Int64, shift)); \
+      Value* ptr = builder.build_add_ptr(array, offset); \
+      data.output(builder.build_load(ptr, Type::type, LoadFlags::None, AliasingGroup(1), 0)); \
+    }); \
+    suite.diff_test("sib_load_mul_" #type).run([](Builder& builder, TestData& data) { \
+      Value* array = builder.build_alloca(builder.build_const(Type::Int64, 4 * size + 8), size); \
+      for (size_t it = 0; it < 4; it++) { \
+        builder.build_store(array, data.input(Type::type), AliasingGroup(1), 8 + it * size); \
+      } \
+      Value* index = data.input(RandomRange(Type::Int64, 0, 3)); \
+      Value* offset = builder.build_mul(index, builder.build_const(Type::Int64, size)); \
+      Value* ptr = builder.build_add_ptr(array, offset); \
+      data.output(builder.build_load(ptr, Type::type, LoadFlags::None, AliasingGroup(1), 8)); \
+    });
+
+  sib_load_type(Int8, 1, 0)
+  sib_load_type(Int16, 2, 1)
+  sib_load_type(Int32, 4, 2)
+  sib_load_type(Int64, 8, 3)
+
+  suite.diff_test("sib_store_Int32").run([](Builder& builder, TestData& data) {
+    Value* array = builder.build_alloca(builder.build_const(Type::Int64, 16), 4);
+    for (size_t it = 0; it < 4; it++) {
+      builder.build_store(array, builder.build_const(Type::Int32, it), AliasingGroup(1), it * 4);
+    }
+    Value* index = data.input(RandomRange(Type::Int64, 0, 3));
+    Value* offset = builder.build_shl(index, builder.build_const(Type::Int64, 2));
+    builder.build_store(builder.build_add_ptr(array, offset), data.input(Type::Int32), AliasingGroup(1), 0);
+    for (size_t it = 0; it < 4; it++) {
+      data.output(builder.build_load(array, Type::Int32, LoadFlags::None, AliasingGroup(1), it * 4));
+    }
+  });
+
+  // The loaded value must not be read again after the store
+  suite.diff_test("fold_load_clobbered").run([](Builder& builder, TestData& data) {
+    Value* ptr = builder.build_alloca(builder.build_const(Type::Int64, 8), 8);
+    builder.build_store(ptr, data.input(Type::Int64), AliasingGroup(1), 0);
+    Value* loaded = builder.build_load(ptr, Type::Int64, LoadFlags::None, AliasingGroup(1), 0);
+    builder.build_store(ptr, data.input(Type::Int64), AliasingGroup(1), 0);
+    data.output(builder.build_sub(data.input(Type::Int64), loaded));
+  });
+
+  suite.diff_test("fold_load_select_Int32").run([](Builder& builder, TestData& data) {
+    Value* a = data.input(Type::Int32);
+    Value* b = data.input(Type::Int32);
+    Value* cond = builder.build_eq(data.input(RandomRange(Type::Int32, 0, 1)), builder.build_const(Type::Int32, 0));
+    data.output(builder.build_select(cond, a, b));
+  });
+}
+
+void test_imm_forms(DiffTestSuite& suite) {
+  #define test_and_type(type) \
+    suite.diff_test("test_and_" #type).run([](Builder& builder, TestData& data) { \
+      Value* masked = builder.build_and(data.input(Type::type), data.input(Type::type)); \
+      data.output(builder.build_eq(masked, builder.build_const(Type::type, 0))); \
+    }); \
+    suite.diff_test("test_and_" #type "_imm").run([](Builder& builder, TestData& data) { \
+      Value* masked = builder.build_and(data.input(Type::type), RandomRange(Type::type).gen_const(builder)); \
+      data.output(builder.build_eq(masked, builder.build_const(Type::type, 0))); \
+    }); \
+    suite.diff_test("test_and_sign_" #type).run([](Builder& builder, TestData& data) { \
+      Value* masked = builder.build_and(data.input(Type::type), RandomRange(Type::type).gen_const(builder)); \
+      data.output(builder.build_lt_s(masked, builder.build_const(Type::type, 0))); \
+    });
+
+  test_and_type(Int8)
+  test_and_type(Int16)
+  test_and_type(Int32)
+  test_and_type(Int64)
+
+  #define rmw_imm_type(name, type) \
+    suite.diff_test("rmw_imm_" #name "_" #type).run([](Builder& builder, TestData& data) { \
+      Value* ptr = builder.build_alloca(builder.build_const(Type::Int64, 8), 8); \
+      builder.build_store(ptr, data.input(Type::type), AliasingGroup(1), 0); \
+      Value* loaded = builder.build_load(ptr, Type::type, LoadFlags::None, AliasingGroup(1), 0); \
+      Value* value = builder.build_##name(loaded, RandomRange(Type::type).gen_const(builder)); \
+      builder.build_store(ptr, value, AliasingGroup(1), 0); \
+      data.output(builder.build_load(ptr, Type::type, LoadFlags::None, AliasingGroup(1), 0)); \
+    });
+
+  #define rmw_imm(name) \
+    rmw_imm_type(name, Int8) \
+    rmw_imm_type(name, Int16) \
+    rmw_imm_type(name, Int32) \
+    rmw_imm_type(name, Int64)
+
+  rmw_imm(add)
+  rmw_imm(sub)
+  rmw_imm(and)
+  rmw_imm(or)
+  rmw_imm(xor)
+}
+
+void test_peephole(DiffTestSuite& suite) {
+  // The mask after setcc can only be dropped when the upper bytes are never read
+  suite.diff_test("peephole_setcc_store_and_resize").run([](Builder& builder, TestData& data) {
+    Value* cond = builder.build_lt_s(data.input(Type::Int32), data.input(Type::Int32));
+    data.output(cond);
+    data.output(builder.build_resize_u(cond, Type::Int64));
+  });
+
+  // The zero extended condition is used as an index in a byte compare
+  suite.diff_test("peephole_setcc_address").run([](Builder& builder, TestData& data) {
+    Value* cond = builder.build_lt_s(data.input(Type::Int32), data.input(Type::Int32));
+    Value* array = builder.build_alloca(builder.build_const(Type::Int64, 8), 8);
+    builder.build_store(array, data.input(Type::Int8), AliasingGroup(1), 0);
+    builder.build_store(array, data.input(Type::Int8), AliasingGroup(1), 1);
+    Value* ptr = builder.build_add_ptr(array, builder.build_resize_u(cond, Type::Int64));
+    Value* value = builder.build_load(ptr, Type::Int8, LoadFlags::None, AliasingGroup(1), 0);
+    data.output(builder.build_eq(value, builder.build_const(Type::Int8, 7)));
+  });
+
+  suite.diff_test("peephole_add_ptr_chain").run([](Builder& builder, TestData& data) {
+    Value* array = builder.build_alloca(builder.build_const(Type::Int64, 32), 8);
+    Value* ptr = array;
+    for (size_t it = 0; it < 4; it++) {
+      builder.build_store(ptr, data.input(Type::Int64), AliasingGroup(1), 0);
+      ptr = builder.build_add_ptr(ptr, builder.build_const(Type::Int64, 8));
+    }
+    Value* index = builder.build_shl(data.input(RandomRange(Type::Int64, 0, 3)), builder.build_const(Type::Int64, 3));
+    data.output(builder.build_load(builder.build_add_ptr(array, index), Type::Int64, LoadFlags::None, AliasingGroup(1), 0));
+  });
+
+  suite.diff_test("peephole_spill_reload").aot(false).run([](Builder& builder, TestData& data) {
+    std::vector<Value*> values;
+    for (size_t it = 0; it < 20; it++) {
+      values.push_back(data.input(Type::Int64));
+    }
+    Value* sum = builder.build_const(Type::Int64, 0);
+    for (size_t it = 0; it < values.size(); it++) {
+      sum = builder.build_add(sum, builder.build_mul(values[it], values[values.size() - 1 - it]));
+    }
+    for (Value* value : values) {
+      sum = builder.build_xor(sum, value);
+    }
+    data.output(sum);
+  });
+}
+
+void test_register_pressure(DiffTestSuite& suite) {
+  // More live values than registers, the AOT register allocator cannot spill yet
+  #define register_pressure_type(type, count) \
+    suite.diff_test("register_pressure_" #type).aot(false).run([](Builder& builder, TestData& data) { \
+      std::vector<Value*> values; \
+      for (size_t it = 0; it < count; it++) { \
+        values.push_back(data.input(Type::type)); \
+      } \
+      Value* sum = values.back(); \
+      for (size_t it = count - 1; it-- > 0; ) { \
+        sum = builder.build_sub(builder.build_add(sum, values[it]), values[count - 1 - it]); \
+      } \
+      data.output(sum); \
+    });
+
+  register_pressure_type(Int32, 24)
+  register_pressure_type(Int64, 24)
+
+  // Converted from integers to avoid NaN payloads, which differ between backends
+  suite.diff_test("register_pressure_Float64").aot(false).interpreter(false).run([](Builder& builder, TestData& data) {
+    std::vector<Value*> values;
+    for (size_t it = 0; it < 24; it++) {
+      values.push_back(builder.build_int_to_float_s(data.input(Type::Int32), Type::Float64));
+    }
+    Value* sum = values.back();
+    for (size_t it = values.size() - 1; it-- > 0; ) {
+      sum = builder.build_sub_f(builder.build_add_f(sum, values[it]), values[values.size() - 1 - it]);
+    }
+    data.output(sum);
+  });
+
+  // Spilled stack addresses are recomputed instead of reloaded
+  suite.diff_test("register_pressure_alloca").aot(false).run([](Builder& builder, TestData& data) {
+    std::vector<Value*> ptrs;
+    for (size_t it = 0; it < 24; it++) {
+      ptrs.push_back(builder.build_alloca(builder.build_const(Type::Int64, 8), 8));
+    }
+    for (size_t it = 0; it < ptrs.size(); it++) {
+      builder.build_store(ptrs[it], data.input(Type::Int64), AliasingGroup(0), 0);
+    }
+    Value* sum = builder.build_const(Type::Int64, 0);
+    for (size_t it = 0; it < ptrs.size(); it++) {
+      Value* value = builder.build_load(ptrs[it], Type::Int64, LoadFlags::None, AliasingGroup(0), 0);
+      sum = builder.build_add(sum, value);
+      builder.build_store(ptrs[ptrs.size() - 1 - it], sum, AliasingGroup(0), 0);
+    }
+    for (size_t it = 0; it < ptrs.size(); it++) {
+      Value* value = builder.build_load(ptrs[it], Type::Int64, LoadFlags::None, AliasingGroup(0), 0);
+      sum = builder.build_sub(sum, value);
+    }
+    data.output(sum);
+  });
+}
+
 int main(int argc, char** argv) {
   LLVMCodeGen::initilize_llvm_jit();
 
@@ -493,6 +827,11 @@ int main(int argc, char** argv) {
   test_alloca(suite);
   test_call(suite);
   test_binop_f(suite);
+  test_int_float_conv(suite);
+  test_operand_folding(suite);
+  test_imm_forms(suite);
+  test_peephole(suite);
+  test_register_pressure(suite);
 
   return suite.finish();
 }
\ No newline at end of file
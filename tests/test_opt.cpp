@@ -53,8 +53,11 @@ void check_cse(const std::string& expected, Section* section) {
   unittest_assert(ss.str() == expected);
 }
 
-void check_block_order(const std::string& expected, Section* section, BlockOrdering target_order = BlockOrdering::Natural) {
-  section->order_blocks(target_order);
+void check_block_order(const std::string& expected,
+                       Section* section,
+                       BlockOrdering target_order = BlockOrdering::Natural,
+                       BlockLayout layout = BlockLayout::Default) {
+  section->order_blocks(target_order, layout);
   unittest_assert (!section->verify(std::cout));
   std::stringstream ss;
   section->write(ss);
@@ -313,6 +316,49 @@ b0(%0: Ptr):
   Exit
 }
 )", builder.section());
+  });
+  suite.diff_test("simplifycfg twice with unreachable block").run([](Builder& builder, TestData& data) {
+    Value* cond = data.input(Type::Bool);
+    Block* unreachable = builder.build_block();
+    Block* then_block = builder.build_block();
+    Block* else_block = builder.build_block();
+    Block* merge_block = builder.build_block({Type::Int64});
+
+    builder.build_branch(cond, then_block, else_block);
+    builder.move_to_end(unreachable);
+    builder.build_exit();
+    builder.move_to_end(then_block);
+    builder.build_jump(merge_block, {builder.build_const(Type::Int64, 1)});
+    builder.move_to_end(else_block);
+    builder.build_jump(merge_block, {builder.build_const(Type::Int64, 2)});
+    builder.move_to_end(merge_block);
+    data.output(merge_block->arg(0));
+    builder.build_exit();
+
+    Section* section = builder.section();
+    metajit::SimplifyCFG::run(section);
+
+    // Block names must not have gaps after removing the unreachable block
+    section->autoname();
+    size_t index = 0;
+    for (Block* block : *section) {
+      unittest_assert(block->name() == index++);
+    }
+    unittest_assert(section->block_count() == index);
+
+    check_simplifycfg(R"(section {
+b0(%0: Ptr):
+  %1 = Load %0, type=Bool, flags={}, aliasing=0, offset=0
+  Branch %1, true_block=b1, false_block=b2
+b1:
+  Jump 1:Int64, block=b3
+b2:
+  Jump 2:Int64, block=b3
+b3(%5: Int64):
+  Store %0, %5, aliasing=0, offset=8
+  Exit
+}
+)", section);
   });
   suite.diff_test("simplifycfg branch with const true").run([](Builder& builder, TestData& data) {
     Value* cond = builder.build_const(Type::Bool, 1);
@@ -906,6 +952,66 @@ b3:
     assert(builder.section()->ordering() == BlockOrdering::Topological);
   });
 
+  suite.diff_test("block order sinks side exits").run([](Builder& builder, TestData& data) {
+    Value* limit = data.input(RandomRange(Type::Int32, 0, 20));
+
+    Block* loop_block = builder.build_block({Type::Int32});
+    Block* body_block = builder.build_block();
+    Block* fail_block = builder.build_block();
+    Block* next_block = builder.build_block();
+    Block* after_block = builder.build_block();
+
+    builder.build_jump(loop_block, {builder.build_const(Type::Int32, 0)});
+
+    builder.move_to_end(loop_block);
+    Value* counter = loop_block->arg(0);
+    builder.build_branch(
+      builder.build_lt_u(counter, builder.build_const(Type::Int32, 10)),
+      body_block,
+      after_block
+    );
+
+    builder.move_to_end(body_block);
+    builder.build_branch(builder.build_eq(counter, limit), fail_block, next_block);
+
+    builder.move_to_end(next_block);
+    builder.build_jump(loop_block, {
+      builder.build_add(counter, builder.build_const(Type::Int32, 1))
+    });
+
+    builder.move_to_end(after_block);
+    data.output(counter);
+    builder.build_exit();
+
+    builder.move_to_end(fail_block);
+    builder.build_store(builder.entry_arg(0), counter, AliasingGroup(0), 4);
+    builder.build_side_exit(1);
+
+    builder.section()->set_ordering(BlockOrdering::None);
+    check_block_order(R"(section {
+b0(%0: Ptr):
+  %1 = Load %0, type=Int32, flags={}, aliasing=0, offset=0
+  Jump 0:Int32, block=b1
+b1(%3: Int32):
+  %4 = LtU %3, 10:Int32
+  Branch %4, true_block=b2, false_block=b4
+b2:
+  %6 = Eq %3, %1
+  Branch %6, true_block=b5, false_block=b3
+b3:
+  %8 = Add %3, 1:Int32
+  Jump %8, block=b1
+b4:
+  Store %0, %3, aliasing=0, offset=4
+  Exit
+b5:
+  Store %0, %3, aliasing=0, offset=4
+  SideExit id=1
+}
+)", builder.section(), BlockOrdering::Natural, BlockLayout::ColdTail);
+    assert(builder.section()->ordering() == BlockOrdering::Natural);
+  });
+
   suite.test("cse does not merge distinct allocas").run([]() {
     Context context;
     Allocator allocator;
@@ -938,5 +1044,69 @@ b0(%0: Ptr):
     delete section;
   });
 
+  suite.test("frozen section").run([]() {
+    Context context;
+    Allocator allocator;
+    Section* section = new Section(context, allocator);
+    Builder builder(section);
+    builder.move_to_end(builder.build_block({Type::Int64, Type::Ptr}));
+    Block* target = builder.build_block({Type::Int64, Type::Int64, Type::Int64, Type::Int64});
+    Value* sum = builder.build_add(builder.entry_arg(0), builder.build_const(Type::Int64, 1000));
+    builder.build_jump(target, {sum, sum, builder.entry_arg(0), builder.build_const(Type::Int64, 1000)});
+    builder.move_to_end(target);
+    builder.build_store(builder.entry_arg(1), target->arg(3), AliasingGroup(0), 0);
+    builder.build_exit();
+
+    FrozenSection frozen(section);
+    unittest_assert(frozen.block_count() == 2 && frozen.inst_count() == 4);
+    unittest_assert(frozen.block(1).first_inst == 2 && frozen.block(1).arg_count == 4);
+
+    const FrozenSection::FrozenInst& add = frozen.at(0);
+    unittest_assert(add.opcode == Opcode::Add && add.value_type() == Type::Int64);
+    unittest_assert(frozen.value(frozen.args(add)[0]) == builder.entry_arg(0));
+
+    const FrozenSection::FrozenInst& jump = frozen.at(1);
+    unittest_assert(jump.arg_count == 4);
+    lwir::Span<const FrozenSection::Id> args = frozen.args(jump);
+    unittest_assert(FrozenSection::is_inst(args[0]) && FrozenSection::id_index(args[0]) == 0);
+    unittest_assert(args[0] == args[1] && args[3] == frozen.args(add)[1]);
+    unittest_assert(frozen.value(args[3]) == builder.build_const(Type::Int64, 1000));
+
+    for (size_t it = 0; it < frozen.inst_count(); it++) {
+      unittest_assert(frozen.at(it).opcode == frozen.inst(it)->opcode());
+    }
+
+    delete section;
+  });
+
+  suite.test("incremental naming").run([]() {
+    Context context;
+    Allocator allocator;
+    Section* section = new Section(context, allocator);
+    Builder builder(section);
+    builder.move_to_end(builder.build_block({Type::Int64, Type::Ptr}));
+    builder.build_add(builder.entry_arg(0), builder.build_const(Type::Int64, 1));
+    builder.build_store(builder.entry_arg(1), builder.entry_arg(0), AliasingGroup(0), 0);
+    Inst* exit = builder.build_exit();
+
+    section->autoname();
+    size_t generation = section->name_generation();
+    size_t name_count = section->name_count();
+    unittest_assert(!section->names_dirty());
+
+    // Removing instructions keeps the existing names
+    DeadCodeElim::run(section);
+    unittest_assert(section->name_generation() == generation);
+    unittest_assert(section->name_count() == name_count);
+
+    builder.move_before(section->entry(), exit);
+    builder.build_add(builder.entry_arg(0), builder.entry_arg(0));
+    unittest_assert(section->names_dirty());
+    section->autoname();
+    unittest_assert(section->name_generation() == generation + 1);
+
+    delete section;
+  });
+
   return suite.finish();
 }
@@ -480,5 +480,48 @@ int main(int argc, char** argv) {
     return result;
   });
 
+  // The exit id is returned to the caller, so sections which only differ in
+  // the id of a side exit are not refinements of each other
+  suite.test("side_exit_id_refinement").run([]() {
+    Context context;
+    Allocator allocator;
+
+    auto build = [&](uint32_t exit_id, tv::TVTestData& data) {
+      Section* section = new Section(context, allocator);
+      Builder builder(section);
+      data = tv::TVTestData(builder, {Type::Bool, Type::Int32});
+      data.output(data.input(1));
+
+      Block* exit_block = builder.build_block();
+      Block* side_exit_block = builder.build_block();
+      builder.build_branch(data.input(0), side_exit_block, exit_block);
+      builder.move_to_end(exit_block);
+      builder.build_exit();
+      builder.move_to_end(side_exit_block);
+      builder.build_side_exit(exit_id);
+      return section;
+    };
+
+    tv::TVTestData data;
+    Section* before = build(1, data);
+    tv::TVTestData other_data;
+    Section* same = build(1, other_data);
+    Section* renumbered = build(2, other_data);
+
+    tv::check_tv_refinement(before, same, data);
+
+    bool failed = false;
+    try {
+      tv::check_tv_refinement(before, renumbered, data);
+    } catch (std::runtime_error& err) {
+      failed = true;
+    }
+    unittest_assert(failed);
+
+    delete before;
+    delete same;
+    delete renumbered;
+  });
+
   return suite.finish();
 }
\ No newline at end of file
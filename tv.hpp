@@ -289,6 +289,7 @@ namespace metajit {
       std::unordered_map<Block*, BlockData> _blocks;
       std::unordered_map<NamedValue*, ValueState> _values;
       size_t _freeze_counter = 0;
+      z3::expr _exit_id; // Returned to the caller, Exit returns 0
 
     public:
       ValueState emit(Value* value) {
@@ -356,6 +357,11 @@ namespace metajit {
         }
       }
 
+      void enter_exit(Block* from, uint32_t id) {
+        _exit_id = z3::ite(_blocks.at(from).active, _context.bv_val(id, 32), _exit_id);
+        enter(nullptr, from, _context.bool_val(true), {});
+      }
+
       MemoryState& memory_state(Block* block) {
         BlockData& block_data = _blocks.at(block);
         assert(block_data.memory_state.has_value());
@@ -377,7 +383,7 @@ namespace metajit {
           std::string name = "freeze_" + std::to_string(_freeze_counter++);
           z3::expr arbitrary = _context.bv_const(name.c_str(), type_width(freeze->type()));
           return ValueState(freeze->type(), z3::ite(input.is_poison(), arbitrary, input.value()));
-        } else if (dynamic_cast<PromoteInst*>(inst) || dynamic_cast<AssumeConstInst*>(inst)) {
+        } else if (dyn_cast<PromoteInst>(inst) || dyn_cast<AssumeConstInst>(inst)) {
           return emit(inst->arg(0));
         } else if (dynmatch(SelectInst, select, inst)) {
           ValueState cond_state = emit(select->arg(0));
@@ -430,7 +436,7 @@ namespace metajit {
         }
 
         #define binop(InstType, expression) \
-          else if (dynamic_cast<InstType*>(inst)) { \
+          else if (dyn_cast<InstType>(inst)) { \
             z3::expr a = emit(inst->arg(0)).value(); \
             z3::expr b = emit(inst->arg(1)).value(); \
             ValueState result(inst->type(), expression); \
@@ -439,7 +445,7 @@ namespace metajit {
           }
 
         #define binop_divmod(InstType, expression) \
-          else if (dynamic_cast<InstType*>(inst)) { \
+          else if (dyn_cast<InstType>(inst)) { \
             z3::expr a = emit(inst->arg(0)).value(); \
             z3::expr b = emit(inst->arg(1)).value(); \
             ValueState result(inst->type(), expression); \
@@ -449,7 +455,7 @@ namespace metajit {
           }
 
         #define binop_shift(InstType, expression) \
-          else if (dynamic_cast<InstType*>(inst)) { \
+          else if (dyn_cast<InstType>(inst)) { \
             z3::expr a = emit(inst->arg(0)).value(); \
             z3::expr b = emit(inst->arg(1)).value(); \
             ValueState result(inst->type(), expression); \
@@ -492,8 +498,10 @@ namespace metajit {
             args.push_back(emit(arg));
           }
           enter(jump->block(), block, _context.bool_val(true), args);
-        } else if (dynmatch(ExitInst, exit, inst)) {
-          enter(nullptr, block, _context.bool_val(true), {});
+        } else if (dyn_cast<ExitInst>(inst)) {
+          enter_exit(block, 0);
+        } else if (dynmatch(SideExitInst, side_exit, inst)) {
+          enter_exit(block, side_exit->id());
         } else if (dynmatch(CommentInst, comment, inst)) {
         } else {
           assert(false && "Unknown instruction");
@@ -536,13 +544,16 @@ namespace metajit {
         return memory_state(nullptr);
       }
 
+      z3::expr exit_id() const { return _exit_id; }
+
       Z3CodeGen(Section* section,
                 z3::context& context,
                 std::vector<ValueState> entry_args,
                 MemoryState entry_memory_state):
           Pass<Z3CodeGen>(section),
           _section(section),
-          _context(context) {
+          _context(context),
+          _exit_id(context.bv_val(0, 32)) {
         
         for (Block* block : *section) {
           _blocks.emplace(block, BlockData(context, block));
@@ -720,9 +731,11 @@ namespace metajit {
       z3::solver solver(z3_context);
       solver.set("timeout", (unsigned) 5000); // 5 second timeout per query
 
-      // For each output slot, check refinement:
-      // before is NOT UB AND before result is NOT poison AND
+      // The exit id is part of the final state. For each output slot, check
+      // refinement: before is NOT UB AND before result is NOT poison AND
       // (after result IS poison OR values differ)
+      z3::expr counterexample = !before_cg.has_ub() &&
+        before_cg.exit_id() != after_cg.exit_id();
       for (const TVTestData::Output& output : data.outputs()) {
         ValueState ptr(Type::Ptr,
           data_ptr.value() + z3_context.bv_val(output.offset, type_width(Type::Ptr)),
@@ -732,13 +745,13 @@ namespace metajit {
         ValueState before_val = before_cg.exit_memory_state().load(ptr, output.type);
         ValueState after_val  = after_cg.exit_memory_state().load(ptr, output.type);
 
-        z3::expr counterexample =
+        counterexample = counterexample || (
           !before_cg.has_ub() &&
           !before_val.is_poison() &&
-          (after_val.is_poison() || before_val.value() != after_val.value());
-
-        solver.add(counterexample.simplify());
+          (after_val.is_poison() || before_val.value() != after_val.value())
+        );
       }
+      solver.add(counterexample.simplify());
 
       z3::check_result result = solver.check();
       if (result == z3::sat) {
@@ -750,6 +763,9 @@ namespace metajit {
           ValueState arg = before_cg.emit(before->entry()->arg(1 + it)).eval(model);
           stream << "  input" << it << " = " << arg.value() << "\n";
         }
+        stream << "Exit id:\n";
+        stream << "  before: " << model.eval(before_cg.exit_id(), true) << "\n";
+        stream << "  after:  " << model.eval(after_cg.exit_id(), true) << "\n";
         stream << "Outputs:\n";
         for (const TVTestData::Output& output : data.outputs()) {
           ValueState ptr(Type::Ptr,
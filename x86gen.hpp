@@ -16,12 +16,16 @@
 
 #include <variant>
 #include <fstream>
+#include <queue>
 
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <unistd.h>
+#include <cpuid.h>
+#include <elf.h>
 
 #include "jitir.hpp"
+#include "codearena.hpp"
 
 namespace metajit {
   class Reg {
@@ -29,6 +33,13 @@ namespace metajit {
     enum class Kind {
       Invalid, Virtual, Physical
     };
+
+    enum class Class {
+      GPR, XMM
+    };
+
+    // Physical ids 0-15 are general purpose registers, 16-31 are XMM registers
+    static constexpr size_t XMM_BASE = 16;
   private:
     Kind _kind = Kind::Invalid;
     size_t _id = 0;
@@ -57,6 +68,8 @@ namespace metajit {
     static constexpr Reg X86_R14() { return phys(14); }
     static constexpr Reg X86_R15() { return phys(15); }
 
+    static constexpr Reg X86_XMM(size_t index) { return phys(XMM_BASE + index); }
+
     static constexpr Reg virt(size_t id) {
       return Reg(Kind::Virtual, id);
     }
@@ -68,6 +81,9 @@ namespace metajit {
     bool is_virtual() const { return _kind == Kind::Virtual; }
     bool is_physical() const { return _kind == Kind::Physical; }
 
+    bool is_xmm() const { return _kind == Kind::Physical && _id >= XMM_BASE; }
+    Class reg_class() const { return is_xmm() ? Class::XMM : Class::GPR; }
+
     bool operator==(const Reg& other) const {
       if (_kind == other._kind) {
         switch (_kind) {
@@ -100,7 +116,11 @@ namespace metajit {
           stream << "v" << _id;
         break;
         case Kind::Physical:
-          stream << "p" << _id;
+          if (is_xmm()) {
+            stream << "xmm" << (_id - XMM_BASE);
+          } else {
+            stream << "p" << _id;
+          }
         break;
       }
     }
@@ -158,6 +178,7 @@ namespace metajit {
     Reg _reg;
     RM _rm;
     Imm _imm;
+    Reg _vvvv; // Additional register operand of VEX encoded instructions
     void* _data = nullptr;
     size_t _name = 0;
   public:
@@ -167,12 +188,14 @@ namespace metajit {
     Reg reg() const { return _reg; }
     RM rm() const { return _rm; }
     Imm imm() const { return _imm; }
+    Reg vvvv() const { return _vvvv; }
     void* data() const { return _data; }
 
     X86Inst& set_kind(Kind kind) { _kind = kind; return *this; }
     X86Inst& set_reg(Reg reg) { _reg = reg; return *this; }
     X86Inst& set_rm(const RM& rm) { _rm = rm; return *this; }
     X86Inst& set_imm(const Imm& imm) { _imm = imm; return *this; }
+    X86Inst& set_vvvv(Reg vvvv) { _vvvv = vvvv; return *this; }
     X86Inst& set_data(void* data) { _data = data; return *this; }
 
     size_t name() const { return _name; }
@@ -184,6 +207,10 @@ namespace metajit {
         fn(_reg);
       }
 
+      if (!_vvvv.is_invalid()) {
+        fn(_vvvv);
+      }
+
       if (std::holds_alternative<Reg>(_rm)) {
         fn(std::get<Reg>(_rm));
       } else if (std::holds_alternative<Mem>(_rm)) {
@@ -202,6 +229,10 @@ namespace metajit {
         reg = _reg;
       }
       RM rm = _rm;
+      RM vvvv = std::monostate();
+      if (!_vvvv.is_invalid()) {
+        vvvv = _vvvv;
+      }
 
       auto use = [&](RM rm) {
         if (std::holds_alternative<Reg>(rm)) {
@@ -313,6 +344,10 @@ namespace metajit {
       stream << " reg=" << _reg;
     }
 
+    if (!_vvvv.is_invalid()) {
+      stream << " vvvv=" << _vvvv;
+    }
+
     if (std::holds_alternative<Reg>(_rm)) {
       stream << " rm=" << std::get<Reg>(_rm);
     } else if (std::holds_alternative<Mem>(_rm)) {
@@ -326,6 +361,11 @@ namespace metajit {
     } else if (std::holds_alternative<X86Block*>(_imm)) {
       stream << " imm=b" << std::get<X86Block*>(_imm)->name();
     }
+
+    if (_kind == Kind::Mov64Imm64 && _data) {
+      const Symbol* symbol = (const Symbol*) _data;
+      stream << " symbol=@" << std::string(symbol->symbol().data(), symbol->symbol().size());
+    }
   }
 
   struct X86CallData {
@@ -365,6 +405,11 @@ namespace metajit {
       _insert_pos = block->first();
     }
 
+    void move_to_end(X86Block* block) {
+      _block = block;
+      _insert_pos = nullptr;
+    }
+
     X86Block* build_block() {
       X86Block* block = (X86Block*) _allocator.alloc(sizeof(X86Block), alignof(X86Block));
       new (block) X86Block();
@@ -401,12 +446,29 @@ namespace metajit {
         return &build(X86Inst::Kind::kind); \
       }
 
+    #define vex_x86_inst(kind, name, ...) \
+      X86Inst* name(Reg dst, X86Inst::RM src, Reg vvvv) { \
+        return &build(X86Inst::Kind::kind).set_reg(dst).set_rm(src).set_vvvv(vvvv); \
+      }
+
     #include "x86insts.inc.hpp"
 
+    X86Inst* link_ret(X86Inst::Imm id) {
+      return &build(X86Inst::Kind::LinkRet).set_imm(id);
+    }
+
     X86Inst* mov64_imm64(Reg dst, X86Inst::Imm imm) {
       return &build(X86Inst::Kind::Mov64Imm64).set_rm(dst).set_imm(imm);
     }
     
+    X86Inst* imul32_imm(Reg dst, X86Inst::RM src, X86Inst::Imm imm) {
+      return &build(X86Inst::Kind::IMul32Imm).set_reg(dst).set_rm(src).set_imm(imm);
+    }
+
+    X86Inst* imul64_imm(Reg dst, X86Inst::RM src, X86Inst::Imm imm) {
+      return &build(X86Inst::Kind::IMul64Imm).set_reg(dst).set_rm(src).set_imm(imm);
+    }
+
     X86Inst* lea64(Reg dst, X86Inst::Mem src) {
       return &build(X86Inst::Kind::Lea64).set_reg(dst).set_rm(src);
     }
@@ -437,6 +499,9 @@ namespace metajit {
     lwir::Span<const Reg> _preserved_regs;
     Reg _ret_reg;
 
+    uint32_t _preserved_mask = 0;
+    uint8_t _arg_index[32]; // Position in the argument registers, 0xff if not an argument
+
     static constexpr Reg preserve_none_arg_regs[] = {
       Reg::X86_R12(), Reg::X86_R13(), Reg::X86_R14(), Reg::X86_R15(),
       Reg::X86_RDI(), Reg::X86_RSI(), Reg::X86_RDX(), Reg::X86_RCX(),
@@ -470,6 +535,14 @@ namespace metajit {
         default:
           assert(false && "Unsupported calling convention");
       }
+
+      std::fill(_arg_index, _arg_index + 32, 0xff);
+      for (size_t it = 0; it < _arg_regs.size(); it++) {
+        _arg_index[_arg_regs.at(it).id()] = (uint8_t) it;
+      }
+      for (Reg reg : _preserved_regs) {
+        _preserved_mask |= uint32_t(1) << reg.id();
+      }
     }
 
     const lwir::Span<const Reg>& args() const { return _arg_regs; }
@@ -478,39 +551,91 @@ namespace metajit {
     Reg arg(size_t index) const { return _arg_regs.at(index); }
     Reg preserved(size_t index) const { return _preserved_regs.at(index); }
     Reg ret() const { return _ret_reg; }
-
-    // TODO: Optimize
+    uint32_t preserved_mask() const { return _preserved_mask; }
 
     bool is_preserved(Reg reg) const {
-      for (Reg preserved_reg : _preserved_regs) {
-        if (reg == preserved_reg) {
-          return true;
-        }
-      }
-      return false;
+      assert(reg.is_physical());
+      return (_preserved_mask & (uint32_t(1) << reg.id())) != 0;
     }
 
     bool is_arg(Reg reg, size_t arg_count) const {
-      for (size_t it = 0; it < arg_count && it < _arg_regs.size(); it++) {
-        if (reg == _arg_regs.at(it)) {
-          return true;
-        }
+      assert(reg.is_physical());
+      return _arg_index[reg.id()] < arg_count;
+    }
+  };
+
+  // Optional instruction set extensions used by isel
+  struct X86Features {
+    bool bmi1 = false;
+    bool bmi2 = false;
+
+    X86Features() {}
+
+    // Features of the CPU we are running on
+    static X86Features host() {
+      static X86Features features = detect();
+      return features;
+    }
+
+  private:
+    static X86Features detect() {
+      X86Features features;
+      unsigned int eax, ebx, ecx, edx;
+      if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        features.bmi1 = (ebx >> 3) & 1;
+        features.bmi2 = (ebx >> 8) & 1;
       }
-      return false;
+      return features;
     }
   };
 
   class X86CodeGen: public Pass<X86CodeGen> {
   public:
     enum class Mode {
-      JIT, AOT
+      JIT, AOT, LinearScan
+    };
+
+    // Patchable jump of a linkable exit
+    struct ExitSlot {
+      uint32_t id = 0;
+      size_t offset = 0; // Offset of the rel32 displacement in the code
+    };
+
+    // Absolute 64-bit address of a Symbol, resolved when linking object files
+    struct Relocation {
+      size_t offset = 0; // Offset of the imm64 in the code
+      std::string symbol;
     };
 
+    // Peephole patterns in the order they are tried on each instruction
+    #define x86_peepholes(pattern) \
+      pattern(self_mov) \
+      pattern(mov_chain) \
+      pattern(spill_reload) \
+      pattern(setcc_and) \
+      pattern(lea_to_add) \
+      pattern(zero_mov) \
+      pattern(fallthrough_jmp)
+
     struct Stats {
       Timer total;
+      Timer analysis; // Freezing the section and memory_deps
       Timer isel;
       Timer regalloc;
       Timer peephole;
+
+      struct PeepholeHits {
+        #define pattern(name) size_t name = 0;
+        x86_peepholes(pattern)
+        #undef pattern
+      };
+      PeepholeHits peephole_hits;
+
+      size_t frame_size = 0;
+      size_t spill_slots = 0;
+      size_t alloca_bytes = 0; // Requested by Alloca instructions
+      size_t alloca_frame_bytes = 0; // Occupied in the frame after sharing
+      size_t rematerialized = 0;
     };
   private:
     struct Interval {
@@ -542,20 +667,48 @@ namespace metajit {
     };
 
     struct VRegInfo {
+      Reg::Class reg_class = Reg::Class::GPR;
       Reg fixed;
       Interval interval;
       Reg current_reg;
       size_t stack_offset = ~size_t(0);
+      size_t defs = 0;
+      X86Inst* remat = nullptr; // Def which can be re-emitted instead of reloading
+      Reg hint; // Preferred physical register
+      Reg copy; // Block argument this vreg is passed to
     };
 
     Section* _section;
     Allocator& _allocator;
     Mode _mode;
+    X86Features _features;
+    bool _link_exits = false;
+    std::vector<Reg> _input_pregs;
+    std::vector<ExitSlot> _exit_slots;
+    std::vector<Relocation> _relocations;
+    std::vector<size_t> _loop_offsets;
+    size_t _long_jump_count = 0;
 
     std::vector<X86Block*> _blocks;
+    std::vector<X86Block*> _layout; // Emission order of _blocks
+    std::vector<size_t> _layout_pos;
     X86InstBuilder _builder;
 
+    // Stack storage of an Alloca, placed once live ranges are known
+    struct AllocaSlot {
+      AllocaInst* alloca = nullptr;
+      X86Inst* lea = nullptr;
+      size_t size = 0;
+      size_t align = 0;
+      Interval lifetime;
+      bool escapes = false;
+    };
+    std::vector<AllocaSlot> _alloca_slots;
+
     NameMap<void*> _memory_deps;
+    NameMap<size_t> _use_counts;
+    NameMap<size_t> _inst_pos;
+    NameMap<size_t> _load_valid_until;
 
     NameMap<Reg> _vregs;
     std::vector<VRegInfo> _vreg_info;
@@ -564,42 +717,100 @@ namespace metajit {
     Stats _stats;
     #endif
     
-    void memory_deps() {
-      for (Block* block : *_section) {
+    void memory_deps(const FrozenSection& frozen) {
+      std::vector<size_t> use_counts(frozen.inst_count(), 0);
+      for (const FrozenSection::FrozenInst& inst : frozen.insts()) {
+        for (FrozenSection::Id arg : frozen.args(inst)) {
+          if (FrozenSection::is_inst(arg)) {
+            use_counts[FrozenSection::id_index(arg)]++;
+          }
+        }
+      }
+
+      // Instructions are numbered across the section. A load may be read again
+      // at any position before _load_valid_until, which is the next potentially
+      // aliasing store or call, or the end of the block.
+      size_t pos = 0;
+      for (const FrozenSection::FrozenBlock& frozen_block : frozen.blocks()) {
         std::unordered_map<AliasingGroup, void*> last_store;
-        for (Inst* inst : *block) {
+        std::unordered_map<AliasingGroup, std::vector<LoadInst*>> valid_loads;
+        void* barrier = (void*) frozen_block.block;
+
+        auto invalidate = [&](std::vector<LoadInst*>& loads) {
+          for (LoadInst* load : loads) {
+            _load_valid_until[load] = pos;
+          }
+          loads.clear();
+        };
+
+        size_t end = frozen_block.first_inst + frozen_block.inst_count;
+        for (size_t index = frozen_block.first_inst; index < end; index++) {
+          Inst* inst = frozen.inst(index);
+          _inst_pos[inst] = ++pos;
+          _use_counts[inst] = use_counts[index];
+
           #define find_dep(inst) \
-            void* dep = (void*) block; \
+            void* dep = barrier; \
             if (last_store.find(inst->aliasing()) != last_store.end()) { \
               dep = (void*) last_store.at(inst->aliasing()); \
             } \
             _memory_deps[inst] = dep;
           
-          if (dynmatch(LoadInst, load, inst)) {
-            find_dep(load);
-          } else if (dynmatch(StoreInst, store, inst)) {
-            find_dep(store);
-            last_store[store->aliasing()] = store;
-          } else if (dynamic_cast<CallInst*>(inst)) {
-            _memory_deps[inst] = (void*) block;
-            for (auto& [aliasing, dep] : last_store) {
-              dep = (void*) inst;
+          switch (frozen.at(index).opcode) {
+            case Opcode::Load: {
+              LoadInst* load = (LoadInst*) inst;
+              find_dep(load);
+              valid_loads[load->aliasing()].push_back(load);
+              break;
             }
-          } else {
-            _memory_deps[inst] = nullptr;
+            case Opcode::Store: {
+              StoreInst* store = (StoreInst*) inst;
+              find_dep(store);
+              last_store[store->aliasing()] = store;
+              invalidate(valid_loads[store->aliasing()]);
+              break;
+            }
+            case Opcode::Call:
+              _memory_deps[inst] = barrier;
+              barrier = (void*) inst;
+              last_store.clear();
+              for (auto& [aliasing, loads] : valid_loads) {
+                invalidate(loads);
+              }
+            break;
+            default:
+              _memory_deps[inst] = nullptr;
+            break;
           }
 
           #undef find_dep
         }
+
+        pos++;
+        for (auto& [aliasing, loads] : valid_loads) {
+          invalidate(loads);
+        }
       }
     }
 
-    Reg vreg() {
+    Reg vreg(Reg::Class reg_class = Reg::Class::GPR) {
       size_t id = _vreg_info.size();
       _vreg_info.emplace_back();
+      _vreg_info.back().reg_class = reg_class;
       return Reg::virt(id);
     }
 
+    static Reg::Class reg_class(Type type) {
+      return is_float(type) ? Reg::Class::XMM : Reg::Class::GPR;
+    }
+
+    Reg::Class reg_class(Reg reg) const {
+      if (reg.is_virtual()) {
+        return _vreg_info[reg.id()].reg_class;
+      }
+      return reg.reg_class();
+    }
+
     Reg fix_to_preg(Reg vreg, Reg preg) {
       assert(vreg.is_virtual());
       VRegInfo& info = _vreg_info[vreg.id()];
@@ -616,8 +827,40 @@ namespace metajit {
       }
     }
 
+    // Constants sign extended from their size. The upper bits of registers
+    // holding narrower values are undefined, so this is a valid immediate for
+    // operations of any width.
+    static uint64_t imm_value(Const* constant) {
+      size_t shift = 64 - type_size(constant->type()) * 8;
+      return (uint64_t) ((int64_t) (constant->value() << shift) >> shift);
+    }
+
+    // Checks if the constant can be used as the immediate of an ALU operation
+    bool is_alu_imm(Const* constant) {
+      return type_size(constant->type()) < 8 || is_sext_imm32(constant);
+    }
+
+    static bool is_int32(int64_t value) {
+      return value >= INT32_MIN && value <= INT32_MAX;
+    }
+
     Reg vreg(Value* value) {
       if (dynmatch(Const, constant, value)) {
+        if (is_float(constant->type())) {
+          // There is no immediate form for XMM registers, so we go through a GPR
+          Reg bits = vreg();
+          if (constant->type() == Type::Float32) {
+            _builder.mov32_imm(bits, constant->value());
+          } else if (is_sext_imm32(constant)) {
+            _builder.mov64_imm(bits, constant->value());
+          } else {
+            _builder.mov64_imm64(bits, constant->value());
+          }
+          Reg reg = vreg(Reg::Class::XMM);
+          _builder.movq_to_xmm(reg, bits);
+          return reg;
+        }
+
         Reg reg = vreg();
         switch (type_size(constant->type())) {
           case 1: _builder.mov8_imm(reg, constant->value()); break;
@@ -634,10 +877,16 @@ namespace metajit {
             assert(false && "Unsupported constant type");
         }
         return reg;
+      } else if (dynmatch(Symbol, symbol, value)) {
+        assert(type_size(symbol->type()) == 8 && "Symbols must be pointer sized");
+        // The address is filled in by the linker, see Relocation
+        Reg reg = vreg();
+        _builder.mov64_imm64(reg, (uint64_t) 0)->set_data((void*) symbol);
+        return reg;
       } else if (value->is_named()) {
         NamedValue* named = (NamedValue*) value;
         if (_vregs.at(named).is_invalid()) {
-          _vregs[named] = vreg();
+          _vregs[named] = vreg(reg_class(named->type()));
         }
         return _vregs.at(named);
       } else {
@@ -646,8 +895,122 @@ namespace metajit {
       }
     }
 
+    void build_mov(Reg dst, Reg src) {
+      if (reg_class(dst) == Reg::Class::XMM) {
+        _builder.movaps(dst, src);
+      } else {
+        _builder.mov64(dst, src);
+      }
+    }
+
+    bool is_int_cmp(Inst* inst) {
+      return (dyn_cast<EqInst>(inst) ||
+              dyn_cast<LtSInst>(inst) ||
+              dyn_cast<LtUInst>(inst)) &&
+             !is_float(inst->arg(0)->type());
+    }
+
+    bool is_float_cmp(Inst* inst) {
+      return (dyn_cast<EqInst>(inst) && is_float(inst->arg(0)->type())) ||
+             dyn_cast<LtFOInst>(inst) ||
+             dyn_cast<LtFUInst>(inst);
+    }
+
+    // x86 condition codes. Inverting a condition flips the lowest bit.
+    enum class Cond {
+      B = 0x2, AE = 0x3, E = 0x4, NE = 0x5, BE = 0x6, A = 0x7,
+      L = 0xc, GE = 0xd, LE = 0xe, G = 0xf
+    };
+
+    static Cond invert(Cond cond) {
+      return Cond(int(cond) ^ 1);
+    }
+
+    // Matches index * scale where scale is supported by SIB addressing
+    bool match_scaled_index(Value* value, Value*& index, size_t& scale) {
+      if (dynmatch(MulInst, mul, value)) {
+        if (dynmatch(Const, constant_scale, mul->arg(1))) {
+          switch (constant_scale->value()) {
+            case 1: case 2: case 4: case 8:
+              index = mul->arg(0);
+              scale = constant_scale->value();
+              return true;
+          }
+        }
+      } else if (dynmatch(ShlInst, shl, value)) {
+        if (dynmatch(Const, constant_shift, shl->arg(1))) {
+          if (constant_shift->value() <= 3) {
+            index = shl->arg(0);
+            scale = size_t(1) << constant_shift->value();
+            return true;
+          }
+        }
+      }
+      return false;
+    }
+
+    // Memory operand for ptr + offset. Single use AddPtr instructions are
+    // folded into the address.
+    X86Inst::Mem build_mem(Value* ptr, uint64_t offset) {
+      if (dynmatch(AddPtrInst, add_ptr, ptr)) {
+        if (_use_counts.at(add_ptr) == 1) {
+          Value* index = nullptr;
+          size_t scale = 0;
+          if (dynmatch(Const, constant_offset, add_ptr->offset())) {
+            int64_t disp = (int64_t) (offset + constant_offset->value());
+            if (is_int32(disp)) {
+              return X86Inst::Mem(vreg(add_ptr->ptr()), (int32_t) disp);
+            }
+          } else if (match_scaled_index(add_ptr->offset(), index, scale)) {
+            return X86Inst::Mem(vreg(add_ptr->ptr()), scale, vreg(index), (int32_t) offset);
+          } else {
+            return X86Inst::Mem(vreg(add_ptr->ptr()), 1, vreg(add_ptr->offset()), (int32_t) offset);
+          }
+        }
+      }
+      return X86Inst::Mem(vreg(ptr), (int32_t) offset);
+    }
+
+    // Memory operand of a single use load, if its value can be read at inst instead
+    std::optional<X86Inst::Mem> fold_load(Value* value, Inst* inst) {
+      if (dynmatch(LoadInst, load, value)) {
+        if (!is_float(load->type()) &&
+            _use_counts.at(load) == 1 &&
+            _inst_pos.at(load) < _inst_pos.at(inst) &&
+            _inst_pos.at(inst) < _load_valid_until.at(load)) {
+          return build_mem(load->ptr(), load->offset());
+        }
+      }
+      return {};
+    }
+
+    // Matches x ^ -1 which is only used once, returns x
+    Value* match_single_use_not(Value* value) {
+      if (dynmatch(XorInst, xor_inst, value)) {
+        dynmatch(Const, constant, xor_inst->arg(1));
+        if (constant && _use_counts.at(xor_inst) == 1) {
+          if (xor_inst->type() == Type::Bool ? constant->value() == 1 : imm_value(constant) == ~uint64_t(0)) {
+            return xor_inst->arg(0);
+          }
+        }
+      }
+      return nullptr;
+    }
+
+    // Register or memory source operand, loads of the given width are folded
+    X86Inst::RM build_rm_src(Value* value, size_t size, Inst* inst) {
+      if (type_size(value->type()) == size) {
+        if (std::optional<X86Inst::Mem> mem = fold_load(value, inst)) {
+          return mem.value();
+        }
+      }
+      return vreg(value);
+    }
+
     void build_add(Reg dst, Value* a, Value* b) {
       X86Inst::Mem mem;
+      Value* index = nullptr;
+      size_t scale = 0;
       if (dynmatch(Const, constant_b, b)) {
         if (is_sext_imm32(constant_b)) {
           mem = X86Inst::Mem(
@@ -655,19 +1018,13 @@ namespace metajit {
             constant_b->value()
           );
         }
-      } else if (dynmatch(MulInst, mul, b)) {
-        if (dynmatch(Const, constant_scale, mul->arg(1))) {
-          if (constant_scale->value() == 2 ||
-              constant_scale->value() == 4 ||
-              constant_scale->value() == 8) {
-            mem = X86Inst::Mem(
-              vreg(a),
-              constant_scale->value(),
-              vreg(mul->arg(0)),
-              0
-            );
-          }
-        }
+      } else if (match_scaled_index(b, index, scale)) {
+        mem = X86Inst::Mem(
+          vreg(a),
+          scale,
+          vreg(index),
+          0
+        );
       }
 
       if (mem.is_invalid()) {
@@ -682,14 +1039,108 @@ namespace metajit {
       _builder.lea64(dst, mem);
     }
 
-    void build_cmp(Value* a, Value* b) {
+    // Folds a single use load into the second operand of a two operand ALU instruction
+    bool build_binop_mem(Inst* inst, bool is_commutative) {
+      Value* a = inst->arg(0);
+      std::optional<X86Inst::Mem> mem = fold_load(inst->arg(1), inst);
+      if (!mem.has_value() && is_commutative) {
+        a = inst->arg(1);
+        mem = fold_load(inst->arg(0), inst);
+      }
+      if (!mem.has_value()) {
+        return false;
+      }
+
+      Reg dst = vreg(inst);
+      _builder.mov64(dst, vreg(a));
+
+      #define sized_binop(name) \
+        switch (type_size(inst->type())) { \
+          case 1: _builder.name##8(dst, mem.value()); break; \
+          case 2: _builder.name##16(dst, mem.value()); break; \
+          case 4: _builder.name##32(dst, mem.value()); break; \
+          case 8: _builder.name##64(dst, mem.value()); break; \
+          default: assert(false && "Unsupported type"); \
+        }
+
+      if (dyn_cast<AddInst>(inst)) {
+        sized_binop(add);
+      } else if (dyn_cast<SubInst>(inst)) {
+        sized_binop(sub);
+      } else if (dyn_cast<AndInst>(inst)) {
+        sized_binop(and);
+      } else if (dyn_cast<OrInst>(inst)) {
+        sized_binop(or);
+      } else if (dyn_cast<XorInst>(inst)) {
+        sized_binop(xor);
+      } else {
+        assert(false);
+      }
+
+      #undef sized_binop
+      return true;
+    }
+
+    // Compares a and b at the position of inst
+    void build_cmp(Value* a, Value* b, Inst* inst) {
+      // Comparing (x & y) to zero only needs the flags set by test
       if (dynmatch(Const, constant_b, b)) {
-        if (is_sext_imm32(constant_b)) {
+        dynmatch(AndInst, and_inst, a);
+        if (constant_b->value() == 0 && and_inst && _use_counts.at(and_inst) == 1) {
+          Reg x = vreg(and_inst->arg(0));
+          if (dynmatch(Const, mask, and_inst->arg(1))) {
+            if (is_alu_imm(mask)) {
+              switch (type_size(a->type())) {
+                case 1: _builder.test8_imm(x, imm_value(mask)); break;
+                case 2: _builder.test16_imm(x, imm_value(mask)); break;
+                case 4: _builder.test32_imm(x, imm_value(mask)); break;
+                case 8: _builder.test64_imm(x, imm_value(mask)); break;
+                default: assert(false && "Unsupported comparison type");
+              }
+              return;
+            }
+          }
+
+          Reg y = vreg(and_inst->arg(1));
+          switch (type_size(a->type())) {
+            case 1: _builder.test8(x, y); break;
+            case 2: _builder.test16(x, y); break;
+            case 4: _builder.test32(x, y); break;
+            case 8: _builder.test64(x, y); break;
+            default: assert(false && "Unsupported comparison type");
+          }
+          return;
+        }
+      }
+
+      X86Inst::RM lhs;
+      if (std::optional<X86Inst::Mem> mem = fold_load(a, inst)) {
+        lhs = mem.value();
+      } else {
+        lhs = vreg(a);
+      }
+
+      if (dynmatch(Const, constant_b, b)) {
+        if (is_alu_imm(constant_b)) {
+          switch (type_size(a->type())) {
+            case 1: _builder.cmp8_imm(lhs, imm_value(constant_b)); break;
+            case 2: _builder.cmp16_imm(lhs, imm_value(constant_b)); break;
+            case 4: _builder.cmp32_imm(lhs, imm_value(constant_b)); break;
+            case 8: _builder.cmp64_imm(lhs, imm_value(constant_b)); break;
+            default: assert(false && "Unsupported comparison type");
+          }
+          return;
+        }
+      }
+
+      if (std::holds_alternative<Reg>(lhs)) {
+        if (std::optional<X86Inst::Mem> mem = fold_load(b, inst)) {
+          Reg reg = std::get<Reg>(lhs);
           switch (type_size(a->type())) {
-            case 1: _builder.cmp8_imm(vreg(a), constant_b->value()); break;
-            case 2: _builder.cmp16_imm(vreg(a), constant_b->value()); break;
-            case 4: _builder.cmp32_imm(vreg(a), constant_b->value()); break;
-            case 8: _builder.cmp64_imm(vreg(a), constant_b->value()); break;
+            case 1: _builder.cmp8_rm(reg, mem.value()); break;
+            case 2: _builder.cmp16_rm(reg, mem.value()); break;
+            case 4: _builder.cmp32_rm(reg, mem.value()); break;
+            case 8: _builder.cmp64_rm(reg, mem.value()); break;
             default: assert(false && "Unsupported comparison type");
           }
           return;
@@ -697,443 +1148,815 @@ namespace metajit {
       }
 
       switch (type_size(a->type())) {
-        case 1: _builder.cmp8(vreg(a), vreg(b)); break;
-        case 2: _builder.cmp16(vreg(a), vreg(b)); break;
-        case 4: _builder.cmp32(vreg(a), vreg(b)); break;
-        case 8: _builder.cmp64(vreg(a), vreg(b)); break;
+        case 1: _builder.cmp8(lhs, vreg(b)); break;
+        case 2: _builder.cmp16(lhs, vreg(b)); break;
+        case 4: _builder.cmp32(lhs, vreg(b)); break;
+        case 8: _builder.cmp64(lhs, vreg(b)); break;
         default: assert(false && "Unsupported comparison type");
       }
     }
 
-    void build_cmov(Reg res, Value* cond, Reg then) {
+    // Sets the flags for cond at the position of inst. Returns the condition
+    // code under which cond holds. Compares are recomputed here instead of
+    // materializing them, so that cmp and jcc/cmovcc end up adjacent.
+    Cond build_cond(Value* cond, Inst* inst) {
       if (cond->is_inst()) {
         Inst* pred_inst = (Inst*) cond;
-        if (dynamic_cast<EqInst*>(pred_inst) ||
-            dynamic_cast<LtSInst*>(pred_inst) ||
-            dynamic_cast<LtUInst*>(pred_inst)) {
-          build_cmp(pred_inst->arg(0), pred_inst->arg(1));
-          if (dynamic_cast<EqInst*>(pred_inst)) {
-            _builder.cmove64(res, then);
-          } else if (dynamic_cast<LtSInst*>(pred_inst)) {
-            _builder.cmovl64(res, then);
-          } else if (dynamic_cast<LtUInst*>(pred_inst)) {
-            _builder.cmovb64(res, then);
+        if (dynmatch(XorInst, xor_inst, pred_inst)) {
+          dynmatch(Const, constant, xor_inst->arg(1));
+          if (xor_inst->type() == Type::Bool && constant && constant->value() == 1) {
+            return invert(build_cond(xor_inst->arg(0), inst));
+          }
+        } else if (is_int_cmp(pred_inst)) {
+          // Move constants to the right, so they can be used as immediates
+          Value* a = pred_inst->arg(0);
+          Value* b = pred_inst->arg(1);
+          bool is_swapped = false;
+          if (dyn_cast<Const>(a) && !dyn_cast<Const>(b)) {
+            std::swap(a, b);
+            is_swapped = true;
+          }
+
+          build_cmp(a, b, inst);
+          if (dyn_cast<EqInst>(pred_inst)) {
+            return Cond::E;
+          } else if (dyn_cast<LtSInst>(pred_inst)) {
+            return is_swapped ? Cond::G : Cond::L;
+          } else if (dyn_cast<LtUInst>(pred_inst)) {
+            return is_swapped ? Cond::A : Cond::B;
+          }
+          assert(false);
+        } else if (is_float_cmp(pred_inst)) {
+          // ucomis* sets ZF, PF and CF on unordered operands, so E yields an
+          // unordered equality and B an unordered less than. For the ordered
+          // less than, we swap the operands and use A, which is false if unordered.
+          Value* a = pred_inst->arg(0);
+          Value* b = pred_inst->arg(1);
+          if (dyn_cast<LtFOInst>(pred_inst)) {
+            std::swap(a, b);
+          }
+
+          if (a->type() == Type::Float64) {
+            _builder.ucomisd(vreg(a), vreg(b));
           } else {
-            assert(false);
+            _builder.ucomiss(vreg(a), vreg(b));
           }
-          return;
+
+          if (dyn_cast<EqInst>(pred_inst)) {
+            return Cond::E;
+          } else if (dyn_cast<LtFOInst>(pred_inst)) {
+            return Cond::A;
+          } else if (dyn_cast<LtFUInst>(pred_inst)) {
+            return Cond::B;
+          }
+          assert(false);
         }
       }
-      
+
       _builder.test8_imm(vreg(cond), (uint64_t) 1);
-      _builder.cmovnz64(res, then);
+      return Cond::NE;
+    }
+
+    void build_jcc(Cond cond, X86Block* target) {
+      switch (cond) {
+        case Cond::B: _builder.jb(target); break;
+        case Cond::AE: _builder.jae(target); break;
+        case Cond::E: _builder.je(target); break;
+        case Cond::NE: _builder.jne(target); break;
+        case Cond::BE: _builder.jbe(target); break;
+        case Cond::A: _builder.ja(target); break;
+        case Cond::L: _builder.jl(target); break;
+        case Cond::GE: _builder.jge(target); break;
+        case Cond::LE: _builder.jle(target); break;
+        case Cond::G: _builder.jg(target); break;
+      }
+    }
+
+    // Returns the exit id in eax. Linkable exits also pass the entry
+    // arguments on in the input registers, so the linked trace can take over.
+    void build_exit(uint32_t id) {
+      Reg rax = fix_to_preg(vreg(), Reg::X86_RAX());
+      _builder.mov32_imm(rax, (uint64_t) id);
+      _builder.pseudo_use(rax);
+      if (_link_exits) {
+        for (Arg* arg : _section->entry()->args()) {
+          Reg preg = fix_to_preg(vreg(reg_class(arg->type())), _input_pregs[arg->index()]);
+          build_mov(preg, vreg(arg));
+          _builder.pseudo_use(preg);
+        }
+        _builder.link_ret((uint64_t) id);
+      } else {
+        _builder.ret();
+      }
+    }
+
+    void build_setcc(Cond cond, Reg res) {
+      switch (cond) {
+        case Cond::B: _builder.setb8(res); break;
+        case Cond::AE: _builder.setae8(res); break;
+        case Cond::E: _builder.sete8(res); break;
+        case Cond::NE: _builder.setne8(res); break;
+        case Cond::BE: _builder.setbe8(res); break;
+        case Cond::A: _builder.seta8(res); break;
+        case Cond::L: _builder.setl8(res); break;
+        case Cond::GE: _builder.setge8(res); break;
+        case Cond::LE: _builder.setle8(res); break;
+        case Cond::G: _builder.setg8(res); break;
+      }
+    }
+
+    void build_cmov(Reg res, Value* cond, Reg then, Inst* inst) {
+      switch (build_cond(cond, inst)) {
+        case Cond::B: _builder.cmovb64(res, then); break;
+        case Cond::AE: _builder.cmovae64(res, then); break;
+        case Cond::E: _builder.cmove64(res, then); break;
+        case Cond::NE: _builder.cmovnz64(res, then); break;
+        case Cond::BE: _builder.cmovbe64(res, then); break;
+        case Cond::A: _builder.cmova64(res, then); break;
+        case Cond::L: _builder.cmovl64(res, then); break;
+        case Cond::GE: _builder.cmovge64(res, then); break;
+        case Cond::LE: _builder.cmovle64(res, then); break;
+        case Cond::G: _builder.cmovg64(res, then); break;
+      }
     }
 
     void isel(Inst* inst, Block* block) {
-      if (dynmatch(FreezeInst, freeze, inst)) {
-        _builder.mov64(vreg(inst), vreg(freeze->arg(0)));
-      } else if (dynmatch(PromoteInst, promote, inst)) {
-        _builder.mov64(vreg(inst), vreg(promote->arg(0)));
-      } else if (dynmatch(AssumeConstInst, assume_const, inst)) {
-        _builder.mov64(vreg(inst), vreg(assume_const->arg(0)));
-      } else if (dynmatch(SelectInst, select, inst)) {
-        _builder.mov64(vreg(inst), vreg(select->arg(2)));
-        build_cmov(vreg(inst), select->cond(), vreg(select->arg(1)));
-      } else if (dynmatch(ResizeUInst, resize_u, inst)) {
-        if (resize_u->arg(0)->type() == Type::Bool) {
-          _builder.mov64(vreg(inst), vreg(resize_u->arg(0)));
-          _builder.and64_imm(vreg(inst), (uint64_t) 1);
-        } else {
-          switch (type_size(resize_u->arg(0)->type())) {
-            case 1: _builder.movzx8to64(vreg(inst), vreg(resize_u->arg(0))); break;
-            case 2: _builder.movzx16to64(vreg(inst), vreg(resize_u->arg(0))); break;
-            case 4: _builder.mov32(vreg(inst), vreg(resize_u->arg(0))); break;
-            case 8: _builder.mov64(vreg(inst), vreg(resize_u->arg(0))); break;
-            default:
-              assert(false && "Unsupported resize type");
-          }
+      switch (inst->opcode()) {
+        case Opcode::Freeze: {
+          FreezeInst* freeze = (FreezeInst*) inst;
+          build_mov(vreg(inst), vreg(freeze->arg(0)));
+          break;
         }
-      } else if (dynmatch(ResizeSInst, resize_s, inst)) {
-        if (resize_s->arg(0)->type() == Type::Bool) {
-          _builder.mov64_imm(vreg(inst), (uint64_t) 0);
-          Reg ones = vreg();
-          _builder.mov64_imm(ones, ~(uint64_t) 0);
-          build_cmov(vreg(inst), resize_s->arg(0), ones);
-        } else {
-          switch (type_size(resize_s->arg(0)->type())) {
-            case 1: _builder.movsx8to64(vreg(inst), vreg(resize_s->arg(0))); break;
-            case 2: _builder.movsx16to64(vreg(inst), vreg(resize_s->arg(0))); break;
-            case 4: _builder.movsx32to64(vreg(inst), vreg(resize_s->arg(0))); break;
-            case 8: _builder.mov64(vreg(inst), vreg(resize_s->arg(0))); break;
-            default:
-              assert(false && "Unsupported resize type");
-          }
-        }
-      } else if (dynmatch(ResizeXInst, resize_x, inst)) {
-        _builder.mov64(vreg(inst), vreg(resize_x->arg(0)));
-      } else if (dynmatch(LoadInst, load, inst)) {
-        X86Inst::Mem mem(vreg(load->arg(0)), load->offset());
-        switch (type_size(load->type())) {
-          case 1: _builder.mov8(vreg(inst), mem); break;
-          case 2: _builder.mov16(vreg(inst), mem); break;
-          case 4: _builder.mov32(vreg(inst), mem); break;
-          case 8: _builder.mov64(vreg(inst), mem); break;
-          default:
-            assert(false && "Unsupported load type");
+        case Opcode::Promote: {
+          PromoteInst* promote = (PromoteInst*) inst;
+          build_mov(vreg(inst), vreg(promote->arg(0)));
+          break;
         }
-      } else if (dynmatch(StoreInst, store, inst)) {
-        X86Inst::Mem mem(vreg(store->arg(0)), store->offset());
-        if (dynmatch(Const, constant_value, store->arg(1))) {
-          switch (type_size(store->arg(1)->type())) {
-            case 1: _builder.mov8_imm(mem, constant_value->value()); return;
-            case 2: _builder.mov16_imm(mem, constant_value->value()); return;
-            case 4: _builder.mov32_imm(mem, constant_value->value()); return;
-            case 8:
-              if (is_sext_imm32(constant_value)) {
-                _builder.mov64_imm(mem, constant_value->value());
-                return;
-              }
-            break;
-            default:
-              assert(false && "Unsupported store type");
+        case Opcode::AssumeConst: {
+          AssumeConstInst* assume_const = (AssumeConstInst*) inst;
+          build_mov(vreg(inst), vreg(assume_const->arg(0)));
+          break;
+        }
+        case Opcode::Select: {
+          SelectInst* select = (SelectInst*) inst;
+          if (is_float(select->type())) {
+            // No cmov for XMM registers, select the bit patterns in GPRs instead
+            Reg res = vreg();
+            Reg then = vreg();
+            _builder.movq_from_xmm(res, vreg(select->arg(2)));
+            _builder.movq_from_xmm(then, vreg(select->arg(1)));
+            build_cmov(res, select->cond(), then, inst);
+            _builder.movq_to_xmm(vreg(inst), res);
+          } else {
+            _builder.mov64(vreg(inst), vreg(select->arg(2)));
+            build_cmov(vreg(inst), select->cond(), vreg(select->arg(1)), inst);
           }
-        } else if (dynmatch(AddInst, add, store->arg(1))) {
-          LoadInst* load_arg = nullptr;
-          Value* other_arg = nullptr;
-
-          #define find_load(load_index, other_index) \
-            if (dynmatch(LoadInst, load, add->arg(load_index))) { \
-              bool exact_aliasing_matches = load->aliasing() == store->aliasing() && load->aliasing() < 0; \
-              bool ptr_offset_matches = load->arg(0) == store->arg(0) && load->offset() == store->offset(); \
-              if (_memory_deps.at(load) == _memory_deps.at(store) && (exact_aliasing_matches || ptr_offset_matches)) { \
-                load_arg = load; \
-                other_arg = add->arg(other_index); \
-              } \
+          break;
+        }
+        case Opcode::ResizeU: {
+          ResizeUInst* resize_u = (ResizeUInst*) inst;
+          if (resize_u->arg(0)->type() == Type::Bool) {
+            _builder.mov64(vreg(inst), vreg(resize_u->arg(0)));
+            _builder.and64_imm(vreg(inst), (uint64_t) 1);
+          } else {
+            switch (type_size(resize_u->arg(0)->type())) {
+              case 1: _builder.movzx8to64(vreg(inst), vreg(resize_u->arg(0))); break;
+              case 2: _builder.movzx16to64(vreg(inst), vreg(resize_u->arg(0))); break;
+              case 4: _builder.mov32(vreg(inst), vreg(resize_u->arg(0))); break;
+              case 8: _builder.mov64(vreg(inst), vreg(resize_u->arg(0))); break;
+              default:
+                assert(false && "Unsupported resize type");
             }
-          
-          find_load(0, 1);
-          find_load(1, 0);
-
-          #undef find_load
-
-          if (load_arg) {
-            switch (type_size(store->arg(1)->type())) {
-              case 1: _builder.add8_mem(mem, vreg(other_arg)); return;
-              case 2: _builder.add16_mem(mem, vreg(other_arg)); return;
-              case 4: _builder.add32_mem(mem, vreg(other_arg)); return;
-              case 8: _builder.add64_mem(mem, vreg(other_arg)); return;
+          }
+          break;
+        }
+        case Opcode::ResizeS: {
+          ResizeSInst* resize_s = (ResizeSInst*) inst;
+          if (resize_s->arg(0)->type() == Type::Bool) {
+            _builder.mov64_imm(vreg(inst), (uint64_t) 0);
+            Reg ones = vreg();
+            _builder.mov64_imm(ones, ~(uint64_t) 0);
+            build_cmov(vreg(inst), resize_s->arg(0), ones, inst);
+          } else {
+            switch (type_size(resize_s->arg(0)->type())) {
+              case 1: _builder.movsx8to64(vreg(inst), vreg(resize_s->arg(0))); break;
+              case 2: _builder.movsx16to64(vreg(inst), vreg(resize_s->arg(0))); break;
+              case 4: _builder.movsx32to64(vreg(inst), vreg(resize_s->arg(0))); break;
+              case 8: _builder.mov64(vreg(inst), vreg(resize_s->arg(0))); break;
               default:
-                assert(false && "Unsupported store type");
+                assert(false && "Unsupported resize type");
             }
           }
+          break;
         }
-
-        if (store->arg(1)->type() == Type::Bool) {
-          _builder.and64_imm(vreg(store->arg(1)), (uint64_t) 1);
+        case Opcode::ResizeX: {
+          ResizeXInst* resize_x = (ResizeXInst*) inst;
+          _builder.mov64(vreg(inst), vreg(resize_x->arg(0)));
+          break;
         }
-
-        switch (type_size(store->arg(1)->type())) {
-          case 1: _builder.mov8_mem(mem, vreg(store->arg(1))); break;
-          case 2: _builder.mov16_mem(mem, vreg(store->arg(1))); break;
-          case 4: _builder.mov32_mem(mem, vreg(store->arg(1))); break;
-          case 8: _builder.mov64_mem(mem, vreg(store->arg(1))); break;
-          default:
-            assert(false && "Unsupported store type");
-        }
-      } else if (dynmatch(AllocaInst, alloca, inst)) {
-        dynmatch(Const, size_const, alloca->size());
-        assert(size_const && "x86 backend currently requires constant-size Alloca");
-
-        size_t size = size_const->value();
-        assert(size > 0 && "Alloca size must be non-zero");
-
-        size_t offset = _stack_offset_alloc.alloc_bytes(size, alloca->align());
-        Reg rsp = fix_to_preg(vreg(), Reg::X86_RSP());
-        _builder.lea64(vreg(inst), X86Inst::Mem(rsp, (int32_t) offset));
-      } else if (dynmatch(AddPtrInst, add_ptr, inst)) {
-        build_add(vreg(inst), add_ptr->ptr(), add_ptr->offset());
-      } else if (dynmatch(AddInst, add, inst)) {
-        build_add(vreg(inst), add->arg(0), add->arg(1));
-      } else if (dynmatch(SubInst, sub, inst)) {
-        _builder.mov64(vreg(inst), vreg(sub->arg(0)));
-
-        if (dynmatch(Const, constant_b, sub->arg(1))) {
-          if (is_sext_imm32(constant_b)) {
-            _builder.sub64_imm(vreg(inst), constant_b->value());
-            return;
+        case Opcode::IntToFloatS: {
+          IntToFloatSInst* int_to_float_s = (IntToFloatSInst*) inst;
+          Reg src = vreg();
+          switch (type_size(int_to_float_s->arg(0)->type())) {
+            case 1: _builder.movsx8to64(src, vreg(int_to_float_s->arg(0))); break;
+            case 2: _builder.movsx16to64(src, vreg(int_to_float_s->arg(0))); break;
+            case 4: _builder.movsx32to64(src, vreg(int_to_float_s->arg(0))); break;
+            case 8: _builder.mov64(src, vreg(int_to_float_s->arg(0))); break;
+            default:
+              assert(false && "Unsupported int to float type");
           }
-        }
-
-        _builder.sub64(vreg(inst), vreg(sub->arg(1)));
-      } else if (dynmatch(MulInst, mul, inst)) {
-        _builder.mov64(vreg(inst), vreg(mul->arg(0)));
-        _builder.imul64(vreg(inst), vreg(mul->arg(1)));
-      } else if (dynamic_cast<DivUInst*>(inst) ||
-                 dynamic_cast<ModUInst*>(inst) ||
-                 dynamic_cast<DivSInst*>(inst) ||
-                 dynamic_cast<ModSInst*>(inst)) {
-
-        Reg rdx = fix_to_preg(vreg(), Reg::X86_RDX());
-        Reg rax = fix_to_preg(vreg(), Reg::X86_RAX());
 
-        if (dynamic_cast<DivSInst*>(inst) || dynamic_cast<ModSInst*>(inst)) {
-          if (inst->type() == Type::Int8) {
-            _builder.movsx8to64(rax, vreg(inst->arg(0)));
-            _builder.movsx8to64(vreg(inst->arg(1)), vreg(inst->arg(1)));
+          if (int_to_float_s->type() == Type::Float32) {
+            _builder.cvtsi2ss64(vreg(inst), src);
           } else {
-            _builder.mov64(rax, vreg(inst->arg(0)));
-          }
-
-          switch (inst->type()) {
-            case Type::Int8:
-            case Type::Int16:
-              _builder.cwd(rdx);
-              _builder.idiv16(vreg(inst->arg(1)));
-            break;
-            case Type::Int32:
-              _builder.cdq(rdx);
-              _builder.idiv32(vreg(inst->arg(1)));
-            break;
-            case Type::Int64:
-              _builder.cqo(rdx);
-              _builder.idiv64(vreg(inst->arg(1)));
-            break;
-            default: assert(false && "Unsupported type");
+            _builder.cvtsi2sd64(vreg(inst), src);
           }
-        } else {
-          _builder.mov64_imm(rdx, (uint64_t) 0);
-          if (inst->type() == Type::Int8) {
-            _builder.movzx8to64(rax, vreg(inst->arg(0)));
-            _builder.movzx8to64(vreg(inst->arg(1)), vreg(inst->arg(1)));
+          break;
+        }
+        case Opcode::FloatToIntS: {
+          FloatToIntSInst* float_to_int_s = (FloatToIntSInst*) inst;
+          // The lower bits of the 64-bit result are the truncated result for smaller types
+          if (float_to_int_s->arg(0)->type() == Type::Float32) {
+            _builder.cvttss2si64(vreg(inst), vreg(float_to_int_s->arg(0)));
           } else {
-            _builder.mov64(rax, vreg(inst->arg(0)));
+            _builder.cvttsd2si64(vreg(inst), vreg(float_to_int_s->arg(0)));
+          }
+          break;
+        }
+        case Opcode::Load: {
+          LoadInst* load = (LoadInst*) inst;
+          X86Inst::Mem mem = build_mem(load->ptr(), load->offset());
+          switch (load->type()) {
+            case Type::Float32: _builder.movss(vreg(inst), mem); return;
+            case Type::Float64: _builder.movsd(vreg(inst), mem); return;
+            default: break;
           }
 
-          switch (inst->type()) {
-            case Type::Int8:
-            case Type::Int16: _builder.div16(vreg(inst->arg(1))); break;
-            case Type::Int32: _builder.div32(vreg(inst->arg(1))); break;
-            case Type::Int64: _builder.div64(vreg(inst->arg(1))); break;
-            default: assert(false && "Unsupported type");
+          switch (type_size(load->type())) {
+            case 1: _builder.mov8(vreg(inst), mem); break;
+            case 2: _builder.mov16(vreg(inst), mem); break;
+            case 4: _builder.mov32(vreg(inst), mem); break;
+            case 8: _builder.mov64(vreg(inst), mem); break;
+            default:
+              assert(false && "Unsupported load type");
           }
+          break;
         }
+        case Opcode::Store: {
+          StoreInst* store = (StoreInst*) inst;
+          X86Inst::Mem mem = build_mem(store->ptr(), store->offset());
+          if (dynmatch(Const, constant_value, store->arg(1))) {
+            switch (type_size(store->arg(1)->type())) {
+              case 1: _builder.mov8_imm(mem, constant_value->value()); return;
+              case 2: _builder.mov16_imm(mem, constant_value->value()); return;
+              case 4: _builder.mov32_imm(mem, constant_value->value()); return;
+              case 8:
+                if (is_sext_imm32(constant_value)) {
+                  _builder.mov64_imm(mem, constant_value->value());
+                  return;
+                }
+              break;
+              default:
+                assert(false && "Unsupported store type");
+            }
+          } else if (dyn_cast<AddInst>(store->arg(1)) ||
+                     dyn_cast<SubInst>(store->arg(1)) ||
+                     dyn_cast<AndInst>(store->arg(1)) ||
+                     dyn_cast<OrInst>(store->arg(1)) ||
+                     dyn_cast<XorInst>(store->arg(1))) {
+            // Read-modify-write of the stored location
+            Inst* op = (Inst*) store->arg(1);
+            LoadInst* load_arg = nullptr;
+            Value* other_arg = nullptr;
+
+            #define find_load(load_index, other_index) \
+              if (dynmatch(LoadInst, load, op->arg(load_index))) { \
+                bool exact_aliasing_matches = load->aliasing() == store->aliasing() && load->aliasing() < 0; \
+                bool ptr_offset_matches = load->arg(0) == store->arg(0) && load->offset() == store->offset(); \
+                if (_memory_deps.at(load) == _memory_deps.at(store) && (exact_aliasing_matches || ptr_offset_matches)) { \
+                  load_arg = load; \
+                  other_arg = op->arg(other_index); \
+                } \
+              }
+          
+            find_load(0, 1);
+            if (!dyn_cast<SubInst>(op)) {
+              find_load(1, 0);
+            }
 
-        if (dynamic_cast<ModUInst*>(inst) || dynamic_cast<ModSInst*>(inst)) {
-          _builder.mov64(vreg(inst), rdx);
-          _builder.pseudo_use(rax);
-        } else {
-          _builder.mov64(vreg(inst), rax);
-          _builder.pseudo_use(rdx);
-        }
-      } else if (dynmatch(AndInst, and_inst, inst)) {
-        _builder.mov64(vreg(inst), vreg(and_inst->arg(0)));
+            #undef find_load
+
+            if (load_arg) {
+              dynmatch(Const, constant_other, other_arg);
+              if (constant_other && is_alu_imm(constant_other)) {
+                uint64_t imm = imm_value(constant_other);
+
+                #define sized_mem_imm(name) \
+                  switch (type_size(op->type())) { \
+                    case 1: _builder.name##8_imm(mem, imm); return; \
+                    case 2: _builder.name##16_imm(mem, imm); return; \
+                    case 4: _builder.name##32_imm(mem, imm); return; \
+                    case 8: _builder.name##64_imm(mem, imm); return; \
+                    default: assert(false && "Unsupported store type"); \
+                  }
 
-        if (dynmatch(Const, constant_b, and_inst->arg(1))) {
-          if (is_sext_imm32(constant_b)) {
-            _builder.and64_imm(vreg(inst), constant_b->value());
+                if (dyn_cast<AddInst>(op)) {
+                  sized_mem_imm(add);
+                } else if (dyn_cast<SubInst>(op)) {
+                  sized_mem_imm(sub);
+                } else if (dyn_cast<AndInst>(op)) {
+                  sized_mem_imm(and);
+                } else if (dyn_cast<OrInst>(op)) {
+                  sized_mem_imm(or);
+                } else if (dyn_cast<XorInst>(op)) {
+                  sized_mem_imm(xor);
+                }
+
+                #undef sized_mem_imm
+              } else if (dyn_cast<AddInst>(op)) {
+                switch (type_size(store->arg(1)->type())) {
+                  case 1: _builder.add8_mem(mem, vreg(other_arg)); return;
+                  case 2: _builder.add16_mem(mem, vreg(other_arg)); return;
+                  case 4: _builder.add32_mem(mem, vreg(other_arg)); return;
+                  case 8: _builder.add64_mem(mem, vreg(other_arg)); return;
+                  default:
+                    assert(false && "Unsupported store type");
+                }
+              }
+            }
+          }
+
+          if (store->arg(1)->type() == Type::Bool) {
+            _builder.and64_imm(vreg(store->arg(1)), (uint64_t) 1);
+          }
+
+          switch (store->arg(1)->type()) {
+            case Type::Float32: _builder.movss_mem(mem, vreg(store->arg(1))); return;
+            case Type::Float64: _builder.movsd_mem(mem, vreg(store->arg(1))); return;
+            default: break;
+          }
+
+          switch (type_size(store->arg(1)->type())) {
+            case 1: _builder.mov8_mem(mem, vreg(store->arg(1))); break;
+            case 2: _builder.mov16_mem(mem, vreg(store->arg(1))); break;
+            case 4: _builder.mov32_mem(mem, vreg(store->arg(1))); break;
+            case 8: _builder.mov64_mem(mem, vreg(store->arg(1))); break;
+            default:
+              assert(false && "Unsupported store type");
+          }
+          break;
+        }
+        case Opcode::Alloca: {
+          AllocaInst* alloca = (AllocaInst*) inst;
+          dynmatch(Const, size_const, alloca->size());
+          assert(size_const && "x86 backend currently requires constant-size Alloca");
+
+          size_t size = size_const->value();
+          assert(size > 0 && "Alloca size must be non-zero");
+
+          // The offset is filled in by layout_allocas
+          Reg rsp = fix_to_preg(vreg(), Reg::X86_RSP());
+          X86Inst* lea = _builder.lea64(vreg(inst), X86Inst::Mem(rsp, 0));
+          _alloca_slots.push_back(AllocaSlot { alloca, lea, size, alloca->align() });
+          break;
+        }
+        case Opcode::AddPtr: {
+          AddPtrInst* add_ptr = (AddPtrInst*) inst;
+          build_add(vreg(inst), add_ptr->ptr(), add_ptr->offset());
+          break;
+        }
+        case Opcode::Add: {
+          AddInst* add = (AddInst*) inst;
+          if (!build_binop_mem(add, true)) {
+            build_add(vreg(inst), add->arg(0), add->arg(1));
+          }
+          break;
+        }
+        case Opcode::Sub: {
+          SubInst* sub = (SubInst*) inst;
+          if (build_binop_mem(sub, false)) {
             return;
           }
+
+          _builder.mov64(vreg(inst), vreg(sub->arg(0)));
+
+          if (dynmatch(Const, constant_b, sub->arg(1))) {
+            if (is_alu_imm(constant_b)) {
+              if (type_size(inst->type()) == 8) {
+                _builder.sub64_imm(vreg(inst), imm_value(constant_b));
+              } else {
+                _builder.sub32_imm(vreg(inst), imm_value(constant_b));
+              }
+              return;
+            }
+          }
+
+          _builder.sub64(vreg(inst), vreg(sub->arg(1)));
+          break;
+        }
+        case Opcode::Mul: {
+          MulInst* mul = (MulInst*) inst;
+          if (dynmatch(Const, constant_b, mul->arg(1))) {
+            if (is_alu_imm(constant_b)) {
+              if (type_size(inst->type()) == 8) {
+                _builder.imul64_imm(vreg(inst), vreg(mul->arg(0)), imm_value(constant_b));
+              } else {
+                _builder.imul32_imm(vreg(inst), vreg(mul->arg(0)), imm_value(constant_b));
+              }
+              return;
+            }
+          }
+
+          _builder.mov64(vreg(inst), vreg(mul->arg(0)));
+          _builder.imul64(vreg(inst), vreg(mul->arg(1)));
+          break;
         }
+        case Opcode::DivU:
+        case Opcode::ModU:
+        case Opcode::DivS:
+        case Opcode::ModS: {
+
+          Reg rdx = fix_to_preg(vreg(), Reg::X86_RDX());
+          Reg rax = fix_to_preg(vreg(), Reg::X86_RAX());
+
+          if (dyn_cast<DivSInst>(inst) || dyn_cast<ModSInst>(inst)) {
+            if (inst->type() == Type::Int8) {
+              _builder.movsx8to64(rax, vreg(inst->arg(0)));
+              _builder.movsx8to64(vreg(inst->arg(1)), vreg(inst->arg(1)));
+            } else {
+              _builder.mov64(rax, vreg(inst->arg(0)));
+            }
+
+            switch (inst->type()) {
+              case Type::Int8:
+              case Type::Int16:
+                _builder.cwd(rdx);
+                _builder.idiv16(vreg(inst->arg(1)));
+              break;
+              case Type::Int32:
+                _builder.cdq(rdx);
+                _builder.idiv32(vreg(inst->arg(1)));
+              break;
+              case Type::Int64:
+                _builder.cqo(rdx);
+                _builder.idiv64(vreg(inst->arg(1)));
+              break;
+              default: assert(false && "Unsupported type");
+            }
+          } else {
+            _builder.mov64_imm(rdx, (uint64_t) 0);
+            if (inst->type() == Type::Int8) {
+              _builder.movzx8to64(rax, vreg(inst->arg(0)));
+              _builder.movzx8to64(vreg(inst->arg(1)), vreg(inst->arg(1)));
+            } else {
+              _builder.mov64(rax, vreg(inst->arg(0)));
+            }
+
+            switch (inst->type()) {
+              case Type::Int8:
+              case Type::Int16: _builder.div16(vreg(inst->arg(1))); break;
+              case Type::Int32: _builder.div32(vreg(inst->arg(1))); break;
+              case Type::Int64: _builder.div64(vreg(inst->arg(1))); break;
+              default: assert(false && "Unsupported type");
+            }
+          }
 
-        _builder.and64(vreg(inst), vreg(and_inst->arg(1)));
-      } else if (dynmatch(OrInst, or_inst, inst)) {
-        _builder.mov64(vreg(inst), vreg(or_inst->arg(0)));
+          if (dyn_cast<ModUInst>(inst) || dyn_cast<ModSInst>(inst)) {
+            _builder.mov64(vreg(inst), rdx);
+            _builder.pseudo_use(rax);
+          } else {
+            _builder.mov64(vreg(inst), rax);
+            _builder.pseudo_use(rdx);
+          }
+          break;
+        }
+        case Opcode::And: {
+          AndInst* and_inst = (AndInst*) inst;
+          if (_features.bmi1) {
+            for (size_t it = 0; it < 2; it++) {
+              if (Value* inverted = match_single_use_not(and_inst->arg(it))) {
+                Value* other = and_inst->arg(1 - it);
+                if (type_size(inst->type()) == 8) {
+                  _builder.andn64(vreg(inst), build_rm_src(other, 8, inst), vreg(inverted));
+                } else {
+                  _builder.andn32(vreg(inst), build_rm_src(other, 4, inst), vreg(inverted));
+                }
+                return;
+              }
+            }
+          }
 
-        if (dynmatch(Const, constant_b, or_inst->arg(1))) {
-          if (is_sext_imm32(constant_b)) {
-            _builder.or64_imm(vreg(inst), constant_b->value());
+          if (build_binop_mem(and_inst, true)) {
             return;
           }
+
+          _builder.mov64(vreg(inst), vreg(and_inst->arg(0)));
+
+          if (dynmatch(Const, constant_b, and_inst->arg(1))) {
+            if (is_alu_imm(constant_b)) {
+              if (type_size(inst->type()) == 8) {
+                _builder.and64_imm(vreg(inst), imm_value(constant_b));
+              } else {
+                _builder.and32_imm(vreg(inst), imm_value(constant_b));
+              }
+              return;
+            }
+          }
+
+          _builder.and64(vreg(inst), vreg(and_inst->arg(1)));
+          break;
         }
+        case Opcode::Or: {
+          OrInst* or_inst = (OrInst*) inst;
+          if (build_binop_mem(or_inst, true)) {
+            return;
+          }
+
+          _builder.mov64(vreg(inst), vreg(or_inst->arg(0)));
 
-        _builder.or64(vreg(inst), vreg(or_inst->arg(1)));
-      } else if (dynmatch(XorInst, xor_inst, inst)) {
-        _builder.mov64(vreg(inst), vreg(xor_inst->arg(0)));
+          if (dynmatch(Const, constant_b, or_inst->arg(1))) {
+            if (is_alu_imm(constant_b)) {
+              if (type_size(inst->type()) == 8) {
+                _builder.or64_imm(vreg(inst), imm_value(constant_b));
+              } else {
+                _builder.or32_imm(vreg(inst), imm_value(constant_b));
+              }
+              return;
+            }
+          }
 
-        if (dynmatch(Const, constant_b, xor_inst->arg(1))) {
-          if (is_sext_imm32(constant_b)) {
-            _builder.xor64_imm(vreg(inst), constant_b->value());
+          _builder.or64(vreg(inst), vreg(or_inst->arg(1)));
+          break;
+        }
+        case Opcode::Xor: {
+          XorInst* xor_inst = (XorInst*) inst;
+          if (build_binop_mem(xor_inst, true)) {
             return;
           }
+
+          _builder.mov64(vreg(inst), vreg(xor_inst->arg(0)));
+
+          if (dynmatch(Const, constant_b, xor_inst->arg(1))) {
+            if (is_alu_imm(constant_b)) {
+              if (type_size(inst->type()) == 8) {
+                _builder.xor64_imm(vreg(inst), imm_value(constant_b));
+              } else {
+                _builder.xor32_imm(vreg(inst), imm_value(constant_b));
+              }
+              return;
+            }
+          }
+
+          _builder.xor64(vreg(inst), vreg(xor_inst->arg(1)));
+          break;
         }
+        case Opcode::Shl: {
+          ShlInst* shl = (ShlInst*) inst;
+          if (_features.bmi2 && !dyn_cast<Const>(shl->arg(1))) {
+            _builder.shlx64(vreg(inst), build_rm_src(shl->arg(0), 8, inst), vreg(shl->arg(1)));
+            return;
+          }
 
-        _builder.xor64(vreg(inst), vreg(xor_inst->arg(1)));
-      } else if (dynmatch(ShlInst, shl, inst)) {
-        _builder.mov64(vreg(inst), vreg(shl->arg(0)));
+          _builder.mov64(vreg(inst), vreg(shl->arg(0)));
 
-        if (dynmatch(Const, constant_b, shl->arg(1))) {
-          _builder.shl64_imm(vreg(inst), constant_b->value());
-          return;
+          if (dynmatch(Const, constant_b, shl->arg(1))) {
+            _builder.shl64_imm(vreg(inst), constant_b->value());
+            return;
+          }
+
+          Reg rcx = fix_to_preg(vreg(), Reg::X86_RCX());
+          _builder.mov64(rcx, vreg(shl->arg(1)));
+          _builder.shl64(vreg(inst));
+          _builder.pseudo_use(rcx);
+          break;
         }
+        case Opcode::ShrU: {
+          ShrUInst* shr_u = (ShrUInst*) inst;
+          if (_features.bmi2 && !dyn_cast<Const>(shr_u->arg(1))) {
+            // Narrow shifts count modulo 32 like shrx32, so shifting the zero extended value is equivalent
+            Value* value = shr_u->arg(0);
+            Reg count = vreg(shr_u->arg(1));
+            switch (type_size(value->type())) {
+              case 1:
+                _builder.movzx8to64(vreg(inst), vreg(value));
+                _builder.shrx32(vreg(inst), vreg(inst), count);
+              break;
+              case 2:
+                _builder.movzx16to64(vreg(inst), vreg(value));
+                _builder.shrx32(vreg(inst), vreg(inst), count);
+              break;
+              case 4: _builder.shrx32(vreg(inst), build_rm_src(value, 4, inst), count); break;
+              case 8: _builder.shrx64(vreg(inst), build_rm_src(value, 8, inst), count); break;
+              default: assert(false && "Unsupported type");
+            }
+            return;
+          }
 
-        Reg rcx = fix_to_preg(vreg(), Reg::X86_RCX());
-        _builder.mov64(rcx, vreg(shl->arg(1)));
-        _builder.shl64(vreg(inst));
-        _builder.pseudo_use(rcx);
-      } else if (dynmatch(ShrUInst, shr_u, inst)) {
-        _builder.mov64(vreg(inst), vreg(shr_u->arg(0)));
+          _builder.mov64(vreg(inst), vreg(shr_u->arg(0)));
 
-        if (dynmatch(Const, constant_b, shr_u->arg(1))) {
+          if (dynmatch(Const, constant_b, shr_u->arg(1))) {
+            switch (type_size(shr_u->arg(0)->type())) {
+              case 1: _builder.shr8_imm(vreg(inst), constant_b->value()); break;
+              case 2: _builder.shr16_imm(vreg(inst), constant_b->value()); break;
+              case 4: _builder.shr32_imm(vreg(inst), constant_b->value()); break;
+              case 8: _builder.shr64_imm(vreg(inst), constant_b->value()); break;
+              default: assert(false && "Unsupported type");
+            }
+            return;
+          }
+          Reg rcx = fix_to_preg(vreg(), Reg::X86_RCX());
+          _builder.mov64(rcx, vreg(shr_u->arg(1)));
           switch (type_size(shr_u->arg(0)->type())) {
-            case 1: _builder.shr8_imm(vreg(inst), constant_b->value()); break;
-            case 2: _builder.shr16_imm(vreg(inst), constant_b->value()); break;
-            case 4: _builder.shr32_imm(vreg(inst), constant_b->value()); break;
-            case 8: _builder.shr64_imm(vreg(inst), constant_b->value()); break;
+            case 1: _builder.shr8(vreg(inst)); break;
+            case 2: _builder.shr16(vreg(inst)); break;
+            case 4: _builder.shr32(vreg(inst)); break;
+            case 8: _builder.shr64(vreg(inst)); break;
             default: assert(false && "Unsupported type");
           }
-          return;
-        }
-        Reg rcx = fix_to_preg(vreg(), Reg::X86_RCX());
-        _builder.mov64(rcx, vreg(shr_u->arg(1)));
-        switch (type_size(shr_u->arg(0)->type())) {
-          case 1: _builder.shr8(vreg(inst)); break;
-          case 2: _builder.shr16(vreg(inst)); break;
-          case 4: _builder.shr32(vreg(inst)); break;
-          case 8: _builder.shr64(vreg(inst)); break;
-          default: assert(false && "Unsupported type");
+          _builder.pseudo_use(rcx);
+          break;
         }
-        _builder.pseudo_use(rcx);
-      } else if (dynmatch(ShrSInst, shr_s, inst)) {
-        _builder.mov64(vreg(inst), vreg(shr_s->arg(0)));
+        case Opcode::ShrS: {
+          ShrSInst* shr_s = (ShrSInst*) inst;
+          if (_features.bmi2 && !dyn_cast<Const>(shr_s->arg(1))) {
+            Value* value = shr_s->arg(0);
+            Reg count = vreg(shr_s->arg(1));
+            switch (type_size(value->type())) {
+              case 1:
+                _builder.movsx8to64(vreg(inst), vreg(value));
+                _builder.sarx32(vreg(inst), vreg(inst), count);
+              break;
+              case 2:
+                _builder.movsx16to64(vreg(inst), vreg(value));
+                _builder.sarx32(vreg(inst), vreg(inst), count);
+              break;
+              case 4: _builder.sarx32(vreg(inst), build_rm_src(value, 4, inst), count); break;
+              case 8: _builder.sarx64(vreg(inst), build_rm_src(value, 8, inst), count); break;
+              default: assert(false && "Unsupported type");
+            }
+            return;
+          }
+
+          _builder.mov64(vreg(inst), vreg(shr_s->arg(0)));
 
-        if (dynmatch(Const, constant_b, shr_s->arg(1))) {
+          if (dynmatch(Const, constant_b, shr_s->arg(1))) {
+            switch (type_size(shr_s->arg(0)->type())) {
+              case 1: _builder.sar8_imm(vreg(inst), constant_b->value()); break;
+              case 2: _builder.sar16_imm(vreg(inst), constant_b->value()); break;
+              case 4: _builder.sar32_imm(vreg(inst), constant_b->value()); break;
+              case 8: _builder.sar64_imm(vreg(inst), constant_b->value()); break;
+              default: assert(false && "Unsupported type");
+            }
+            return;
+          }
+
+          Reg rcx = fix_to_preg(vreg(), Reg::X86_RCX());
+          _builder.mov64(rcx, vreg(shr_s->arg(1)));
           switch (type_size(shr_s->arg(0)->type())) {
-            case 1: _builder.sar8_imm(vreg(inst), constant_b->value()); break;
-            case 2: _builder.sar16_imm(vreg(inst), constant_b->value()); break;
-            case 4: _builder.sar32_imm(vreg(inst), constant_b->value()); break;
-            case 8: _builder.sar64_imm(vreg(inst), constant_b->value()); break;
+            case 1: _builder.sar8(vreg(inst)); break;
+            case 2: _builder.sar16(vreg(inst)); break;
+            case 4: _builder.sar32(vreg(inst)); break;
+            case 8: _builder.sar64(vreg(inst)); break;
             default: assert(false && "Unsupported type");
           }
-          return;
+          _builder.pseudo_use(rcx);
+          break;
         }
-
-        Reg rcx = fix_to_preg(vreg(), Reg::X86_RCX());
-        _builder.mov64(rcx, vreg(shr_s->arg(1)));
-        switch (type_size(shr_s->arg(0)->type())) {
-          case 1: _builder.sar8(vreg(inst)); break;
-          case 2: _builder.sar16(vreg(inst)); break;
-          case 4: _builder.sar32(vreg(inst)); break;
-          case 8: _builder.sar64(vreg(inst)); break;
-          default: assert(false && "Unsupported type");
-        }
-        _builder.pseudo_use(rcx);
-      } else if (dynamic_cast<EqInst*>(inst) ||
-                 dynamic_cast<LtSInst*>(inst) ||
-                 dynamic_cast<LtUInst*>(inst)) {
-        build_cmp(inst->arg(0), inst->arg(1));
-        if (dynamic_cast<EqInst*>(inst)) {
-          _builder.sete8(vreg(inst));
-        } else if (dynamic_cast<LtSInst*>(inst)) {
-          _builder.setl8(vreg(inst));
-        } else if (dynamic_cast<LtUInst*>(inst)) {
-          _builder.setb8(vreg(inst));
-        } else {
-          assert(false);
+        case Opcode::AddF:
+        case Opcode::SubF:
+        case Opcode::MulF:
+        case Opcode::DivF: {
+          Reg b = vreg(inst->arg(1));
+          _builder.movaps(vreg(inst), vreg(inst->arg(0)));
+
+          bool is_double = inst->type() == Type::Float64;
+          if (dyn_cast<AddFInst>(inst)) {
+            if (is_double) { _builder.addsd(vreg(inst), b); } else { _builder.addss(vreg(inst), b); }
+          } else if (dyn_cast<SubFInst>(inst)) {
+            if (is_double) { _builder.subsd(vreg(inst), b); } else { _builder.subss(vreg(inst), b); }
+          } else if (dyn_cast<MulFInst>(inst)) {
+            if (is_double) { _builder.mulsd(vreg(inst), b); } else { _builder.mulss(vreg(inst), b); }
+          } else if (dyn_cast<DivFInst>(inst)) {
+            if (is_double) { _builder.divsd(vreg(inst), b); } else { _builder.divss(vreg(inst), b); }
+          } else {
+            assert(false);
+          }
+          break;
+        }
+        case Opcode::Eq:
+        case Opcode::LtS:
+        case Opcode::LtU:
+        case Opcode::LtFO:
+        case Opcode::LtFU: {
+          build_setcc(build_cond(inst, inst), vreg(inst));
+          break;
         }
-      } else if (dynmatch(CallInst, call, inst)) {
-        CallConvInfo info(call->call_conv());
+        case Opcode::Call: {
+          CallInst* call = (CallInst*) inst;
+          CallConvInfo info(call->call_conv());
 
-        assert(call->arg_count() >= 1);
-        assert(call->arg_count() - 1 <= info.args().size() && "Call with too many register arguments");
+          assert(call->arg_count() >= 1);
+          assert(call->arg_count() - 1 <= info.args().size() && "Call with too many register arguments");
 
-        lwir::Span<Reg> args = _builder.alloc_regs(call->args().size() - 1);
-        for (size_t it = 1; it < call->args().size(); it++) {
-          Reg arg_reg = fix_to_preg(vreg(), info.arg(it - 1));
-          _builder.mov64(arg_reg, vreg(call->arg(it)));
-          args[it - 1] = arg_reg;
-        }
+          assert(!is_float(call->type()) && "Float return values are not supported");
 
-        Reg ret_reg = fix_to_preg(vreg(), info.ret());
-        Reg callee_reg = fix_to_preg(vreg(), Reg::X86_R10());
-        _builder.mov64(callee_reg, vreg(call->callee()));
-        _builder.call(callee_reg, ret_reg, call->call_conv(), args);
+          lwir::Span<Reg> args = _builder.alloc_regs(call->args().size() - 1);
+          for (size_t it = 1; it < call->args().size(); it++) {
+            assert(!is_float(call->arg(it)->type()) && "Float arguments are not supported");
+            Reg arg_reg = fix_to_preg(vreg(), info.arg(it - 1));
+            _builder.mov64(arg_reg, vreg(call->arg(it)));
+            args[it - 1] = arg_reg;
+          }
 
-        if (call->type() != Type::Void) {
-          _builder.mov64(vreg(call), ret_reg);
-        }
+          Reg ret_reg = fix_to_preg(vreg(), info.ret());
+          Reg callee_reg = fix_to_preg(vreg(), Reg::X86_R10());
+          _builder.mov64(callee_reg, vreg(call->callee()));
+          _builder.call(callee_reg, ret_reg, call->call_conv(), args);
+
+          if (call->type() != Type::Void) {
+            _builder.mov64(vreg(call), ret_reg);
+          }
 
-        _stack_offset_alloc.require_call_alignment();
-      } else if (dynmatch(BranchInst, branch, inst)) {
-        if (branch->arg(0)->is_inst()) {
-          Inst* pred_inst = (Inst*) branch->arg(0);
+          _stack_offset_alloc.require_call_alignment();
+          break;
+        }
+        case Opcode::Branch: {
+          BranchInst* branch = (BranchInst*) inst;
+          Cond cond = build_cond(branch->cond(), inst);
 
-          bool is_negated = false;
           Block* true_block = branch->true_block();
           Block* false_block = branch->false_block();
-          if (true_block->name() == block->name() + 1) {
+          if (_blocks[true_block->name()] == layout_next(_blocks[block->name()])) {
             std::swap(true_block, false_block);
-            is_negated = true;
+            cond = invert(cond);
           }
 
-          if (dynamic_cast<EqInst*>(pred_inst) ||
-              dynamic_cast<LtSInst*>(pred_inst) ||
-              dynamic_cast<LtUInst*>(pred_inst)) {
-            build_cmp(pred_inst->arg(0), pred_inst->arg(1));
-            if (dynamic_cast<EqInst*>(pred_inst)) {
-              if (is_negated) {
-                _builder.jne(_blocks[true_block->name()]);
-              } else {
-                _builder.je(_blocks[true_block->name()]);
-              }
-            } else if (dynamic_cast<LtSInst*>(pred_inst)) {
-              if (is_negated) {
-                _builder.jge(_blocks[true_block->name()]);
-              } else {
-                _builder.jl(_blocks[true_block->name()]);
-              }
-            } else if (dynamic_cast<LtUInst*>(pred_inst)) {
-              if (is_negated) {
-                _builder.jae(_blocks[true_block->name()]);
-              } else {
-                _builder.jb(_blocks[true_block->name()]);
-              }
-            } else {
-              assert(false);
-            }
-            _builder.jmp(_blocks[false_block->name()]);
-            return;
+          build_jcc(cond, _blocks[true_block->name()]);
+          _builder.jmp(_blocks[false_block->name()]);
+          break;
+        }
+        case Opcode::Jump: {
+          JumpInst* jump = (JumpInst*) inst;
+          Reg copies[jump->block()->args().size()];
+          for (Arg* arg : jump->block()->args()) {
+            copies[arg->index()] = vreg(reg_class(arg->type()));
+            build_mov(copies[arg->index()], vreg(jump->arg(arg->index())));
+          }
+          for (Arg* arg : jump->block()->args()) {
+            build_mov(vreg(arg), copies[arg->index()]);
           }
+          _builder.jmp(_blocks[jump->block()->name()]);
+          break;
         }
-
-        _builder.test8_imm(vreg(branch->cond()), (uint64_t) 1);
-        _builder.jne(_blocks[branch->true_block()->name()]);
-        _builder.jmp(_blocks[branch->false_block()->name()]);
-      } else if (dynmatch(JumpInst, jump, inst)) {
-        Reg copies[jump->block()->args().size()];
-        for (Arg* arg : jump->block()->args()) {
-          copies[arg->index()] = vreg();
-          _builder.mov64(copies[arg->index()], vreg(jump->arg(arg->index())));
+        case Opcode::Exit:
+          build_exit(0);
+          break;
+        case Opcode::SideExit: {
+          SideExitInst* side_exit = (SideExitInst*) inst;
+          build_exit(side_exit->id());
+          break;
         }
-        for (Arg* arg : jump->block()->args()) {
-          _builder.mov64(vreg(arg), copies[arg->index()]);
+        default: {
+          inst->write(std::cerr);
+          std::cerr << std::endl;
+          assert(false && "Unknown instruction");
         }
-        _builder.jmp(_blocks[jump->block()->name()]);
-      } else if (dynmatch(ExitInst, exit, inst)) {
-        _builder.ret();
-      } else {
-        inst->write(std::cerr);
-        std::cerr << std::endl;
-        assert(false && "Unknown instruction");
       }
     }
 
-    void isel() {
-      for (Block* block : _section->rev_range()) {
+    void isel(const FrozenSection& frozen) {
+      for (size_t block_index = frozen.block_count(); block_index-- > 0; ) {
+        const FrozenSection::FrozenBlock& frozen_block = frozen.block(block_index);
+        Block* block = frozen_block.block;
         X86Block* x86block = _blocks[block->name()];
         
         // Keep track of backedges, to identify loops
-        if (dynmatch(JumpInst, jump, block->terminator())) {
-          _blocks[jump->block()->name()]->add_incoming(x86block);
-        } else if (dynmatch(BranchInst, branch, block->terminator())) {
-          _blocks[branch->true_block()->name()]->add_incoming(x86block);
-          _blocks[branch->false_block()->name()]->add_incoming(x86block);
+        if (frozen_block.inst_count > 0) {
+          size_t last = frozen_block.first_inst + frozen_block.inst_count - 1;
+          switch (frozen.at(last).opcode) {
+            case Opcode::Jump: {
+              JumpInst* jump = (JumpInst*) frozen.inst(last);
+              _blocks[jump->block()->name()]->add_incoming(x86block);
+              break;
+            }
+            case Opcode::Branch: {
+              BranchInst* branch = (BranchInst*) frozen.inst(last);
+              _blocks[branch->true_block()->name()]->add_incoming(x86block);
+              _blocks[branch->false_block()->name()]->add_incoming(x86block);
+              break;
+            }
+            default: break;
+          }
         }
 
         // isel
         _builder.set_block(x86block);
-        for (Inst* inst : block->rev_range()) {
-          if (inst->has_side_effect() ||
-              inst->is_terminator() ||
+        for (size_t index = frozen_block.first_inst + frozen_block.inst_count;
+             index-- > frozen_block.first_inst; ) {
+          Opcode opcode = frozen.at(index).opcode;
+          Inst* inst = frozen.inst(index);
+          if (has_side_effect(opcode) ||
+              is_terminator(opcode) ||
               !_vregs.at(inst).is_invalid()) {
             
             _builder.move_before(_builder.block(), _builder.block()->first());
@@ -1165,7 +1988,7 @@ namespace metajit {
           // which are defined before the loop (name < (*loop->begin())->name())
           // and used inside the loop (vreg exists)
 
-          size_t max_name = (*block->begin())->name();
+          size_t max_name = frozen.inst(frozen_block.first_inst)->name();
           assert(max_name < _section->name_count());
           _builder.move_to_begin(after_end);
           for (size_t it = 0; it < max_name; it++) {
@@ -1190,6 +2013,7 @@ namespace metajit {
     class StackOffsetAlloc {
     private:
       size_t _max_offset = 0;
+      size_t _spill_slots = 0;
       std::vector<size_t> _returned_offsets;
       bool _needs_call_alignment = false;
 
@@ -1204,6 +2028,10 @@ namespace metajit {
         return _max_offset;
       }
 
+      size_t spill_slots() const {
+        return _spill_slots;
+      }
+
       void require_call_alignment() {
         _needs_call_alignment = true;
       }
@@ -1220,6 +2048,7 @@ namespace metajit {
         if (_returned_offsets.empty()) {
           size_t offset = _max_offset;
           _max_offset += 8;
+          _spill_slots++;
           return offset;
         } else {
           size_t offset = _returned_offsets.back();
@@ -1245,15 +2074,25 @@ namespace metajit {
     class RegFileState {
     private:
       std::vector<Reg> _regs;
-      uint16_t _free = 0xffff;
-      uint16_t _max_free = 0xffff;
+      uint32_t _free = 0xffffffff;
+      uint32_t _max_free = 0xffffffff;
       
       std::vector<size_t> _lru;
       size_t _lru_count = 0;
     public:
+      static constexpr size_t REG_COUNT = 32;
+
+      static uint32_t class_mask(Reg::Class reg_class) {
+        switch (reg_class) {
+          case Reg::Class::GPR: return 0x0000ffff;
+          case Reg::Class::XMM: return 0xffff0000;
+        }
+        return 0;
+      }
+
       RegFileState() {
-        _regs.resize(16, Reg());
-        _lru.resize(16, 0);
+        _regs.resize(REG_COUNT, Reg());
+        _lru.resize(REG_COUNT, 0);
 
         disable(Reg::X86_RSP());
         disable(Reg::X86_RBP());
@@ -1267,7 +2106,7 @@ namespace metajit {
 
       void disable(Reg preg) {
         assert(preg.is_physical());
-        _max_free &= ~(1 << preg.id());
+        _max_free &= ~(uint32_t(1) << preg.id());
         _lru[preg.id()] = ~size_t(0);
       }
 
@@ -1279,7 +2118,7 @@ namespace metajit {
       void set(Reg preg, Reg vreg) {
         assert(preg.is_physical() && vreg.is_virtual());
         _regs[preg.id()] = vreg;
-        _free &= ~(1 << preg.id());
+        _free &= ~(uint32_t(1) << preg.id());
       }
 
       void touch(Reg preg) {
@@ -1290,32 +2129,33 @@ namespace metajit {
       void free(Reg preg) {
         assert(preg.is_physical());
         _regs[preg.id()] = Reg();
-        _free |= (1 << preg.id());
+        _free |= (uint32_t(1) << preg.id());
       }
 
       bool is_free(Reg preg) const {
         assert(preg.is_physical());
-        return (_free & (1 << preg.id())) != 0;
+        return (_free & (uint32_t(1) << preg.id())) != 0;
       }
 
       bool is_disabled(Reg preg) const {
         assert(preg.is_physical());
-        return (_max_free & (1 << preg.id())) == 0;
+        return (_max_free & (uint32_t(1) << preg.id())) == 0;
       }
 
-      Reg get_free_reg() {
-        if (_free == 0) {
+      Reg get_free_reg(Reg::Class reg_class, uint32_t mask = 0xffffffff) {
+        uint32_t free = _free & class_mask(reg_class) & mask;
+        if (free == 0) {
           return Reg();
         } else {
-          return Reg::phys(__builtin_ctz(_free));
+          return Reg::phys(__builtin_ctz(free));
         }
       }
 
-      Reg get_lru() {
+      Reg get_lru(Reg::Class reg_class) {
         size_t min_index = 0;
         size_t min_value = ~size_t(0);
         for (size_t it = 0; it < _lru.size(); it++) {
-          if (_lru[it] < min_value) {
+          if (Reg::phys(it).reg_class() == reg_class && _lru[it] < min_value) {
             min_value = _lru[it];
             min_index = it;
           }
@@ -1341,7 +2181,7 @@ namespace metajit {
         for (size_t it = 0; it < _regs.size(); it++) {
           _regs[it] = state[it];
           if (!_regs[it].is_invalid()) {
-            _free &= ~(1 << it);
+            _free &= ~(uint32_t(1) << it);
           }
         }
         assert_invariant();
@@ -1382,110 +2222,449 @@ namespace metajit {
 
     StackOffsetAlloc _stack_offset_alloc;
 
-    void spill(RegFileState& reg_file, Reg preg, bool allow_spill_to_reg = true) {
-      Reg vreg = reg_file[preg];
-      if (vreg.is_virtual()) {
-        VRegInfo& info = _vreg_info[vreg.id()];
-        Reg free_reg = reg_file.get_free_reg();
-        if (allow_spill_to_reg && free_reg.is_physical()) {
-          // No need to spill, just move to free reg
-          _builder.mov64(free_reg, preg);
-          reg_file.free(preg);
-          info.current_reg = free_reg;
-          reg_file.set(free_reg, vreg);
-        } else {
-          if (info.stack_offset == ~size_t(0)) {
-            info.stack_offset = _stack_offset_alloc.alloc();
-          }
-          _builder.mov64_mem(
-            X86Inst::Mem(
-              Reg::X86_RSP(),
-              (int32_t) info.stack_offset
-            ),
-            preg
-          );
-          reg_file.free(preg);
-          info.current_reg = Reg();
-        }
+    // Allocas whose address does not escape share storage when their live
+    // ranges are disjoint. The memory of such an alloca is only accessed
+    // through the vregs of pointers derived from it, so their live range
+    // bounds its lifetime.
+    void layout_allocas(const FrozenSection& frozen) {
+      if (_alloca_slots.empty()) {
+        return;
       }
-    }
 
-    void unspill(RegFileState& reg_file, Reg vreg, Reg preg) {
-      assert(vreg.is_virtual());
-      VRegInfo& info = _vreg_info[vreg.id()];
-      if (info.current_reg.is_physical()) {
-        // No need to unspill, just move from current reg
-        _builder.mov64(preg, info.current_reg);
-        reg_file.free(info.current_reg);
-      } else {
-        assert(info.stack_offset != ~size_t(0));
-        _builder.mov64(
-          preg,
-          X86Inst::Mem(
-            Reg::X86_RSP(),
-            (int32_t) info.stack_offset
-          )
-        );
+      std::unordered_map<Inst*, size_t> alloca_slots;
+      for (size_t it = 0; it < _alloca_slots.size(); it++) {
+        alloca_slots[_alloca_slots[it].alloca] = it;
       }
-      info.current_reg = preg;
-      reg_file.set(preg, vreg);
-    }
 
-    void spill_and_unspill(RegFileState& reg_file,
-                           Reg preg,
-                           Reg vreg,
-                           bool is_def,
-                           bool allow_spill_to_reg = true) {
-      assert(preg.is_physical());
-      spill(reg_file, preg, allow_spill_to_reg);
-      if (vreg.is_virtual()) {
-        VRegInfo& info = _vreg_info[vreg.id()];
-        if (is_def) {
-          info.current_reg = preg;
-          reg_file.set(preg, vreg);
-        } else {
-          unspill(reg_file, vreg, preg);
+      // Pointer -> slot, indexed by frozen instruction
+      constexpr size_t NO_SLOT = size_t(-1);
+      std::vector<size_t> derived(frozen.inst_count(), NO_SLOT);
+      for (size_t index = 0; index < frozen.inst_count(); index++) {
+        const FrozenSection::FrozenInst& inst = frozen.at(index);
+        if (inst.opcode == Opcode::Alloca) {
+          auto slot = alloca_slots.find(frozen.inst(index));
+          if (slot != alloca_slots.end()) {
+            derived[index] = slot->second;
+          }
+          continue;
         }
-        reg_file.touch(preg); 
-      }
-    }
 
-    bool is_foldable_mov(X86Inst* inst) {
-      if (inst->kind() == X86Inst::Kind::Mov64 &&
-          std::holds_alternative<Reg>(inst->rm())) {
-        Reg src = std::get<Reg>(inst->rm());
-        Reg dst = inst->reg();
-        assert(src.is_virtual() && dst.is_virtual());
-        if (_vreg_info[src.id()].current_reg.is_physical() &&
-            _vreg_info[src.id()].interval.max == inst->name() &&
-            _vreg_info[dst.id()].interval.min == inst->name() &&
-            _vreg_info[dst.id()].fixed.is_invalid()) {
-          return true;
+        const FrozenSection::Id* args = frozen.args(inst).data();
+        for (size_t it = 0; it < inst.arg_count; it++) {
+          if (!FrozenSection::is_inst(args[it]) ||
+              derived[FrozenSection::id_index(args[it])] == NO_SLOT) {
+            continue;
+          }
+          size_t slot = derived[FrozenSection::id_index(args[it])];
+          if (it == 0 && inst.opcode == Opcode::AddPtr) {
+            derived[index] = slot;
+          } else if (it != 0 || !(inst.opcode == Opcode::Load ||
+                                  inst.opcode == Opcode::Store)) {
+            _alloca_slots[slot].escapes = true;
+          }
         }
-      } 
-      return false;
-    }
+      }
 
-    void load_state(RegFileState& reg_file, Reg* state) {
-      for (size_t it = 0; it < reg_file.size(); it++) {
-        Reg preg = Reg::phys(it);
-        if (reg_file[preg].is_virtual()) {
-          _vreg_info[reg_file[preg].id()].current_reg = Reg();
+      std::unordered_map<size_t, size_t> vreg_slots;
+      for (size_t index = 0; index < derived.size(); index++) {
+        if (derived[index] == NO_SLOT) {
+          continue;
         }
-      }
-      reg_file.load_state(state);
-      for (size_t it = 0; it < reg_file.size(); it++) {
-        Reg preg = Reg::phys(it);
-        if (reg_file[preg].is_virtual()) {
-          _vreg_info[reg_file[preg].id()].current_reg = preg;
+        size_t slot = derived[index];
+        Reg reg = _vregs.at(frozen.inst(index));
+        if (reg.is_virtual()) {
+          vreg_slots[reg.id()] = slot;
         }
       }
-    }
 
-    void spill_all(RegFileState& reg_file) {
-      for (size_t it = 0; it < reg_file.size(); it++) {
-        if (!reg_file.is_free(Reg::phys(it))) {
-          spill(reg_file, Reg::phys(it), false);
+      for (X86Block* block : _blocks) {
+        for (X86Inst* inst : *block) {
+          inst->visit_regs([&](Reg reg) {
+            if (reg.is_virtual()) {
+              auto it = vreg_slots.find(reg.id());
+              if (it != vreg_slots.end()) {
+                _alloca_slots[it->second].lifetime.incl(inst->name());
+              }
+            }
+          });
+        }
+      }
+
+      // The first and last instruction name of each block
+      std::vector<Interval> block_names(_blocks.size());
+      for (X86Block* block : _blocks) {
+        for (X86Inst* inst : *block) {
+          block_names[block->name()].incl(inst->name());
+        }
+      }
+
+      // An alloca which is live on entry to a loop carries its contents
+      // around the back edge, so it stays live until the end of the loop.
+      // Loops are visited in order, so nested and later loops see the
+      // extended lifetime.
+      for (X86Block* header : _blocks) {
+        if (!header->loop() || block_names[header->name()].empty()) {
+          continue;
+        }
+        size_t start = block_names[header->name()].min;
+        size_t end = start;
+        for (size_t it = header->name(); it <= header->loop()->name(); it++) {
+          if (!block_names[it].empty()) {
+            end = std::max(end, block_names[it].max);
+          }
+        }
+        for (AllocaSlot& slot : _alloca_slots) {
+          if (!slot.lifetime.empty() &&
+              slot.lifetime.min < start &&
+              slot.lifetime.max >= start) {
+            slot.lifetime.incl(end);
+          }
+        }
+      }
+
+      std::vector<size_t> order(_alloca_slots.size());
+      for (size_t it = 0; it < order.size(); it++) {
+        order[it] = it;
+      }
+      std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return _alloca_slots[a].lifetime.min < _alloca_slots[b].lifetime.min;
+      });
+
+      struct Region {
+        size_t offset = 0;
+        size_t size = 0;
+        size_t busy_until = 0;
+      };
+      std::vector<Region> regions;
+
+      for (size_t index : order) {
+        AllocaSlot& slot = _alloca_slots[index];
+        Region* region = nullptr;
+        if (!slot.escapes) {
+          for (Region& other : regions) {
+            if (other.busy_until < slot.lifetime.min &&
+                other.size >= slot.size &&
+                other.offset % slot.align == 0) {
+              region = &other;
+              break;
+            }
+          }
+        }
+
+        size_t busy_until = slot.escapes ? ~size_t(0) : slot.lifetime.max;
+        size_t offset = 0;
+        if (region) {
+          offset = region->offset;
+          region->busy_until = busy_until;
+        } else {
+          offset = _stack_offset_alloc.alloc_bytes(slot.size, slot.align);
+          regions.push_back(Region { offset, slot.size, busy_until });
+          #ifdef METAJIT_STATS
+          _stats.alloca_frame_bytes += slot.size;
+          #endif
+        }
+
+        #ifdef METAJIT_STATS
+        _stats.alloca_bytes += slot.size;
+        #endif
+
+        X86Inst::Mem mem = std::get<X86Inst::Mem>(slot.lea->rm());
+        mem.disp = (int32_t) offset;
+        slot.lea->set_rm(mem);
+      }
+    }
+
+    void build_store_slot(size_t offset, Reg preg) {
+      X86Inst::Mem slot(Reg::X86_RSP(), (int32_t) offset);
+      if (preg.is_xmm()) {
+        _builder.movsd_mem(slot, preg);
+      } else {
+        _builder.mov64_mem(slot, preg);
+      }
+    }
+
+    void build_load_slot(Reg preg, size_t offset) {
+      X86Inst::Mem slot(Reg::X86_RSP(), (int32_t) offset);
+      if (preg.is_xmm()) {
+        _builder.movsd(preg, slot);
+      } else {
+        _builder.mov64(preg, slot);
+      }
+    }
+
+    // Constants and stack addresses are cheaper to recompute than to reload
+    bool is_rematerializable(X86Inst* inst) const {
+      switch (inst->kind()) {
+        case X86Inst::Kind::Mov8Imm:
+        case X86Inst::Kind::Mov16Imm:
+        case X86Inst::Kind::Mov32Imm:
+        case X86Inst::Kind::Mov64Imm:
+        case X86Inst::Kind::Mov64Imm64:
+          return std::holds_alternative<Reg>(inst->rm()) &&
+                 std::holds_alternative<uint64_t>(inst->imm());
+        case X86Inst::Kind::Lea64: {
+          // Addresses of allocas are relative to the stack pointer
+          X86Inst::Mem mem = std::get<X86Inst::Mem>(inst->rm());
+          return mem.base.is_virtual() &&
+                 mem.scale == 0 &&
+                 _vreg_info[mem.base.id()].fixed == Reg::X86_RSP();
+        }
+        default:
+          return false;
+      }
+    }
+
+    void find_remats_and_copies() {
+      for (X86Block* block : _blocks) {
+        for (X86Inst* inst : *block) {
+          visit_use_then_def_with_calls(inst, [](Reg) {}, [&](Reg reg) {
+            VRegInfo& info = _vreg_info[reg.id()];
+            info.defs++;
+            info.remat = info.defs == 1 && is_rematerializable(inst) ? inst : nullptr;
+          });
+          if (is_reg_mov(inst)) {
+            _vreg_info[std::get<Reg>(inst->rm()).id()].copy = inst->reg();
+          }
+        }
+      }
+    }
+
+    // Prefers the register the vreg (or the block argument it is copied to)
+    // occupies in an already fixed block state
+    Reg get_free_reg(RegFileState& reg_file, Reg vreg) {
+      Reg hint;
+      // Jumps copy through a temporary, so follow a few copies
+      Reg copy = vreg;
+      for (size_t it = 0; it < 3 && copy.is_virtual() && !hint.is_physical(); it++) {
+        hint = _vreg_info[copy.id()].hint;
+        copy = _vreg_info[copy.id()].copy;
+      }
+      if (hint.is_physical() && reg_file.is_free(hint)) {
+        return hint;
+      }
+      return reg_file.get_free_reg(_vreg_info[vreg.id()].reg_class);
+    }
+
+    void build_remat(Reg preg, X86Inst* def) {
+      switch (def->kind()) {
+        case X86Inst::Kind::Mov8Imm: _builder.mov8_imm(preg, def->imm()); break;
+        case X86Inst::Kind::Mov16Imm: _builder.mov16_imm(preg, def->imm()); break;
+        case X86Inst::Kind::Mov32Imm: _builder.mov32_imm(preg, def->imm()); break;
+        case X86Inst::Kind::Mov64Imm: _builder.mov64_imm(preg, def->imm()); break;
+        case X86Inst::Kind::Mov64Imm64: _builder.mov64_imm64(preg, def->imm())->set_data(def->data()); break;
+        case X86Inst::Kind::Lea64: {
+          X86Inst::Mem mem = std::get<X86Inst::Mem>(def->rm());
+          _builder.lea64(preg, X86Inst::Mem(Reg::X86_RSP(), mem.disp));
+        }
+        break;
+        default: assert(false);
+      }
+
+      #ifdef METAJIT_STATS
+      _stats.rematerialized++;
+      #endif
+    }
+
+    void spill(RegFileState& reg_file, Reg preg, bool allow_spill_to_reg = true) {
+      Reg vreg = reg_file[preg];
+      if (vreg.is_virtual()) {
+        VRegInfo& info = _vreg_info[vreg.id()];
+        Reg free_reg = get_free_reg(reg_file, vreg);
+        if (info.remat) {
+          // Recomputed by unspill, so there is nothing to store
+          reg_file.free(preg);
+          info.current_reg = Reg();
+        } else if (allow_spill_to_reg && free_reg.is_physical()) {
+          // No need to spill, just move to free reg
+          build_mov(free_reg, preg);
+          reg_file.free(preg);
+          info.current_reg = free_reg;
+          reg_file.set(free_reg, vreg);
+        } else {
+          if (info.stack_offset == ~size_t(0)) {
+            info.stack_offset = _stack_offset_alloc.alloc();
+          }
+          build_store_slot(info.stack_offset, preg);
+          reg_file.free(preg);
+          info.current_reg = Reg();
+        }
+      }
+    }
+
+    void unspill(RegFileState& reg_file, Reg vreg, Reg preg) {
+      assert(vreg.is_virtual());
+      VRegInfo& info = _vreg_info[vreg.id()];
+      if (info.current_reg.is_physical()) {
+        // No need to unspill, just move from current reg
+        build_mov(preg, info.current_reg);
+        reg_file.free(info.current_reg);
+      } else if (info.remat) {
+        build_remat(preg, info.remat);
+      } else {
+        assert(info.stack_offset != ~size_t(0));
+        build_load_slot(preg, info.stack_offset);
+      }
+      info.current_reg = preg;
+      reg_file.set(preg, vreg);
+    }
+
+    void spill_and_unspill(RegFileState& reg_file,
+                           Reg preg,
+                           Reg vreg,
+                           bool is_def,
+                           bool allow_spill_to_reg = true) {
+      assert(preg.is_physical());
+      spill(reg_file, preg, allow_spill_to_reg);
+      if (vreg.is_virtual()) {
+        VRegInfo& info = _vreg_info[vreg.id()];
+        if (is_def) {
+          info.current_reg = preg;
+          reg_file.set(preg, vreg);
+        } else {
+          unspill(reg_file, vreg, preg);
+        }
+        reg_file.touch(preg); 
+      }
+    }
+
+    // Moves the register file into the given state. The register to register
+    // moves form a parallel copy, which is sequentialized so that cycles are
+    // broken by exchanges instead of going through the stack.
+    void restore_state(RegFileState& reg_file, Reg* state) {
+      auto target_reg = [&](Reg vreg) {
+        for (size_t it = 0; it < reg_file.size(); it++) {
+          if (state[it] == vreg) {
+            return Reg::phys(it);
+          }
+        }
+        return Reg();
+      };
+
+      auto is_pending = [&](Reg preg) {
+        Reg vreg = state[preg.id()];
+        return vreg.is_virtual() &&
+               reg_file[preg] != vreg &&
+               _vreg_info[vreg.id()].current_reg.is_physical();
+      };
+
+      // Values which the target does not keep in registers go to the stack
+      for (size_t it = 0; it < reg_file.size(); it++) {
+        Reg preg = Reg::phys(it);
+        Reg vreg = reg_file[preg];
+        if (vreg.is_virtual() && vreg != state[it] && !target_reg(vreg).is_physical()) {
+          spill(reg_file, preg, false);
+        }
+      }
+
+      while (true) {
+        bool pending = false;
+        bool progress = false;
+        for (size_t it = 0; it < reg_file.size(); it++) {
+          Reg preg = Reg::phys(it);
+          if (is_pending(preg)) {
+            pending = true;
+            if (reg_file.is_free(preg)) {
+              unspill(reg_file, state[it], preg);
+              reg_file.touch(preg);
+              progress = true;
+            }
+          }
+        }
+
+        if (!pending) {
+          break;
+        } else if (progress) {
+          continue;
+        }
+
+        // All remaining moves form cycles
+        Reg preg;
+        for (size_t it = 0; it < reg_file.size() && !preg.is_physical(); it++) {
+          if (is_pending(Reg::phys(it))) {
+            preg = Reg::phys(it);
+          }
+        }
+
+        Reg vreg = state[preg.id()];
+        Reg other = reg_file[preg];
+        VRegInfo& info = _vreg_info[vreg.id()];
+        VRegInfo& other_info = _vreg_info[other.id()];
+        if (preg.reg_class() == Reg::Class::GPR) {
+          Reg src = info.current_reg;
+          _builder.xchg64(preg, src);
+          reg_file.set(preg, vreg);
+          reg_file.set(src, other);
+          info.current_reg = preg;
+          other_info.current_reg = src;
+        } else {
+          Reg scratch = reg_file.get_free_reg(Reg::Class::XMM);
+          if (scratch.is_physical()) {
+            build_mov(scratch, preg);
+            reg_file.free(preg);
+            reg_file.set(scratch, other);
+            other_info.current_reg = scratch;
+          } else {
+            spill(reg_file, preg, false);
+          }
+        }
+      }
+
+      // Values which are not in any register are loaded last
+      for (size_t it = 0; it < reg_file.size(); it++) {
+        Reg preg = Reg::phys(it);
+        if (state[it].is_virtual() && reg_file[preg] != state[it]) {
+          assert(reg_file.is_free(preg));
+          unspill(reg_file, state[it], preg);
+          reg_file.touch(preg);
+        }
+      }
+    }
+
+    static bool is_reg_mov(X86Inst* inst) {
+      return (inst->kind() == X86Inst::Kind::Mov64 ||
+              inst->kind() == X86Inst::Kind::MovAPS) &&
+             std::holds_alternative<Reg>(inst->rm());
+    }
+
+    bool is_foldable_mov(X86Inst* inst) {
+      if (is_reg_mov(inst)) {
+        Reg src = std::get<Reg>(inst->rm());
+        Reg dst = inst->reg();
+        assert(src.is_virtual() && dst.is_virtual());
+        const VRegInfo& dst_info = _vreg_info[dst.id()];
+        // Block arguments which are not in a register on this path can take over the source register
+        bool dst_free = dst_info.interval.min == inst->name() ||
+                        (dst_info.defs > 1 && dst_info.current_reg.is_invalid());
+        if (_vreg_info[src.id()].current_reg.is_physical() &&
+            _vreg_info[src.id()].interval.max == inst->name() &&
+            dst_free &&
+            dst_info.fixed.is_invalid()) {
+          return true;
+        }
+      } 
+      return false;
+    }
+
+    void load_state(RegFileState& reg_file, Reg* state) {
+      for (size_t it = 0; it < reg_file.size(); it++) {
+        Reg preg = Reg::phys(it);
+        if (reg_file[preg].is_virtual()) {
+          _vreg_info[reg_file[preg].id()].current_reg = Reg();
+        }
+      }
+      reg_file.load_state(state);
+      for (size_t it = 0; it < reg_file.size(); it++) {
+        Reg preg = Reg::phys(it);
+        if (reg_file[preg].is_virtual()) {
+          _vreg_info[reg_file[preg].id()].current_reg = preg;
+        }
+      }
+    }
+
+    void spill_all(RegFileState& reg_file) {
+      for (size_t it = 0; it < reg_file.size(); it++) {
+        if (!reg_file.is_free(Reg::phys(it))) {
+          spill(reg_file, Reg::phys(it), false);
         }
       }
     }
@@ -1497,8 +2676,7 @@ namespace metajit {
       // Since they are used for block arguments, the register may
       // be def-only even if the instruction is not the first in
       // the register's live interval.
-      if (inst->kind() == X86Inst::Kind::Mov64 &&
-          std::holds_alternative<Reg>(inst->rm())) {
+      if (is_reg_mov(inst)) {
         Reg src = std::get<Reg>(inst->rm());
         Reg dst = inst->reg();
         if (reg != src && reg == dst) {
@@ -1510,6 +2688,8 @@ namespace metajit {
     }
 
     void regalloc() {
+      find_remats_and_copies();
+
       for (X86Block* block : _blocks) {
         for (X86Inst* inst : *block) {
           inst->visit_regs([&](Reg reg) {
@@ -1583,7 +2763,18 @@ namespace metajit {
                   !info.is_preserved(preg) &&
                   !info.is_arg(preg, data->args.size()) &&
                   reg_file[preg] != std::get<Reg>(inst->rm())) {
-                spill(reg_file, preg, false);
+                // Values live across the call are kept in a callee-saved register if possible
+                Reg vreg = reg_file[preg];
+                Reg saved = reg_file.get_free_reg(preg.reg_class(), info.preserved_mask());
+                if (saved.is_physical()) {
+                  build_mov(saved, preg);
+                  reg_file.free(preg);
+                  reg_file.set(saved, vreg);
+                  reg_file.touch(saved);
+                  _vreg_info[vreg.id()].current_reg = saved;
+                } else {
+                  spill(reg_file, preg, false);
+                }
               }
             }
 
@@ -1627,9 +2818,9 @@ namespace metajit {
             inst->visit_regs([&](Reg reg) {
               VRegInfo& info = _vreg_info[reg.id()];
               if (info.current_reg.is_invalid() && !info.fixed.is_physical()) {
-                Reg preg = reg_file.get_free_reg();
+                Reg preg = get_free_reg(reg_file, reg);
                 if (!preg.is_physical()) {
-                  preg = reg_file.get_lru();
+                  preg = reg_file.get_lru(info.reg_class);
                 }
                 spill_and_unspill(reg_file, preg, reg, is_def_only(reg, inst));
               }
@@ -1684,14 +2875,7 @@ namespace metajit {
                 _builder.comment(stream.str());
               }
               #endif
-              for (size_t it = 0; it < reg_file.size(); it++) {
-                Reg preg = Reg::phys(it);
-                Reg current_vreg = reg_file[preg];
-                Reg target_vreg = target->regalloc()[it];
-                if (current_vreg != target_vreg) {
-                  spill_and_unspill(reg_file, preg, target_vreg, /*is_def=*/ false, /*allow_spill_to_reg=*/ false);
-                }
-              }
+              restore_state(reg_file, target->regalloc());
               #ifdef METAJIT_DEBUG
               {
                 std::ostringstream stream;
@@ -1718,6 +2902,7 @@ namespace metajit {
                 Reg reg = reg_file[Reg::phys(it)];
                 if (reg.is_virtual() && _vreg_info[reg.id()].interval.max >= target->first()->name()) {
                   state[it] = reg;
+                  _vreg_info[reg.id()].hint = Reg::phys(it);
                 } else {
                   state[it] = Reg();
                 }
@@ -1741,21 +2926,45 @@ namespace metajit {
       #endif
     }
 
+    // Symmetric relation between vregs, stored as a lower triangular bit matrix
+    class TriangularBitMatrix {
+    private:
+      std::vector<uint64_t> _words;
+
+      static size_t index(size_t a, size_t b) {
+        if (a < b) {
+          std::swap(a, b);
+        }
+        return a * (a - 1) / 2 + b;
+      }
+    public:
+      TriangularBitMatrix(size_t size): _words((size * (size - 1) / 2 + 63) / 64, 0) {}
+
+      bool test(size_t a, size_t b) const {
+        size_t idx = index(a, b);
+        return (_words[idx / 64] >> (idx % 64)) & 1;
+      }
+
+      // Returns true if the bit was not set before
+      bool set(size_t a, size_t b) {
+        size_t idx = index(a, b);
+        uint64_t mask = uint64_t(1) << (idx % 64);
+        bool is_new = (_words[idx / 64] & mask) == 0;
+        _words[idx / 64] |= mask;
+        return is_new;
+      }
+    };
+
     void graph_coloring_regalloc() {
-      // Not performance critical, since it is not used for JIT, so we can afford to be a bit naive here
+      // Not as performance critical as the JIT register allocator,
+      // but it needs to scale to large sections
 
-      std::vector<std::set<X86Block*>> incoming(_blocks.size());
+      size_t vreg_count = _vreg_info.size();
       std::map<Reg, std::set<Reg>> merge;
 
       for (X86Block* block : _blocks) {
         for (X86Inst* inst : *block) {
-          if (std::holds_alternative<X86Block*>(inst->imm())) {
-            X86Block* target = std::get<X86Block*>(inst->imm());
-            incoming[target->name()].insert(block);
-          }
-
-          if (inst->kind() == X86Inst::Kind::Mov64 &&
-              std::holds_alternative<Reg>(inst->rm())) {
+          if (is_reg_mov(inst)) {
             Reg src = std::get<Reg>(inst->rm());
             Reg dst = inst->reg();
             if (src.is_virtual() && dst.is_virtual()) {
@@ -1766,40 +2975,73 @@ namespace metajit {
         }
       }
 
-      std::vector<std::set<Reg>> liveness_at_exit(_blocks.size());
-      std::vector<std::set<Reg>> conflicts(_vreg_info.size());
+      std::vector<BitVector> live_in(_blocks.size(), BitVector(vreg_count));
 
       bool changed = true;
       while (changed) {
         changed = false;
 
-        for (X86Block* block : _blocks) {
-          std::set<Reg> live = liveness_at_exit.at(block->name());
-          for (X86Inst* inst : block->rev_range()) {
-            inst->visit_defs([&](Reg reg) {
-              live.erase(reg);
-            });
-            inst->visit_uses([&](Reg reg) {
-              live.insert(reg);
+        for (size_t it = _blocks.size(); it-- > 0; ) {
+          BitVector live(vreg_count);
+          for (X86Inst* inst : _blocks[it]->rev_range()) {
+            if (std::holds_alternative<X86Block*>(inst->imm())) {
+              live.or_with(live_in[std::get<X86Block*>(inst->imm())->name()]);
+            }
+            visit_use_then_def_with_calls(inst, [](Reg) {}, [&](Reg reg) {
+              live.clear(reg.id());
             });
+            visit_use_then_def_with_calls(inst, [&](Reg reg) {
+              live.set(reg.id());
+            }, [](Reg) {});
+          }
 
-            for (Reg reg : live) {
-              for (Reg other : live) {
-                if (reg != other) {
-                  conflicts.at(reg.id()).insert(other);
-                }
-              }
-            }
+          if (live != live_in[it]) {
+            live_in[it] = live;
+            changed = true;
           }
+        }
+      }
 
-          for (X86Block* pred : incoming.at(block->name())) {
-            std::set<Reg>& pred_live = liveness_at_exit.at(pred->name());
-            for (Reg reg : live) {
-              if (pred_live.find(reg) == pred_live.end()) {
-                pred_live.insert(reg);
-                changed = true;
-              }
-            }
+      // Every def conflicts with the registers live after it.
+      // Registers which are live at the entry without a def conflict with each other.
+      TriangularBitMatrix conflict_matrix(vreg_count);
+      std::vector<std::vector<size_t>> conflicts(vreg_count);
+
+      auto add_conflict = [&](size_t a, size_t b) {
+        if (a != b && conflict_matrix.set(a, b)) {
+          conflicts[a].push_back(b);
+          conflicts[b].push_back(a);
+        }
+      };
+
+      for (size_t it = _blocks.size(); it-- > 0; ) {
+        BitVector live(vreg_count);
+        for (X86Inst* inst : _blocks[it]->rev_range()) {
+          if (std::holds_alternative<X86Block*>(inst->imm())) {
+            live.or_with(live_in[std::get<X86Block*>(inst->imm())->name()]);
+          }
+          visit_use_then_def_with_calls(inst, [](Reg) {}, [&](Reg reg) {
+            live.for_each([&](size_t other) {
+              add_conflict(reg.id(), other);
+            });
+          });
+          visit_use_then_def_with_calls(inst, [](Reg) {}, [&](Reg reg) {
+            live.clear(reg.id());
+          });
+          visit_use_then_def_with_calls(inst, [&](Reg reg) {
+            live.set(reg.id());
+          }, [](Reg) {});
+        }
+      }
+
+      {
+        std::vector<size_t> entry_live;
+        live_in[0].for_each([&](size_t id) {
+          entry_live.push_back(id);
+        });
+        for (size_t a : entry_live) {
+          for (size_t b : entry_live) {
+            add_conflict(a, b);
           }
         }
       }
@@ -1812,9 +3054,9 @@ namespace metajit {
           stream << "  v" << it << ";" << std::endl;
         }
         for (size_t it = 0; it < conflicts.size(); it++) {
-          for (Reg conflict : conflicts.at(it)) {
-            if (it < conflict.id()) {
-              stream << "  v" << it << " -- v" << conflict.id() << ";" << std::endl;
+          for (size_t conflict : conflicts.at(it)) {
+            if (it < conflict) {
+              stream << "  v" << it << " -- v" << conflict << ";" << std::endl;
             }
           }
         }
@@ -1848,11 +3090,11 @@ namespace metajit {
         
         order.push_back(reg);
         closed.at(reg.id()) = true;
-        for (Reg conflict : conflicts.at(reg.id())) {
-          if (!closed.at(conflict.id())) {
-            queue.erase({degrees[conflict.id()], conflict});
-            degrees[conflict.id()]--;
-            queue.insert({degrees[conflict.id()], conflict});
+        for (size_t conflict : conflicts.at(reg.id())) {
+          if (!closed.at(conflict)) {
+            queue.erase({degrees[conflict], Reg::virt(conflict)});
+            degrees[conflict]--;
+            queue.insert({degrees[conflict], Reg::virt(conflict)});
           }
         }
       }
@@ -1861,14 +3103,14 @@ namespace metajit {
         Reg reg = order.at(it);
         assert(reg.is_virtual());
 
-        uint16_t free_mask = 0xffff;
-        free_mask &= ~(1 << Reg::X86_RSP().id());
-        free_mask &= ~(1 << Reg::X86_RBP().id());
-        for (Reg conflict : conflicts.at(reg.id())) {
-          if (std::holds_alternative<Reg>(assigned.at(conflict.id()))) {
-            Reg assigned_reg = std::get<Reg>(assigned.at(conflict.id()));
+        uint32_t free_mask = RegFileState::class_mask(_vreg_info.at(reg.id()).reg_class);
+        free_mask &= ~(uint32_t(1) << Reg::X86_RSP().id());
+        free_mask &= ~(uint32_t(1) << Reg::X86_RBP().id());
+        for (size_t conflict : conflicts.at(reg.id())) {
+          if (std::holds_alternative<Reg>(assigned.at(conflict))) {
+            Reg assigned_reg = std::get<Reg>(assigned.at(conflict));
             if (assigned_reg.is_physical()) {
-              free_mask &= ~(1 << assigned_reg.id());
+              free_mask &= ~(uint32_t(1) << assigned_reg.id());
             }
           }
         }
@@ -1880,130 +3122,1121 @@ namespace metajit {
           bool merged = false;
           if (merge.find(reg) != merge.end()) {
             std::set<Reg> open = merge.at(reg);
-            std::set<Reg> closure_conflicts = conflicts.at(reg.id());
-            std::set<Reg> closed;
+            std::vector<size_t> closure = { reg.id() };
 
             while (!open.empty()) {
               Reg merge_reg = *open.begin();
               open.erase(open.begin());
-              closed.insert(merge_reg);
 
-              if (closure_conflicts.find(merge_reg) != closure_conflicts.end()) {
+              bool is_conflicting = false;
+              for (size_t member : closure) {
+                if (member != merge_reg.id() && conflict_matrix.test(member, merge_reg.id())) {
+                  is_conflicting = true;
+                  break;
+                }
+              }
+
+              if (is_conflicting) {
                 continue; // Can't merge with this register
               }
 
-              closure_conflicts.insert(conflicts.at(merge_reg.id()).begin(), conflicts.at(merge_reg.id()).end());
+              closure.push_back(merge_reg.id());
 
               if (std::holds_alternative<Reg>(assigned.at(merge_reg.id())) &&
                   std::get<Reg>(assigned.at(merge_reg.id())).is_physical()) {
                 Reg assigned_merge_reg = std::get<Reg>(assigned.at(merge_reg.id()));
-                if ((free_mask & (1 << assigned_merge_reg.id())) != 0) {
+                if ((free_mask & (uint32_t(1) << assigned_merge_reg.id())) != 0) {
                   assigned.at(reg.id()) = assigned_merge_reg;
                   merged = true;
                   break;
                 }
               } 
               
-              uint16_t merge_free_mask = free_mask;
-              for (Reg conflict : conflicts.at(merge_reg.id())) {
-                if (std::holds_alternative<Reg>(assigned.at(conflict.id()))) {
-                  Reg assigned_conflict = std::get<Reg>(assigned.at(conflict.id()));
+              uint32_t merge_free_mask = free_mask;
+              for (size_t conflict : conflicts.at(merge_reg.id())) {
+                if (std::holds_alternative<Reg>(assigned.at(conflict))) {
+                  Reg assigned_conflict = std::get<Reg>(assigned.at(conflict));
                   if (assigned_conflict.is_physical()) {
-                    merge_free_mask &= ~(1 << assigned_conflict.id());
+                    merge_free_mask &= ~(uint32_t(1) << assigned_conflict.id());
                   }
                 }
               }
 
-              if (merge_free_mask == 0) {
-                continue; // No free registers for this merge candidate
-              }
+              if (merge_free_mask == 0) {
+                continue; // No free registers for this merge candidate
+              }
+
+              free_mask = merge_free_mask;
+            }
+          }
+
+          if (!merged) {
+            assigned.at(reg.id()) = Reg::phys(__builtin_ctz(free_mask));
+          }
+        }
+      }
+
+      for (X86Block* block : _blocks) {
+        for (auto it = block->begin(); it != block->end(); ) {
+          X86Inst* inst = *it;
+
+          if (inst->kind() == X86Inst::Kind::PseudoUse ||
+              inst->kind() == X86Inst::Kind::PseudoDef) {
+            it = it.erase(); // Not needed after regalloc
+          } else {
+            inst->visit_regs([&](Reg& reg) {
+              if (reg.is_virtual()) {
+                std::variant<Reg, size_t> assign = assigned.at(reg.id());
+                if (std::holds_alternative<Reg>(assign)) {
+                  reg = std::get<Reg>(assign);
+                } else {
+                  assert(false); // TODO
+                }
+              }
+            });
+
+            if (is_reg_mov(inst)) {
+              Reg src = std::get<Reg>(inst->rm());
+              Reg dst = inst->reg();
+              if (src == dst) {
+                it = it.erase();
+                continue;
+              }
+            }
+
+            it++;
+          }
+        }
+      }
+    }
+
+    // Like X86Inst::visit_use_then_def, but also visits the argument and return registers of calls
+    template <class UseFn, class DefFn>
+    static void visit_use_then_def_with_calls(X86Inst* inst, const UseFn& use_fn, const DefFn& def_fn) {
+      if (inst->kind() == X86Inst::Kind::Call) {
+        X86CallData* data = (X86CallData*) inst->data();
+        for (Reg arg : data->args) {
+          use_fn(arg);
+        }
+        inst->visit_use_then_def(use_fn, def_fn);
+        if (data->ret.is_virtual()) {
+          def_fn(data->ret);
+        }
+      } else {
+        inst->visit_use_then_def(use_fn, def_fn);
+      }
+    }
+
+    struct LinearScanRange {
+      size_t vreg = 0;
+      size_t start = 0;
+      size_t end = 0;
+      Reg preg;
+    };
+
+    struct LinearScanMove {
+      size_t vreg = 0;
+      Reg from; // Invalid if the value is in its stack slot
+      Reg to; // Invalid if the value is in its stack slot
+    };
+
+    size_t stack_slot(size_t vreg) {
+      VRegInfo& info = _vreg_info[vreg];
+      if (info.stack_offset == ~size_t(0)) {
+        info.stack_offset = _stack_offset_alloc.alloc();
+      }
+      return info.stack_offset;
+    }
+
+    void build_linear_scan_moves(const std::vector<LinearScanMove>& moves) {
+      std::vector<LinearScanMove> pending;
+      std::vector<LinearScanMove> loads;
+
+      // Stores only read registers, so they can go first
+      for (const LinearScanMove& move : moves) {
+        if (move.from.is_physical() && move.to.is_invalid()) {
+          build_store_slot(stack_slot(move.vreg), move.from);
+        } else if (move.from.is_physical()) {
+          pending.push_back(move);
+        } else {
+          loads.push_back(move);
+        }
+      }
+
+      // Register to register moves are a parallel copy
+      while (!pending.empty()) {
+        bool progress = false;
+        for (auto it = pending.begin(); it != pending.end(); ) {
+          bool is_blocked = false;
+          for (const LinearScanMove& other : pending) {
+            if (other.from == it->to) {
+              is_blocked = true;
+              break;
+            }
+          }
+
+          if (is_blocked) {
+            it++;
+          } else {
+            build_mov(it->to, it->from);
+            it = pending.erase(it);
+            progress = true;
+          }
+        }
+
+        if (!progress) {
+          // Break the cycle by going through the stack slot
+          LinearScanMove move = pending.back();
+          pending.pop_back();
+          build_store_slot(stack_slot(move.vreg), move.from);
+          loads.push_back(LinearScanMove { move.vreg, Reg(), move.to });
+        }
+      }
+
+      // Loads only write registers which are no longer read by other moves
+      for (const LinearScanMove& move : loads) {
+        build_load_slot(move.to, stack_slot(move.vreg));
+      }
+    }
+
+    void linear_scan_regalloc() {
+      // Positions are 2 * name for uses and 2 * name + 1 for defs, so that a register
+      // which dies at an instruction can be reused for its result.
+      // Values only change their location before an instruction (at even positions).
+
+      // Entry arguments are copied, so that only the copy is fixed and the
+      // value itself may be split
+      std::vector<Reg> entry_regs;
+      std::vector<Reg> entry_copies;
+      for (Arg* arg : _section->entry()->args()) {
+        entry_regs.push_back(vreg(arg));
+        entry_copies.push_back(vreg(reg_class(arg->type())));
+      }
+
+      for (X86Block* block : _blocks) {
+        for (X86Inst* inst : *block) {
+          inst->visit_regs([&](Reg& reg) {
+            for (size_t it = 0; it < entry_regs.size(); it++) {
+              if (reg == entry_regs[it]) {
+                reg = entry_copies[it];
+                break;
+              }
+            }
+          });
+        }
+      }
+
+      _builder.move_to_begin(_blocks[0]);
+      for (size_t it = 0; it < entry_regs.size(); it++) {
+        build_mov(entry_copies[it], entry_regs[it]);
+      }
+
+      autoname_insts();
+
+      std::vector<X86Inst*> insts;
+      std::vector<X86Block*> inst_blocks;
+      for (X86Block* block : _blocks) {
+        for (X86Inst* inst : *block) {
+          insts.push_back(inst);
+          inst_blocks.push_back(block);
+        }
+      }
+
+      size_t vreg_count = _vreg_info.size();
+
+      // Liveness
+      std::vector<BitVector> live_in(_blocks.size(), BitVector(vreg_count));
+
+      bool changed = true;
+      while (changed) {
+        changed = false;
+
+        for (size_t it = _blocks.size(); it-- > 0; ) {
+          BitVector live(vreg_count);
+          for (X86Inst* inst : _blocks[it]->rev_range()) {
+            if (std::holds_alternative<X86Block*>(inst->imm())) {
+              live.or_with(live_in[std::get<X86Block*>(inst->imm())->name()]);
+            }
+            visit_use_then_def_with_calls(inst, [](Reg) {}, [&](Reg reg) {
+              live.clear(reg.id());
+            });
+            visit_use_then_def_with_calls(inst, [&](Reg reg) {
+              live.set(reg.id());
+            }, [](Reg) {});
+          }
+
+          if (live != live_in[it]) {
+            live_in[it] = live;
+            changed = true;
+          }
+        }
+      }
+
+      // Intervals are the hull of all positions at which a register is live
+      std::vector<std::vector<size_t>> accesses(vreg_count);
+      std::vector<std::vector<size_t>> partners(vreg_count);
+      std::vector<std::vector<Interval>> blocked(RegFileState::REG_COUNT);
+
+      for (X86Block* block : _blocks) {
+        if (block->first() == nullptr) {
+          continue;
+        }
+
+        size_t begin = 2 * block->first()->name();
+        live_in[block->name()].for_each([&](size_t id) {
+          _vreg_info[id].interval.incl(begin);
+        });
+
+        for (X86Inst* inst : *block) {
+          size_t pos = 2 * inst->name();
+
+          if (std::holds_alternative<X86Block*>(inst->imm())) {
+            X86Block* target = std::get<X86Block*>(inst->imm());
+            live_in[target->name()].for_each([&](size_t id) {
+              _vreg_info[id].interval.incl(pos + 1);
+            });
+          }
+
+          auto access = [&](Reg reg, size_t at) {
+            _vreg_info[reg.id()].interval.incl(at);
+            std::vector<size_t>& list = accesses[reg.id()];
+            if (list.empty() || list.back() != at) {
+              list.push_back(at);
+            }
+          };
+
+          visit_use_then_def_with_calls(inst, [&](Reg reg) {
+            access(reg, pos);
+          }, [&](Reg reg) {
+            access(reg, pos + 1);
+          });
+
+          if (is_reg_mov(inst)) {
+            Reg src = std::get<Reg>(inst->rm());
+            Reg dst = inst->reg();
+            partners[src.id()].push_back(dst.id());
+            partners[dst.id()].push_back(src.id());
+          }
+
+          if (inst->kind() == X86Inst::Kind::Call) {
+            X86CallData* data = (X86CallData*) inst->data();
+            CallConvInfo info(data->call_conv);
+            for (size_t it = 0; it < RegFileState::REG_COUNT; it++) {
+              if (!info.is_preserved(Reg::phys(it))) {
+                Interval clobber;
+                clobber.incl(pos + 1);
+                blocked[it].push_back(clobber);
+              }
+            }
+          }
+        }
+      }
+
+      // Fixed registers and call clobbers block physical registers
+      for (size_t id = 0; id < vreg_count; id++) {
+        const VRegInfo& info = _vreg_info[id];
+        if (info.fixed.is_physical() && !info.interval.empty()) {
+          blocked[info.fixed.id()].push_back(info.interval);
+        }
+      }
+
+      for (std::vector<Interval>& intervals : blocked) {
+        std::sort(intervals.begin(), intervals.end(), [](const Interval& a, const Interval& b) {
+          return a.min < b.min;
+        });
+
+        std::vector<Interval> merged;
+        for (const Interval& interval : intervals) {
+          if (!merged.empty() && interval.min <= merged.back().max + 1) {
+            merged.back().incl(interval.max);
+          } else {
+            merged.push_back(interval);
+          }
+        }
+        intervals = merged;
+      }
+
+      auto blocked_until = [&](size_t preg, size_t pos) {
+        const std::vector<Interval>& intervals = blocked[preg];
+        auto it = std::lower_bound(intervals.begin(), intervals.end(), pos, [](const Interval& interval, size_t pos) {
+          return interval.max < pos;
+        });
+        if (it == intervals.end()) {
+          return ~size_t(0);
+        }
+        return std::max(it->min, pos);
+      };
+
+      auto next_access = [&](size_t id, size_t pos) {
+        const std::vector<size_t>& list = accesses[id];
+        auto it = std::lower_bound(list.begin(), list.end(), pos);
+        return it == list.end() ? ~size_t(0) : *it;
+      };
+
+      // Allocation
+      std::vector<LinearScanRange> ranges;
+      std::vector<std::vector<size_t>> vreg_ranges(vreg_count);
+
+      using QueueEntry = std::pair<size_t, size_t>; // (start, range index)
+      std::priority_queue<QueueEntry, std::vector<QueueEntry>, std::greater<QueueEntry>> unhandled;
+
+      auto add_range = [&](size_t id, size_t start, size_t end) {
+        LinearScanRange range;
+        range.vreg = id;
+        range.start = start;
+        range.end = end;
+        std::vector<size_t>& list = vreg_ranges[id];
+        auto it = std::upper_bound(list.begin(), list.end(), start, [&](size_t start, size_t other) {
+          return start < ranges[other].start;
+        });
+        list.insert(it, ranges.size());
+        unhandled.push({ start, ranges.size() });
+        ranges.push_back(range);
+      };
+
+      for (size_t id = 0; id < vreg_count; id++) {
+        const VRegInfo& info = _vreg_info[id];
+        if (!info.fixed.is_physical() && !info.interval.empty()) {
+          add_range(id, info.interval.min, info.interval.max);
+        }
+      }
+
+      std::vector<size_t> active;
+      while (!unhandled.empty()) {
+        size_t index = unhandled.top().second;
+        unhandled.pop();
+
+        size_t id = ranges[index].vreg;
+        size_t pos = ranges[index].start;
+        size_t end = ranges[index].end;
+
+        active.erase(std::remove_if(active.begin(), active.end(), [&](size_t other) {
+          return ranges[other].end < pos;
+        }), active.end());
+
+        uint32_t mask = RegFileState::class_mask(_vreg_info[id].reg_class);
+        mask &= ~(uint32_t(1) << Reg::X86_RSP().id());
+        mask &= ~(uint32_t(1) << Reg::X86_RBP().id());
+
+        size_t free_until[RegFileState::REG_COUNT] = {0};
+        for (size_t it = 0; it < RegFileState::REG_COUNT; it++) {
+          if (mask & (uint32_t(1) << it)) {
+            free_until[it] = blocked_until(it, pos);
+          }
+        }
+        for (size_t other : active) {
+          free_until[ranges[other].preg.id()] = 0;
+        }
+
+        // Prefer the register of a mov partner, if it is free for the whole range
+        Reg preg;
+        for (size_t partner : partners[id]) {
+          Reg hint = _vreg_info[partner].fixed;
+          if (!hint.is_physical() && !vreg_ranges[partner].empty()) {
+            hint = ranges[vreg_ranges[partner].back()].preg;
+          }
+          if (hint.is_physical() &&
+              (mask & (uint32_t(1) << hint.id())) &&
+              free_until[hint.id()] > end) {
+            preg = hint;
+            break;
+          }
+        }
+
+        if (!preg.is_physical()) {
+          size_t best = ~size_t(0);
+          for (size_t it = 0; it < RegFileState::REG_COUNT; it++) {
+            if ((mask & (uint32_t(1) << it)) &&
+                (best == ~size_t(0) || free_until[it] > free_until[best])) {
+              best = it;
+            }
+          }
+          assert(best != ~size_t(0));
+
+          if (free_until[best] > end || (free_until[best] & ~size_t(1)) > pos) {
+            preg = Reg::phys(best);
+          } else if (next_access(id, pos) != pos) {
+            // Not needed in a register yet, so retry at the next access
+            size_t next = next_access(id, pos);
+            if (next <= end) {
+              ranges[index].start = next;
+              unhandled.push({ next, index });
+            } else {
+              std::vector<size_t>& list = vreg_ranges[id];
+              list.erase(std::find(list.begin(), list.end(), index));
+            }
+            continue;
+          } else {
+            // Evict the active range whose next access is furthest away
+            size_t split_pos = pos & ~size_t(1);
+            size_t victim = ~size_t(0);
+            size_t victim_next = 0;
+            for (size_t other : active) {
+              const LinearScanRange& range = ranges[other];
+              size_t until = blocked_until(range.preg.id(), pos);
+              if ((mask & (uint32_t(1) << range.preg.id())) == 0 ||
+                  range.start >= split_pos ||
+                  !(until > end || (until & ~size_t(1)) > pos)) {
+                continue;
+              }
+
+              size_t next = next_access(range.vreg, split_pos);
+              if (next > pos && (victim == ~size_t(0) || next > victim_next)) {
+                victim = other;
+                victim_next = next;
+              }
+            }
+            assert(victim != ~size_t(0) && "Linear scan ran out of registers");
+
+            size_t victim_end = ranges[victim].end;
+            ranges[victim].end = split_pos - 1;
+            if (victim_next <= victim_end) {
+              add_range(ranges[victim].vreg, victim_next, victim_end);
+            }
+            active.erase(std::find(active.begin(), active.end(), victim));
+
+            preg = ranges[victim].preg;
+            free_until[preg.id()] = blocked_until(preg.id(), pos);
+          }
+        }
+
+        // Split the range if the register is only free for a part of it
+        if (free_until[preg.id()] <= end) {
+          size_t split_pos = free_until[preg.id()] & ~size_t(1);
+          assert(split_pos > pos);
+          ranges[index].end = split_pos - 1;
+          size_t next = next_access(id, split_pos);
+          if (next <= end) {
+            add_range(id, next, end);
+          }
+        }
+
+        ranges[index].preg = preg;
+        active.push_back(index);
+      }
+
+      // Spill slots are shared between registers with disjoint intervals
+      {
+        std::vector<size_t> spilled;
+        for (size_t id = 0; id < vreg_count; id++) {
+          const VRegInfo& info = _vreg_info[id];
+          const std::vector<size_t>& list = vreg_ranges[id];
+          if (!info.fixed.is_physical() &&
+              !info.interval.empty() &&
+              (list.size() != 1 ||
+               ranges[list[0]].start != info.interval.min ||
+               ranges[list[0]].end != info.interval.max)) {
+            spilled.push_back(id);
+          }
+        }
+
+        std::sort(spilled.begin(), spilled.end(), [&](size_t a, size_t b) {
+          return _vreg_info[a].interval.min < _vreg_info[b].interval.min;
+        });
+
+        using SlotEntry = std::pair<size_t, size_t>; // (end of last interval, offset)
+        std::priority_queue<SlotEntry, std::vector<SlotEntry>, std::greater<SlotEntry>> slots;
+        for (size_t id : spilled) {
+          VRegInfo& info = _vreg_info[id];
+          if (!slots.empty() && slots.top().first < info.interval.min) {
+            info.stack_offset = slots.top().second;
+            slots.pop();
+          } else {
+            info.stack_offset = _stack_offset_alloc.alloc();
+          }
+          slots.push({ info.interval.max, info.stack_offset });
+        }
+      }
+
+      auto location = [&](size_t id, size_t pos) {
+        if (_vreg_info[id].fixed.is_physical()) {
+          return _vreg_info[id].fixed;
+        }
+        const std::vector<size_t>& list = vreg_ranges[id];
+        auto it = std::upper_bound(list.begin(), list.end(), pos, [&](size_t pos, size_t range) {
+          return pos < ranges[range].start;
+        });
+        if (it != list.begin() && ranges[*(it - 1)].end >= pos) {
+          return ranges[*(it - 1)].preg;
+        }
+        return Reg();
+      };
+
+      // Moves between the ranges of a register inside of blocks.
+      // Moves at the beginning of blocks are inserted on the incoming edges instead.
+      std::map<size_t, std::vector<LinearScanMove>> moves;
+      for (size_t id = 0; id < vreg_count; id++) {
+        const Interval& interval = _vreg_info[id].interval;
+        for (size_t index : vreg_ranges[id]) {
+          const LinearScanRange& range = ranges[index];
+
+          if (range.start > interval.min && range.start % 2 == 0) {
+            Reg from = location(id, range.start - 1);
+            if (from != range.preg) {
+              moves[range.start / 2].push_back(LinearScanMove { id, from, range.preg });
+            }
+          }
+
+          if (range.end < interval.max && range.end % 2 == 1) {
+            if (location(id, range.end + 1).is_invalid()) {
+              moves[(range.end + 1) / 2].push_back(LinearScanMove { id, range.preg, Reg() });
+            }
+          }
+        }
+      }
+
+      for (auto& [name, name_moves] : moves) {
+        X86Inst* inst = insts[name];
+        X86Block* block = inst_blocks[name];
+        if (inst != block->first()) {
+          _builder.move_before(block, inst);
+          build_linear_scan_moves(name_moves);
+        }
+      }
+
+      // Moves on edges between blocks
+      size_t block_count = _blocks.size();
+      for (size_t it = 0; it < block_count; it++) {
+        X86Block* block = _blocks[it];
+
+        std::vector<X86Inst*> jumps;
+        for (X86Inst* inst : *block) {
+          if (std::holds_alternative<X86Block*>(inst->imm())) {
+            jumps.push_back(inst);
+          }
+        }
+
+        for (X86Inst* inst : jumps) {
+          X86Block* target = std::get<X86Block*>(inst->imm());
+          if (target->first() == nullptr) {
+            continue;
+          }
+
+          size_t from_pos = 2 * inst->name() + 1;
+          size_t to_pos = 2 * target->first()->name();
+
+          std::vector<LinearScanMove> edge_moves;
+          live_in[target->name()].for_each([&](size_t id) {
+            Reg from = location(id, from_pos);
+            Reg to = location(id, to_pos);
+            if (from != to) {
+              edge_moves.push_back(LinearScanMove { id, from, to });
+            }
+          });
+
+          if (edge_moves.empty()) {
+            continue;
+          }
+
+          if (inst->kind() == X86Inst::Kind::Jmp) {
+            _builder.move_before(block, inst);
+            build_linear_scan_moves(edge_moves);
+          } else {
+            // Conditional jumps get a new block for the moves
+            X86Block* edge_block = _builder.build_block();
+            edge_block->set_name(_blocks.size());
+            _blocks.push_back(edge_block);
+
+            _builder.move_to_end(edge_block);
+            build_linear_scan_moves(edge_moves);
+            _builder.jmp(target);
+            inst->set_imm(edge_block);
+          }
+        }
+      }
+
+      // Rewrite registers
+      for (size_t name = 0; name < insts.size(); name++) {
+        X86Inst* inst = insts[name];
+        inst->visit_regs([&](Reg& reg) {
+          if (reg.is_virtual()) {
+            Reg preg = location(reg.id(), 2 * name);
+            if (preg.is_invalid()) {
+              preg = location(reg.id(), 2 * name + 1);
+            }
+            assert(preg.is_physical());
+            reg = preg;
+          }
+        });
+      }
+
+      for (X86Block* block : _blocks) {
+        for (auto it = block->begin(); it != block->end(); ) {
+          X86Inst* inst = *it;
+          if (inst->kind() == X86Inst::Kind::PseudoUse ||
+              inst->kind() == X86Inst::Kind::PseudoDef) {
+            it = it.erase(); // Not needed after regalloc
+          } else if (is_reg_mov(inst) && std::get<Reg>(inst->rm()) == inst->reg()) {
+            it = it.erase();
+          } else {
+            it++;
+          }
+        }
+      }
+    }
+
+    enum class PeepholeResult {
+      None, Rewrite, Erase
+    };
+
+    static bool is_reg(const X86Inst::RM& rm, Reg reg) {
+      return std::holds_alternative<Reg>(rm) && std::get<Reg>(rm) == reg;
+    }
+
+    static bool is_jump(X86Inst* inst) {
+      return std::holds_alternative<X86Block*>(inst->imm());
+    }
+
+    static bool is_ret(X86Inst* inst) {
+      return inst->kind() == X86Inst::Kind::Ret ||
+             inst->kind() == X86Inst::Kind::LinkRet;
+    }
+
+    // The exit id and, for linked exits, the input registers are live at a ret
+    bool live_at_ret(X86Inst* ret, Reg reg) const {
+      if (reg == Reg::X86_RAX()) {
+        return true;
+      }
+      if (ret->kind() == X86Inst::Kind::LinkRet) {
+        return std::find(_input_pregs.begin(), _input_pregs.end(), reg) != _input_pregs.end();
+      }
+      return false;
+    }
+
+    // Like X86Inst::visit_use_then_def, but also visits the implicit operands of divisions
+    template <class UseFn, class DefFn>
+    static void visit_implicit_use_then_def(X86Inst* inst, const UseFn& use_fn, const DefFn& def_fn) {
+      switch (inst->kind()) {
+        case X86Inst::Kind::Div8:
+        case X86Inst::Kind::Div16:
+        case X86Inst::Kind::Div32:
+        case X86Inst::Kind::Div64:
+        case X86Inst::Kind::IDiv8:
+        case X86Inst::Kind::IDiv16:
+        case X86Inst::Kind::IDiv32:
+        case X86Inst::Kind::IDiv64:
+          use_fn(Reg::X86_RAX());
+          use_fn(Reg::X86_RDX());
+          inst->visit_use_then_def(use_fn, def_fn);
+          def_fn(Reg::X86_RAX());
+          def_fn(Reg::X86_RDX());
+        break;
+        case X86Inst::Kind::Cwd:
+        case X86Inst::Kind::Cdq:
+        case X86Inst::Kind::Cqo:
+          use_fn(Reg::X86_RAX());
+          def_fn(Reg::X86_RDX());
+        break;
+        default:
+          inst->visit_use_then_def(use_fn, def_fn);
+        break;
+      }
+    }
+
+    static bool reads_reg(X86Inst* inst, Reg reg) {
+      bool reads = false;
+      visit_implicit_use_then_def(inst, [&](Reg use) {
+        reads = reads || use == reg;
+      }, [](Reg) {});
+      return reads;
+    }
+
+    static bool writes_reg(X86Inst* inst, Reg reg) {
+      bool writes = false;
+      visit_implicit_use_then_def(inst, [](Reg) {}, [&](Reg def) {
+        writes = writes || def == reg;
+      });
+      return writes;
+    }
+
+    // Checks that reg is overwritten before it is read again.
+    // Values are never live across calls, jumps or the end of a block here.
+    bool reg_dead_after(X86Inst* inst, Reg reg) const {
+      for (X86Inst* next = inst->next(); next != nullptr; next = next->next()) {
+        if (is_ret(next)) {
+          return !live_at_ret(next, reg);
+        } else if (next->kind() == X86Inst::Kind::Call ||
+                   is_jump(next) ||
+                   reads_reg(next, reg)) {
+          return false;
+        } else if (writes_reg(next, reg)) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    #define cond_kinds(prefix, suffix) \
+      case X86Inst::Kind::prefix##E##suffix: \
+      case X86Inst::Kind::prefix##NE##suffix: \
+      case X86Inst::Kind::prefix##L##suffix: \
+      case X86Inst::Kind::prefix##GE##suffix: \
+      case X86Inst::Kind::prefix##LE##suffix: \
+      case X86Inst::Kind::prefix##G##suffix: \
+      case X86Inst::Kind::prefix##B##suffix: \
+      case X86Inst::Kind::prefix##AE##suffix: \
+      case X86Inst::Kind::prefix##BE##suffix: \
+      case X86Inst::Kind::prefix##A##suffix:
+
+    static bool is_setcc(X86Inst::Kind kind) {
+      switch (kind) {
+        cond_kinds(Set, 8)
+          return true;
+        default:
+          return false;
+      }
+    }
+
+    static bool reads_flags(X86Inst::Kind kind) {
+      switch (kind) {
+        cond_kinds(Set, 8)
+        cond_kinds(J, )
+        case X86Inst::Kind::CMovNZ64:
+        case X86Inst::Kind::CMovE64:
+        case X86Inst::Kind::CMovL64:
+        case X86Inst::Kind::CMovGE64:
+        case X86Inst::Kind::CMovLE64:
+        case X86Inst::Kind::CMovG64:
+        case X86Inst::Kind::CMovB64:
+        case X86Inst::Kind::CMovAE64:
+        case X86Inst::Kind::CMovBE64:
+        case X86Inst::Kind::CMovA64:
+          return true;
+        default:
+          return false;
+      }
+    }
+
+    #undef cond_kinds
+
+    static bool is_flags_producer(X86Inst::Kind kind) {
+      switch (kind) {
+        case X86Inst::Kind::Cmp8:
+        case X86Inst::Kind::Cmp16:
+        case X86Inst::Kind::Cmp32:
+        case X86Inst::Kind::Cmp64:
+        case X86Inst::Kind::Cmp8RM:
+        case X86Inst::Kind::Cmp16RM:
+        case X86Inst::Kind::Cmp32RM:
+        case X86Inst::Kind::Cmp64RM:
+        case X86Inst::Kind::Cmp8Imm:
+        case X86Inst::Kind::Cmp16Imm:
+        case X86Inst::Kind::Cmp32Imm:
+        case X86Inst::Kind::Cmp64Imm:
+        case X86Inst::Kind::Test8:
+        case X86Inst::Kind::Test16:
+        case X86Inst::Kind::Test32:
+        case X86Inst::Kind::Test64:
+        case X86Inst::Kind::Test8Imm:
+        case X86Inst::Kind::Test16Imm:
+        case X86Inst::Kind::Test32Imm:
+        case X86Inst::Kind::Test64Imm:
+        case X86Inst::Kind::UComISS:
+        case X86Inst::Kind::UComISD:
+          return true;
+        default:
+          return false;
+      }
+    }
+
+    // Checks that clobbering the flags at inst is not observable.
+    // isel never keeps flags live across blocks.
+    static bool flags_dead_after(X86Inst* inst) {
+      for (X86Inst* next = inst->next(); next != nullptr; next = next->next()) {
+        if (reads_flags(next->kind())) {
+          return false;
+        } else if (is_flags_producer(next->kind())) {
+          return true;
+        }
+      }
+      return true;
+    }
+
+    // mov a, a
+    PeepholeResult peephole_self_mov(X86Block* block, X86Inst* inst) {
+      switch (inst->kind()) {
+        // Mov32 zero extends, so it is not a no-op
+        case X86Inst::Kind::Mov8:
+        case X86Inst::Kind::Mov16:
+        case X86Inst::Kind::Mov64:
+        case X86Inst::Kind::MovAPS:
+        case X86Inst::Kind::MovSS:
+        case X86Inst::Kind::MovSD:
+          if (is_reg(inst->rm(), inst->reg())) {
+            return PeepholeResult::Erase;
+          }
+        break;
+        default: break;
+      }
+      return PeepholeResult::None;
+    }
+
+    // mov b, a; ...; mov c, b  =>  ...; mov c, a
+    // if b is dead afterwards
+    PeepholeResult peephole_mov_chain(X86Block* block, X86Inst* inst) {
+      if ((inst->kind() != X86Inst::Kind::Mov64 &&
+           inst->kind() != X86Inst::Kind::MovAPS) ||
+          !std::holds_alternative<Reg>(inst->rm())) {
+        return PeepholeResult::None;
+      }
+
+      Reg a = std::get<Reg>(inst->rm());
+      Reg b = inst->reg();
+      for (X86Inst* next = inst->next(); next != nullptr; next = next->next()) {
+        if (next->kind() == X86Inst::Kind::Call ||
+            is_ret(next) ||
+            is_jump(next)) {
+          break;
+        } else if (reads_reg(next, b)) {
+          if (next->kind() == inst->kind() &&
+              is_reg(next->rm(), b) &&
+              reg_dead_after(next, b)) {
+            next->set_rm(a);
+            return PeepholeResult::Erase;
+          }
+          break;
+        } else if (writes_reg(next, a) || writes_reg(next, b)) {
+          break;
+        }
+      }
+      return PeepholeResult::None;
+    }
+
+    // mov [rsp + x], a; ...; mov b, [rsp + x]  =>  mov [rsp + x], a; ...; mov b, a
+    PeepholeResult peephole_spill_reload(X86Block* block, X86Inst* inst) {
+      X86Inst::Kind store_kind;
+      X86Inst::Kind mov_kind;
+      switch (inst->kind()) {
+        case X86Inst::Kind::Mov64:
+          store_kind = X86Inst::Kind::Mov64Mem;
+          mov_kind = X86Inst::Kind::Mov64;
+        break;
+        case X86Inst::Kind::MovSD:
+          store_kind = X86Inst::Kind::MovSDMem;
+          mov_kind = X86Inst::Kind::MovAPS;
+        break;
+        default: return PeepholeResult::None;
+      }
+
+      if (!std::holds_alternative<X86Inst::Mem>(inst->rm())) {
+        return PeepholeResult::None;
+      }
+      X86Inst::Mem slot = std::get<X86Inst::Mem>(inst->rm());
+      if (slot.base != Reg::X86_RSP() || slot.scale != 0) {
+        return PeepholeResult::None;
+      }
+
+      for (X86Inst* prev = inst->prev(); prev != nullptr; prev = prev->prev()) {
+        if (prev->kind() == X86Inst::Kind::Call ||
+            writes_reg(prev, Reg::X86_RSP())) {
+          break;
+        }
+
+        if (!std::holds_alternative<X86Inst::Mem>(prev->rm()) ||
+            prev->kind() == X86Inst::Kind::Lea64) {
+          continue;
+        }
+        X86Inst::Mem mem = std::get<X86Inst::Mem>(prev->rm());
+        if (mem.base != Reg::X86_RSP()) {
+          continue;
+        } else if (mem.scale != 0) {
+          break;
+        } else if (mem.disp + 8 <= slot.disp || slot.disp + 8 <= mem.disp) {
+          continue;
+        }
+
+        // Any other access to the slot might be a store
+        if (prev->kind() != store_kind || mem.disp != slot.disp) {
+          break;
+        }
+
+        Reg value = prev->reg();
+        for (X86Inst* cur = prev->next(); cur != inst; cur = cur->next()) {
+          if (writes_reg(cur, value)) {
+            return PeepholeResult::None;
+          }
+        }
+
+        if (value == inst->reg()) {
+          return PeepholeResult::Erase;
+        }
+        inst->set_kind(mov_kind);
+        inst->set_rm(value);
+        return PeepholeResult::Rewrite;
+      }
+      return PeepholeResult::None;
+    }
+
+    // The result of setcc is already 0 or 1, so masking it only matters
+    // if one of the upper bytes is read afterwards:
+    // setcc a; ...; and a, 1; <byte uses of a>  =>  setcc a; ...; <byte uses of a>
+    PeepholeResult peephole_setcc_and(X86Block* block, X86Inst* inst) {
+      if (inst->kind() != X86Inst::Kind::And64Imm ||
+          !std::holds_alternative<Reg>(inst->rm()) ||
+          !std::holds_alternative<uint64_t>(inst->imm()) ||
+          std::get<uint64_t>(inst->imm()) != 1 ||
+          !flags_dead_after(inst)) {
+        return PeepholeResult::None;
+      }
+
+      Reg reg = std::get<Reg>(inst->rm());
+      X86Inst* def = inst->prev();
+      while (def != nullptr &&
+             def->kind() != X86Inst::Kind::Call &&
+             !reads_reg(def, reg) &&
+             !writes_reg(def, reg)) {
+        def = def->prev();
+      }
+      if (def == nullptr ||
+          def->kind() == X86Inst::Kind::Call ||
+          !is_setcc(def->kind()) ||
+          !is_reg(def->rm(), reg)) {
+        return PeepholeResult::None;
+      }
+
+      // Uses of reg in an address read all 64 bits
+      auto is_address_use = [&](X86Inst* use) {
+        return std::holds_alternative<X86Inst::Mem>(use->rm()) &&
+               (std::get<X86Inst::Mem>(use->rm()).base == reg ||
+                std::get<X86Inst::Mem>(use->rm()).index == reg);
+      };
 
-              free_mask = merge_free_mask;
-            }
-          }
+      auto is_byte_use = [&](X86Inst* use) {
+        switch (use->kind()) {
+          case X86Inst::Kind::Mov8Mem:
+            return !is_reg(use->rm(), reg) && !is_address_use(use);
+          case X86Inst::Kind::Test8Imm:
+          case X86Inst::Kind::Cmp8Imm:
+            return is_reg(use->rm(), reg);
+          default:
+            return false;
+        }
+      };
 
-          if (!merged) {
-            assigned.at(reg.id()) = Reg::phys(__builtin_ctz(free_mask));
+      for (X86Inst* next = inst->next(); next != nullptr; next = next->next()) {
+        if (is_ret(next)) {
+          return live_at_ret(next, reg) ? PeepholeResult::None : PeepholeResult::Erase;
+        } else if (next->kind() == X86Inst::Kind::Call || is_jump(next)) {
+          break;
+        } else if (reads_reg(next, reg)) {
+          if (!is_byte_use(next)) {
+            break;
           }
+        } else if (writes_reg(next, reg)) {
+          return PeepholeResult::Erase;
         }
       }
+      return PeepholeResult::None;
+    }
 
-      for (X86Block* block : _blocks) {
-        for (auto it = block->begin(); it != block->end(); ) {
-          X86Inst* inst = *it;
-
-          if (inst->kind() == X86Inst::Kind::PseudoUse ||
-              inst->kind() == X86Inst::Kind::PseudoDef) {
-            it = it.erase(); // Not needed after regalloc
-          } else {
-            inst->visit_regs([&](Reg& reg) {
-              if (reg.is_virtual()) {
-                std::variant<Reg, size_t> assign = assigned.at(reg.id());
-                if (std::holds_alternative<Reg>(assign)) {
-                  reg = std::get<Reg>(assign);
-                } else {
-                  assert(false); // TODO
-                }
-              }
-            });
+    // lea a, [b]  =>  mov a, b
+    // lea a, [a + x]  =>  add a, x
+    // lea a, [a + b]  =>  add a, b
+    PeepholeResult peephole_lea_to_add(X86Block* block, X86Inst* inst) {
+      if (inst->kind() != X86Inst::Kind::Lea64) {
+        return PeepholeResult::None;
+      }
 
-            if (inst->kind() == X86Inst::Kind::Mov64 &&
-                std::holds_alternative<Reg>(inst->rm())) {
-              Reg src = std::get<Reg>(inst->rm());
-              Reg dst = inst->reg();
-              if (src == dst) {
-                it = it.erase();
-                continue;
-              }
-            }
+      X86Inst::Mem mem = std::get<X86Inst::Mem>(inst->rm());
+      Reg dst = inst->reg();
+      if (mem.scale == 0) {
+        if (mem.disp == 0) {
+          inst->set_kind(X86Inst::Kind::Mov64);
+          inst->set_rm(mem.base);
+          return PeepholeResult::Rewrite;
+        } else if (mem.base == dst && flags_dead_after(inst)) {
+          inst->set_kind(X86Inst::Kind::Add64Imm);
+          inst->set_reg(Reg());
+          inst->set_rm(dst);
+          inst->set_imm((uint64_t) (int64_t) mem.disp);
+          return PeepholeResult::Rewrite;
+        }
+      } else if (mem.scale == 1 && mem.disp == 0 && flags_dead_after(inst)) {
+        if (mem.base == dst) {
+          inst->set_kind(X86Inst::Kind::Add64);
+          inst->set_rm(mem.index);
+          return PeepholeResult::Rewrite;
+        } else if (mem.index == dst) {
+          inst->set_kind(X86Inst::Kind::Add64);
+          inst->set_rm(mem.base);
+          return PeepholeResult::Rewrite;
+        }
+      }
+      return PeepholeResult::None;
+    }
 
-            it++;
+    // mov a, 0  =>  xor a, a
+    PeepholeResult peephole_zero_mov(X86Block* block, X86Inst* inst) {
+      switch (inst->kind()) {
+        case X86Inst::Kind::Mov8Imm:
+        case X86Inst::Kind::Mov32Imm:
+        case X86Inst::Kind::Mov64Imm:
+        case X86Inst::Kind::Mov64Imm64:
+          if (std::holds_alternative<Reg>(inst->rm()) &&
+              std::holds_alternative<uint64_t>(inst->imm()) &&
+              std::get<uint64_t>(inst->imm()) == 0 &&
+              inst->data() == nullptr &&
+              flags_dead_after(inst)) {
+            inst->set_kind(X86Inst::Kind::Xor64);
+            inst->set_imm(std::monostate());
+            inst->set_reg(std::get<Reg>(inst->rm()));
+            return PeepholeResult::Rewrite;
           }
-        }
+        break;
+        default: break;
+      }
+      return PeepholeResult::None;
+    }
+
+    // Jump to the next block
+    PeepholeResult peephole_fallthrough_jmp(X86Block* block, X86Inst* inst) {
+      if (inst->kind() == X86Inst::Kind::Jmp &&
+          inst->next() == nullptr &&
+          std::get<X86Block*>(inst->imm()) == layout_next(block)) {
+        return PeepholeResult::Erase;
       }
+      return PeepholeResult::None;
     }
 
     void peephole() {
+      #ifdef METAJIT_STATS
+      #define count_hit(name) _stats.peephole_hits.name++;
+      #else
+      #define count_hit(name)
+      #endif
+
       for (X86Block* block : _blocks) {
         for (auto it = block->begin(); it != block->end(); ) {
           X86Inst* inst = *it;
 
-          if (((inst->kind() == X86Inst::Kind::Mov8Imm ||
-                inst->kind() == X86Inst::Kind::Mov32Imm ||
-                inst->kind() == X86Inst::Kind::Mov64Imm) &&
-              std::holds_alternative<Reg>(inst->rm())) ||
-              inst->kind() == X86Inst::Kind::Mov64Imm64) {
-            if (std::holds_alternative<uint64_t>(inst->imm())) {
-              uint64_t value = std::get<uint64_t>(inst->imm());
-              if (value == 0) {
-                // Replace with xor reg, reg
-                inst->set_kind(X86Inst::Kind::Xor64);
-                inst->set_imm(std::monostate());
-                if (inst->kind() == X86Inst::Kind::Mov64Imm64) {
-                  inst->set_rm(inst->reg());
-                } else {
-                  inst->set_reg(std::get<Reg>(inst->rm()));
-                }
-              }
-            }
-          } else if (inst->kind() == X86Inst::Kind::Jmp &&
-                      inst->next() == nullptr &&
-                      std::holds_alternative<X86Block*>(inst->imm()) &&
-                      block->name() + 1 < _blocks.size()) {
-            X86Block* target_block = std::get<X86Block*>(inst->imm());
-            if (target_block == _blocks[block->name() + 1]) {
-              it = it.erase();
-              continue;
+          PeepholeResult result = PeepholeResult::None;
+          #define pattern(name) \
+            if (result == PeepholeResult::None) { \
+              result = peephole_##name(block, inst); \
+              if (result != PeepholeResult::None) { \
+                count_hit(name) \
+              } \
             }
-          }
+          x86_peepholes(pattern)
+          #undef pattern
 
-          ++it;
+          if (result == PeepholeResult::Erase) {
+            it = it.erase();
+          } else {
+            ++it;
+          }
         }
       }
+
+      #undef count_hit
     }
 
     void insert_stack_frame() {
       size_t stack_frame_size = _stack_offset_alloc.frame_size();
+      #ifdef METAJIT_STATS
+      _stats.frame_size = stack_frame_size;
+      _stats.spill_slots = _stack_offset_alloc.spill_slots();
+      #endif
       if (stack_frame_size == 0) {
         return;
       }
@@ -2013,7 +4246,7 @@ namespace metajit {
 
       for (X86Block* block : _blocks) {
         for (X86Inst* inst : *block) {
-          if (inst->kind() == X86Inst::Kind::Ret) {
+          if (is_ret(inst)) {
             _builder.move_before(block, inst);
             _builder.add64_imm(Reg::X86_RSP(), (uint64_t) stack_frame_size);
           }
@@ -2021,6 +4254,30 @@ namespace metajit {
       }
     }
 
+    // Side exit stubs are emitted behind the hot path. They end in a return,
+    // so only the emission order changes and the section keeps its order.
+    void layout_blocks() {
+      std::vector<bool> is_cold(_blocks.size(), false);
+      for (Block* block : *_section) {
+        is_cold[block->name()] = block != _section->entry() && OrderBlocks::is_cold(block);
+      }
+
+      _layout = _blocks;
+      std::stable_partition(_layout.begin(), _layout.end(), [&](X86Block* block) {
+        return !is_cold[block->name()];
+      });
+
+      _layout_pos.resize(_layout.size());
+      for (size_t it = 0; it < _layout.size(); it++) {
+        _layout_pos[_layout[it]->name()] = it;
+      }
+    }
+
+    X86Block* layout_next(X86Block* block) const {
+      size_t pos = _layout_pos[block->name()] + 1;
+      return pos < _layout.size() ? _layout[pos] : nullptr;
+    }
+
     void run(const std::vector<Reg>& input_pregs) {
       #ifdef METAJIT_STATS
       _stats.total.start();
@@ -2033,9 +4290,14 @@ namespace metajit {
       #endif
 
       _memory_deps.init(_section);
+      _use_counts.init(_section);
+      _inst_pos.init(_section);
+      _load_valid_until.init(_section);
       _vregs.init(_section);
 
+      _input_pregs = input_pregs;
       for (Arg* arg : _section->entry()->args()) {
+        assert(reg_class(arg->type()) == input_pregs[arg->index()].reg_class());
         fix_to_preg(vreg(arg), input_pregs[arg->index()]);
       }
 
@@ -2046,15 +4308,20 @@ namespace metajit {
         x86_block->set_name(it);
         _blocks[it] = x86_block;
       }
+      layout_blocks();
 
-      memory_deps();
-      with_timer(isel, isel());
+      with_timer(analysis,
+        FrozenSection frozen(_section);
+        memory_deps(frozen)
+      );
+      with_timer(isel, isel(frozen));
       autoname_insts();
+      layout_allocas(frozen);
 
-      if (_mode == Mode::JIT) {
-        with_timer(regalloc, regalloc());
-      } else {
-        with_timer(regalloc, graph_coloring_regalloc());
+      switch (_mode) {
+        case Mode::JIT: with_timer(regalloc, regalloc()); break;
+        case Mode::AOT: with_timer(regalloc, graph_coloring_regalloc()); break;
+        case Mode::LinearScan: with_timer(regalloc, linear_scan_regalloc()); break;
       }
 
       insert_stack_frame();
@@ -2066,10 +4333,16 @@ namespace metajit {
       #undef with_timer
     }
   public:
-    X86CodeGen(Section* section, const std::vector<Reg>& input_pregs, Mode mode = Mode::JIT):
+    X86CodeGen(Section* section,
+               const std::vector<Reg>& input_pregs,
+               Mode mode = Mode::JIT,
+               X86Features features = X86Features::host(),
+               bool link_exits = false):
         Pass(section),
         _section(section),
         _mode(mode),
+        _features(features),
+        _link_exits(link_exits),
         _allocator(section->allocator()),
         _builder(section->allocator(), nullptr) {
 
@@ -2080,11 +4353,15 @@ namespace metajit {
     X86CodeGen(Section* section,
                Allocator& allocator,
                const std::vector<Reg>& input_pregs,
-               Mode mode = Mode::JIT):
+               Mode mode = Mode::JIT,
+               X86Features features = X86Features::host(),
+               bool link_exits = false):
         Pass(section),
         _section(section),
         _allocator(allocator),
         _mode(mode),
+        _features(features),
+        _link_exits(link_exits),
         _builder(allocator, nullptr) {
       
       assert(_section->ordering() >= BlockOrdering::Natural);
@@ -2100,25 +4377,212 @@ namespace metajit {
       Label() {}
     };
 
-    void emit(std::vector<uint8_t>& buffer) {
-      std::vector<Label> labels;
-      std::vector<size_t> offsets(_blocks.size(), 0);
-      for (X86Block* block : _blocks) {
+    // Longest possible encoding of a single x86 instruction
+    static constexpr size_t MAX_INST_SIZE = 15;
+    // Loop headers start on a fresh fetch block
+    static constexpr size_t LOOP_ALIGN = 16;
+
+    // Fixed capacity code buffer writing directly into preallocated memory.
+    // Provides the subset of the std::vector interface used by emit.
+    class CodeBuffer {
+    private:
+      uint8_t* _data = nullptr;
+      size_t _size = 0;
+      size_t _capacity = 0;
+    public:
+      CodeBuffer(uint8_t* data, size_t capacity):
+        _data(data), _capacity(capacity) {}
+
+      uint8_t* data() const { return _data; }
+      size_t size() const { return _size; }
+      size_t capacity() const { return _capacity; }
+
+      void push_back(uint8_t value) {
+        assert(_size < _capacity);
+        _data[_size++] = value;
+      }
+
+      void clear() { _size = 0; }
+
+      uint8_t& operator[](size_t index) { return _data[index]; }
+      const uint8_t& operator[](size_t index) const { return _data[index]; }
+    };
+
+    static bool is_rel8(int64_t value) {
+      return value >= -128 && value <= 127;
+    }
+
+    // Loop header and the size of the padding emitted before it
+    struct Align {
+      size_t offset = 0;
+      size_t padding = 0;
+    };
+
+    // Marks short jumps whose target is out of range as long, until all
+    // remaining short jumps fit. Growing a jump also changes the padding of
+    // the loop headers behind it, which is accounted for here, so that a
+    // single re-emit usually suffices. Returns true if any jump was relaxed.
+    template <class Buffer>
+    static bool relax_jumps(const Buffer& buffer,
+                            const std::vector<Label>& labels,
+                            const std::vector<size_t>& offsets,
+                            const std::vector<Align>& aligns,
+                            std::vector<bool>& long_jumps) {
+      long_jumps.resize(labels.size(), false);
+
+      // Number of bytes by which the long form of each jump is larger
+      std::vector<size_t> growth(labels.size(), 0);
+      for (size_t it = 0; it < labels.size(); it++) {
+        if (!long_jumps[it]) {
+          assert(labels[it].size == 1);
+          growth[it] = buffer[labels[it].pos - 1] == 0xeb ? 3 : 4;
+        }
+      }
+
+      // Offsets starting at thresholds[it] move by shifts[it] bytes
+      std::vector<size_t> thresholds;
+      std::vector<int64_t> shifts;
+      auto shifted = [&](size_t offset) {
+        size_t count = std::upper_bound(thresholds.begin(), thresholds.end(), offset) - thresholds.begin();
+        return int64_t(offset) + (count == 0 ? 0 : shifts[count - 1]);
+      };
+
+      bool relaxed = false;
+      bool changed = true;
+      while (changed) {
+        changed = false;
+
+        thresholds.clear();
+        shifts.clear();
+        int64_t shift = 0;
+        size_t align_it = 0;
+        for (size_t it = 0; it <= labels.size(); it++) {
+          size_t pos = it < labels.size() ? labels[it].pos + 1 : ~size_t(0);
+          for (; align_it < aligns.size() && aligns[align_it].offset < pos; align_it++) {
+            const Align& align = aligns[align_it];
+            size_t start = size_t(int64_t(align.offset - align.padding) + shift);
+            size_t padding = (LOOP_ALIGN - start % LOOP_ALIGN) % LOOP_ALIGN;
+            shift += int64_t(padding) - int64_t(align.padding);
+            thresholds.push_back(align.offset);
+            shifts.push_back(shift);
+          }
+          if (it < labels.size() && long_jumps[it]) {
+            shift += growth[it];
+            thresholds.push_back(pos);
+            shifts.push_back(shift);
+          }
+        }
+
+        for (size_t it = 0; it < labels.size(); it++) {
+          if (long_jumps[it]) {
+            continue;
+          }
+          const Label& label = labels[it];
+          int64_t value = shifted(offsets[label.to->name()]) - shifted(label.ref);
+          if (!is_rel8(value)) {
+            long_jumps[it] = true;
+            relaxed = true;
+            changed = true;
+          }
+        }
+      }
+
+      return relaxed;
+    }
+
+    // Pads using the recommended multi-byte nops
+    template <class Buffer>
+    void emit_nops(Buffer& buffer, size_t size) {
+      static const uint8_t nops[9][9] = {
+        { 0x90 },
+        { 0x66, 0x90 },
+        { 0x0f, 0x1f, 0x00 },
+        { 0x0f, 0x1f, 0x40, 0x00 },
+        { 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+        { 0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+        { 0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00 },
+        { 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+        { 0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 }
+      };
+      while (size > 0) {
+        size_t chunk = std::min(size, size_t(9));
+        for (size_t it = 0; it < chunk; it++) {
+          buffer.push_back(nops[chunk - 1][it]);
+        }
+        size -= chunk;
+      }
+    }
+
+    template <class Buffer>
+    void emit(Buffer& buffer,
+              std::vector<Label>& labels,
+              std::vector<size_t>& offsets,
+              std::vector<Align>& aligns,
+              const std::vector<bool>& long_jumps) {
+      for (X86Block* block : _layout) {
+        if (block->loop()) {
+          Align align;
+          align.padding = (LOOP_ALIGN - buffer.size() % LOOP_ALIGN) % LOOP_ALIGN;
+          emit_nops(buffer, align.padding);
+          align.offset = buffer.size();
+          aligns.push_back(align);
+        }
         offsets[block->name()] = buffer.size();
         for (X86Inst* inst : *block) {
-          emit(inst, buffer, labels);
+          bool is_short = std::holds_alternative<X86Block*>(inst->imm()) &&
+                          (labels.size() >= long_jumps.size() || !long_jumps[labels.size()]);
+          emit(inst, buffer, labels, is_short);
+          if (inst->kind() == X86Inst::Kind::LinkRet) {
+            _exit_slots.push_back(ExitSlot { (uint32_t) std::get<uint64_t>(inst->imm()), buffer.size() - 5 });
+          } else if (inst->kind() == X86Inst::Kind::Mov64Imm64 && inst->data()) {
+            const Symbol* symbol = (const Symbol*) inst->data();
+            _relocations.push_back(Relocation {
+              buffer.size() - 8,
+              std::string(symbol->symbol().data(), symbol->symbol().size())
+            });
+          }
         }
       }
+    }
+
+    template <class Buffer>
+    void emit(Buffer& buffer) {
+      // Jumps are emitted in their short form first and only relaxed if needed
+      std::vector<Label> labels;
+      std::vector<size_t> offsets(_blocks.size(), 0);
+      std::vector<Align> aligns;
+      std::vector<bool> long_jumps;
+      _exit_slots.clear();
+      _relocations.clear();
+      emit(buffer, labels, offsets, aligns, long_jumps);
+
+      // Repeat until stable in case the predicted layout was off
+      while (relax_jumps(buffer, labels, offsets, aligns, long_jumps)) {
+        buffer.clear();
+        labels.clear();
+        aligns.clear();
+        _exit_slots.clear();
+        _relocations.clear();
+        emit(buffer, labels, offsets, aligns, long_jumps);
+      }
+
+      _loop_offsets.clear();
+      for (const Align& align : aligns) {
+        _loop_offsets.push_back(align.offset);
+      }
+      _long_jump_count = std::count(long_jumps.begin(), long_jumps.end(), true);
 
       for (const Label& label : labels) {
         int64_t value = offsets[label.to->name()] - label.ref;
+        assert(label.size != 1 || is_rel8(value));
         for (size_t it = 0; it < label.size; it++) {
           buffer[label.pos + it] = (value >> (it * 8)) & 0xff;
         }
       }
     }
 
-    void emit(X86Inst* inst, std::vector<uint8_t>& buffer, std::vector<Label>& labels) {
+    template <class Buffer>
+    void emit(X86Inst* inst, Buffer& buffer, std::vector<Label>& labels, bool is_short = false) {
       Reg reg = inst->reg();
       X86Inst::RM rm = inst->rm();
       std::optional<uint64_t> imm;
@@ -2154,20 +4618,38 @@ namespace metajit {
         rex(true);
       };
 
+      auto vex = [&](uint8_t pp, bool w) {
+        // Three byte VEX prefix, opcode map 0F38
+        uint8_t rxb = ((reg.id() >> 3) & 1) << 2; // R
+        if (std::holds_alternative<Reg>(rm)) {
+          rxb |= ((std::get<Reg>(rm).id() >> 3) & 1); // B
+        } else if (std::holds_alternative<X86Inst::Mem>(rm)) {
+          X86Inst::Mem mem = std::get<X86Inst::Mem>(rm);
+          rxb |= ((mem.base.id() >> 3) & 1); // B
+          if (!mem.index.is_invalid()) {
+            rxb |= ((mem.index.id() >> 3) & 1) << 1; // X
+          }
+        }
+        byte(0xc4);
+        byte(((~rxb & 0b111) << 5) | 0b00010);
+        byte((w ? 0x80 : 0) | ((~inst->vvvv().id() & 0b1111) << 3) | pp);
+      };
+
       auto rex_opt = [&]() {
+        // Bit 3 of the id selects the upper register bank (r8-r15, xmm8-xmm15)
         bool need_rex = false;
-        if (reg.id() >= 8) {
+        if (reg.id() & 0b1000) {
           need_rex = true;
         } else if (std::holds_alternative<Reg>(rm)) {
-          if (std::get<Reg>(rm).id() >= 8) {
+          if (std::get<Reg>(rm).id() & 0b1000) {
             need_rex = true;
           }
         } else if (std::holds_alternative<X86Inst::Mem>(rm)) {
           X86Inst::Mem mem = std::get<X86Inst::Mem>(rm);
-          if (mem.base.id() >= 8) {
+          if (mem.base.id() & 0b1000) {
             need_rex = true;
           }
-          if (!mem.index.is_invalid() && mem.index.id() >= 8) {
+          if (!mem.index.is_invalid() && (mem.index.id() & 0b1000)) {
             need_rex = true;
           }
         }
@@ -2242,6 +4724,16 @@ namespace metajit {
         }
       };
 
+      // Checks if the immediate of an operation of the given size fits into a sign extended imm8
+      auto is_imm8 = [&](size_t size) {
+        if (!std::holds_alternative<uint64_t>(inst->imm())) {
+          return false;
+        }
+        size_t shift = 64 - size * 8;
+        int64_t value = (int64_t) (imm.value() << shift) >> shift;
+        return value >= -128 && value <= 127;
+      };
+
       auto imm_n = [&](size_t size) {
         if (std::holds_alternative<X86Block*>(inst->imm())) {
           Label label;
@@ -2278,36 +4770,52 @@ namespace metajit {
     }
 
     void write(std::ostream& stream) {
-      for (X86Block* block : _blocks) {
+      for (X86Block* block : _layout) {
         block->write(stream);
       }
     }
 
-    void* deploy() {
-      std::vector<uint8_t> bytes;
-      emit(bytes);
-
-      void* buffer = mmap(
-        nullptr,
-        bytes.size(),
-        PROT_READ | PROT_WRITE,
-        MAP_PRIVATE | MAP_ANONYMOUS,
-        -1,
-        0
-      );
-      assert(buffer != nullptr);
+    // Upper bound for the size of the emitted machine code
+    size_t max_code_size() const {
+      size_t loop_count = 0;
+      for (X86Block* block : _blocks) {
+        if (block->loop()) {
+          loop_count++;
+        }
+      }
+      return inst_count() * MAX_INST_SIZE + loop_count * (LOOP_ALIGN - 1);
+    }
 
-      memcpy(buffer, bytes.data(), bytes.size());
+    CodeArena::Allocation deploy_allocation(CodeArena& arena = CodeArena::global()) {
+      // Emit directly into the final memory region to avoid copying
+      CodeArena::Allocation allocation = arena.alloc(max_code_size());
+      CodeBuffer code(allocation.rw, allocation.size);
+      emit(code);
+      assert(_relocations.empty() && "Symbols are only supported in object files");
+      arena.shrink(allocation, code.size());
+      return allocation;
+    }
 
-      if (mprotect(buffer, bytes.size(), PROT_READ | PROT_EXEC) == -1) {
-        std::cerr << "Failed to set memory protection: ";
-        std::cerr << strerrorname_np(errno) << " " << strerror(errno) << std::endl;
-        exit(1);
-      }
+    void* deploy(CodeArena& arena = CodeArena::global()) {
+      return deploy_allocation(arena).rx;
+    }
 
-      return buffer;
+    // Size of the stack frame in bytes, excluding the return address
+    size_t frame_size() const {
+      return _stack_offset_alloc.frame_size();
     }
 
+    // Linkable exits of the last emitted code
+    const std::vector<ExitSlot>& exit_slots() const { return _exit_slots; }
+    // Symbol references of the last emitted code
+    const std::vector<Relocation>& relocations() const { return _relocations; }
+    // Blocks in the order they are emitted
+    const std::vector<X86Block*>& layout() const { return _layout; }
+    // Offsets of the loop headers in the last emitted code
+    const std::vector<size_t>& loop_offsets() const { return _loop_offsets; }
+    // Jumps which needed a rel32 displacement in the last emitted code
+    size_t long_jump_count() const { return _long_jump_count; }
+
     size_t inst_count() const {
       size_t count = 0;
       for (X86Block* block : _blocks) {
@@ -2324,4 +4832,333 @@ namespace metajit {
     Stats stats() const { return Stats(); }
     #endif
   };
+
+  // Links exits of deployed traces directly to other traces, so control does
+  // not return to the dispatcher in between. Traces are identified by a key
+  // chosen by the runtime. Linked traces must use the same input registers.
+  // Code may only be invalidated while it is not executing.
+  // Exits which keep returning to the dispatcher can get a bridge: a trace
+  // recorded from the state written back by the exit's snapshot, which the
+  // exit then jumps to directly.
+  class X86TraceLinker {
+  public:
+    static constexpr uint32_t DEFAULT_BRIDGE_THRESHOLD = 16;
+
+    struct Trace {
+      uint64_t key = 0;
+      CodeArena::Allocation code;
+      std::vector<X86CodeGen::ExitSlot> slots;
+      Trace* parent = nullptr; // Trace a bridge is attached to
+      std::unordered_map<uint32_t, uint32_t> exit_counts; // Exit id -> returns to the dispatcher
+
+      void* entry() const { return code.rx; }
+    };
+  private:
+    struct Link {
+      Trace* from = nullptr;
+      size_t slot = 0;
+    };
+
+    CodeArena& _arena;
+    uint32_t _bridge_threshold = DEFAULT_BRIDGE_THRESHOLD;
+    std::unordered_map<uint64_t, Trace*> _traces;
+    std::unordered_map<uint64_t, std::vector<Link>> _links; // Target key -> exits
+
+    // The displacement is 4 byte aligned, so the store is atomic with respect
+    // to instruction fetch on other cores
+    static void patch(const Link& link, const Trace* to) {
+      const X86CodeGen::ExitSlot& slot = link.from->slots[link.slot];
+      int64_t value = 0;
+      if (to) {
+        value = to->code.rx - (link.from->code.rx + slot.offset + 4);
+        if (value < INT32_MIN || value > INT32_MAX) {
+          return; // Out of range, keep returning to the dispatcher
+        }
+      }
+      int32_t* rel32 = (int32_t*) (link.from->code.rw + slot.offset);
+      assert((uintptr_t) rel32 % 4 == 0);
+      __atomic_store_n(rel32, (int32_t) value, __ATOMIC_RELEASE);
+    }
+  public:
+    X86TraceLinker(CodeArena& arena = CodeArena::global(),
+                   uint32_t bridge_threshold = DEFAULT_BRIDGE_THRESHOLD):
+      _arena(arena), _bridge_threshold(bridge_threshold) {}
+
+    X86TraceLinker(const X86TraceLinker&) = delete;
+    X86TraceLinker& operator=(const X86TraceLinker&) = delete;
+
+    ~X86TraceLinker() {
+      for (auto [key, trace] : _traces) {
+        _arena.free(trace->code);
+        delete trace;
+      }
+    }
+
+    Trace* trace(uint64_t key) const {
+      auto it = _traces.find(key);
+      return it == _traces.end() ? nullptr : it->second;
+    }
+
+    // Deploys the code and patches all exits waiting for key.
+    // The code generator must be created with linkable exits.
+    Trace* install(uint64_t key, X86CodeGen& codegen) {
+      assert(_traces.find(key) == _traces.end());
+
+      Trace* trace = new Trace();
+      trace->key = key;
+      trace->code = codegen.deploy_allocation(_arena);
+      trace->slots = codegen.exit_slots();
+      _traces[key] = trace;
+
+      for (const Link& link : _links[key]) {
+        patch(link, trace);
+      }
+      return trace;
+    }
+
+    // Sends all exits of from with the given id to the trace for target,
+    // once it is installed
+    void link(Trace* from, uint32_t exit_id, uint64_t target) {
+      Trace* to = trace(target);
+      for (size_t it = 0; it < from->slots.size(); it++) {
+        if (from->slots[it].id == exit_id) {
+          Link link { from, it };
+          _links[target].push_back(link);
+          if (to) {
+            patch(link, to);
+          }
+        }
+      }
+    }
+
+    // Called by the dispatcher when code returns with exit_id. Returns true
+    // once the exit is taken often enough that a bridge should be recorded.
+    bool count_exit(Trace* trace, uint32_t exit_id) {
+      return ++trace->exit_counts[exit_id] == _bridge_threshold;
+    }
+
+    // Installs the bridge under key and sends the parent's exit to it
+    Trace* attach_bridge(Trace* parent, uint32_t exit_id, uint64_t key, X86CodeGen& codegen) {
+      Trace* bridge = install(key, codegen);
+      bridge->parent = parent;
+      link(parent, exit_id, key);
+      return bridge;
+    }
+
+    // Unpatches all exits into the trace and frees its code. Exits stay
+    // registered, so installing a new trace for key links them again.
+    void invalidate(uint64_t key) {
+      Trace* trace = this->trace(key);
+      assert(trace);
+      _traces.erase(key);
+
+      for (const Link& link : _links[key]) {
+        patch(link, nullptr);
+      }
+
+      for (auto& [target, links] : _links) {
+        links.erase(std::remove_if(links.begin(), links.end(), [&](const Link& link) {
+          return link.from == trace;
+        }), links.end());
+      }
+
+      for (auto& [other_key, other] : _traces) {
+        if (other->parent == trace) {
+          other->parent = nullptr;
+        }
+      }
+
+      _arena.free(trace->code);
+      delete trace;
+    }
+  };
+
+  // Writes ahead of time compiled sections as an ELF64 relocatable object,
+  // so they can be linked into a binary with standard tools.
+  // Each section becomes a global function symbol in .text and every Symbol
+  // it references becomes an undefined symbol with an R_X86_64_64 relocation.
+  class X86ObjectWriter {
+  public:
+    static constexpr size_t FUNCTION_ALIGN = 16;
+
+    struct Function {
+      std::string name;
+      std::vector<uint8_t> code;
+      std::vector<X86CodeGen::Relocation> relocations;
+    };
+  private:
+    std::vector<Function> _functions;
+
+    template <class T>
+    static void append(std::vector<uint8_t>& buffer, const T& value) {
+      const uint8_t* bytes = (const uint8_t*) &value;
+      buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+    }
+
+    static void align(std::vector<uint8_t>& buffer, size_t alignment, uint8_t fill = 0) {
+      while (buffer.size() % alignment != 0) {
+        buffer.push_back(fill);
+      }
+    }
+
+    static uint32_t add_string(std::vector<uint8_t>& table, const std::string& string) {
+      uint32_t offset = table.size();
+      table.insert(table.end(), string.begin(), string.end());
+      table.push_back('\0');
+      return offset;
+    }
+  public:
+    X86ObjectWriter() {}
+
+    const std::vector<Function>& functions() const { return _functions; }
+
+    void add(const std::string& name,
+             const std::vector<uint8_t>& code,
+             const std::vector<X86CodeGen::Relocation>& relocations = {}) {
+      _functions.push_back(Function { name, code, relocations });
+    }
+
+    void add(const std::string& name, X86CodeGen& codegen) {
+      std::vector<uint8_t> code;
+      codegen.emit(code);
+      add(name, code, codegen.relocations());
+    }
+
+    std::vector<uint8_t> build() const {
+      enum : uint16_t {
+        SECTION_TEXT = 1,
+        SECTION_RELA_TEXT,
+        SECTION_SYMTAB,
+        SECTION_STRTAB,
+        SECTION_NOTE_STACK,
+        SECTION_SHSTRTAB,
+        SECTION_COUNT
+      };
+
+      std::vector<uint8_t> text;
+      std::vector<uint8_t> strtab = { 0 };
+      std::vector<Elf64_Sym> symbols(1, Elf64_Sym {});
+
+      for (const Function& function : _functions) {
+        align(text, FUNCTION_ALIGN, 0xcc);
+
+        Elf64_Sym symbol = {};
+        symbol.st_name = add_string(strtab, function.name);
+        symbol.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+        symbol.st_shndx = SECTION_TEXT;
+        symbol.st_value = text.size();
+        symbol.st_size = function.code.size();
+        symbols.push_back(symbol);
+
+        text.insert(text.end(), function.code.begin(), function.code.end());
+      }
+
+      // External symbols are shared between all functions
+      std::unordered_map<std::string, size_t> externals;
+      std::vector<Elf64_Rela> relas;
+      for (size_t it = 0; it < _functions.size(); it++) {
+        const Function& function = _functions[it];
+        for (const X86CodeGen::Relocation& relocation : function.relocations) {
+          assert(relocation.offset + 8 <= function.code.size());
+          if (externals.find(relocation.symbol) == externals.end()) {
+            Elf64_Sym symbol = {};
+            symbol.st_name = add_string(strtab, relocation.symbol);
+            symbol.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+            symbol.st_shndx = SHN_UNDEF;
+            externals[relocation.symbol] = symbols.size();
+            symbols.push_back(symbol);
+          }
+
+          Elf64_Rela rela = {};
+          rela.r_offset = symbols[it + 1].st_value + relocation.offset;
+          rela.r_info = ELF64_R_INFO(externals.at(relocation.symbol), R_X86_64_64);
+          rela.r_addend = 0;
+          relas.push_back(rela);
+        }
+      }
+
+      std::vector<uint8_t> shstrtab = { 0 };
+      std::vector<Elf64_Shdr> headers(SECTION_COUNT, Elf64_Shdr {});
+      std::vector<uint8_t> buffer(sizeof(Elf64_Ehdr), 0);
+
+      auto add_section = [&](uint16_t index, const char* name, uint32_t type, size_t alignment) -> Elf64_Shdr& {
+        align(buffer, alignment);
+        Elf64_Shdr& header = headers[index];
+        header.sh_name = add_string(shstrtab, name);
+        header.sh_type = type;
+        header.sh_offset = buffer.size();
+        header.sh_addralign = alignment;
+        return header;
+      };
+
+      Elf64_Shdr& text_header = add_section(SECTION_TEXT, ".text", SHT_PROGBITS, FUNCTION_ALIGN);
+      text_header.sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+      text_header.sh_size = text.size();
+      buffer.insert(buffer.end(), text.begin(), text.end());
+
+      Elf64_Shdr& rela_header = add_section(SECTION_RELA_TEXT, ".rela.text", SHT_RELA, 8);
+      rela_header.sh_flags = SHF_INFO_LINK;
+      rela_header.sh_size = relas.size() * sizeof(Elf64_Rela);
+      rela_header.sh_entsize = sizeof(Elf64_Rela);
+      rela_header.sh_link = SECTION_SYMTAB;
+      rela_header.sh_info = SECTION_TEXT;
+      for (const Elf64_Rela& rela : relas) {
+        append(buffer, rela);
+      }
+
+      Elf64_Shdr& symtab_header = add_section(SECTION_SYMTAB, ".symtab", SHT_SYMTAB, 8);
+      symtab_header.sh_size = symbols.size() * sizeof(Elf64_Sym);
+      symtab_header.sh_entsize = sizeof(Elf64_Sym);
+      symtab_header.sh_link = SECTION_STRTAB;
+      symtab_header.sh_info = 1; // Index of the first global symbol
+      for (const Elf64_Sym& symbol : symbols) {
+        append(buffer, symbol);
+      }
+
+      Elf64_Shdr& strtab_header = add_section(SECTION_STRTAB, ".strtab", SHT_STRTAB, 1);
+      strtab_header.sh_size = strtab.size();
+      buffer.insert(buffer.end(), strtab.begin(), strtab.end());
+
+      // Generated code never needs an executable stack
+      add_section(SECTION_NOTE_STACK, ".note.GNU-stack", SHT_PROGBITS, 1);
+
+      Elf64_Shdr& shstrtab_header = add_section(SECTION_SHSTRTAB, ".shstrtab", SHT_STRTAB, 1);
+      shstrtab_header.sh_size = shstrtab.size();
+      buffer.insert(buffer.end(), shstrtab.begin(), shstrtab.end());
+
+      align(buffer, 8);
+      size_t header_offset = buffer.size();
+      for (const Elf64_Shdr& header : headers) {
+        append(buffer, header);
+      }
+
+      Elf64_Ehdr ehdr = {};
+      memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+      ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+      ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+      ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+      ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+      ehdr.e_type = ET_REL;
+      ehdr.e_machine = EM_X86_64;
+      ehdr.e_version = EV_CURRENT;
+      ehdr.e_shoff = header_offset;
+      ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+      ehdr.e_shentsize = sizeof(Elf64_Shdr);
+      ehdr.e_shnum = SECTION_COUNT;
+      ehdr.e_shstrndx = SECTION_SHSTRTAB;
+      memcpy(buffer.data(), &ehdr, sizeof(ehdr));
+
+      return buffer;
+    }
+
+    void save(const std::string& filename) const {
+      std::vector<uint8_t> buffer = build();
+
+      std::ofstream file(filename, std::ios::binary);
+      if (!file) {
+        assert(false && "Failed to open file for writing");
+      }
+      file.write((const char*) buffer.data(), buffer.size());
+    }
+  };
 }
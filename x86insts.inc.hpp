@@ -32,6 +32,10 @@
 #define unop_x86_inst(name, lowercase, usedef, is_64_bit, opcode) x86_inst(name, lowercase, usedef, is_64_bit, opcode)
 #endif
 
+#ifndef vex_x86_inst
+#define vex_x86_inst(name, lowercase, usedef, is_64_bit, opcode) x86_inst(name, lowercase, usedef, is_64_bit, opcode)
+#endif
+
 #ifndef op0_x86_inst
 #define op0_x86_inst(name, lowercase, usedef, is_64_bit, opcode) x86_inst(name, lowercase, usedef, is_64_bit, opcode)
 #endif
@@ -46,6 +50,7 @@
 #define imm_usedef { use(rm); def(rm); }
 #define cmp_usedef { use(reg); use(rm); }
 #define cmp_imm_usedef { use(rm); }
+#define vex_usedef { use(rm); use(vvvv); def(reg); }
 
 unop_x86_inst(PseudoUse, pseudo_use, { use(rm); }, false, { })
 unop_x86_inst(PseudoDef, pseudo_def, { def(rm); }, false, { })
@@ -77,7 +82,13 @@ binop_x86_inst(MovZX16To64, movzx16to64, mov_usedef, false, { rex_w(); byte(0x0f
 
 x86_inst(Lea64, lea64, { use(rm); def(reg); }, true, { rex_w(); byte(0x8d); modrm(); })
 
+binop_x86_inst(Add8, add8, binop_usedef, false, { rex(); byte(0x02); modrm(); })
+binop_x86_inst(Add16, add16, binop_usedef, false, { byte(0x66); rex_opt(); byte(0x03); modrm(); })
+binop_x86_inst(Add32, add32, binop_usedef, false, { rex_opt(); byte(0x03); modrm(); })
 binop_x86_inst(Add64, add64, binop_usedef, true, { rex_w(); byte(0x03); modrm(); })
+binop_x86_inst(Sub8, sub8, binop_usedef, false, { rex(); byte(0x2a); modrm(); })
+binop_x86_inst(Sub16, sub16, binop_usedef, false, { byte(0x66); rex_opt(); byte(0x2b); modrm(); })
+binop_x86_inst(Sub32, sub32, binop_usedef, false, { rex_opt(); byte(0x2b); modrm(); })
 binop_x86_inst(Sub64, sub64, binop_usedef, true, { rex_w(); byte(0x2b); modrm(); })
 binop_x86_inst(IMul64, imul64, binop_usedef, true, { rex_w(); byte(0x0f); byte(0xaf); modrm(); })
 
@@ -100,16 +111,47 @@ rev_binop_x86_inst(Add16Mem, add16_mem, binop_usedef, true, { byte(0x66); rex_op
 rev_binop_x86_inst(Add32Mem, add32_mem, binop_usedef, true, { rex_opt(); byte(0x01); modrm(); })
 rev_binop_x86_inst(Add64Mem, add64_mem, binop_usedef, true, { rex_w(); byte(0x01); modrm(); })
 
-imm_binop_x86_inst(Add64Imm, add64_imm, imm_usedef, true, { reg = Reg::phys(0); rex_w(); byte(0x81); modrm(); imm_n(4); })
-imm_binop_x86_inst(Sub64Imm, sub64_imm, imm_usedef, true, { reg = Reg::phys(5); rex_w(); byte(0x81); modrm(); imm_n(4); })
-
+imm_binop_x86_inst(Add8Imm, add8_imm, imm_usedef, false, { reg = Reg::phys(0); rex(); byte(0x80); modrm(); imm_n(1); })
+imm_binop_x86_inst(Add16Imm, add16_imm, imm_usedef, false, { reg = Reg::phys(0); byte(0x66); rex_opt(); if (is_imm8(2)) { byte(0x83); modrm(); imm_n(1); } else { byte(0x81); modrm(); imm_n(2); } })
+imm_binop_x86_inst(Add32Imm, add32_imm, imm_usedef, false, { reg = Reg::phys(0); rex_opt(); if (is_imm8(4)) { byte(0x83); modrm(); imm_n(1); } else { byte(0x81); modrm(); imm_n(4); } })
+imm_binop_x86_inst(Add64Imm, add64_imm, imm_usedef, true, { reg = Reg::phys(0); rex_w(); if (is_imm8(8)) { byte(0x83); modrm(); imm_n(1); } else { byte(0x81); modrm(); imm_n(4); } })
+imm_binop_x86_inst(Sub8Imm, sub8_imm, imm_usedef, false, { reg = Reg::phys(5); rex(); byte(0x80); modrm(); imm_n(1); })
+imm_binop_x86_inst(Sub16Imm, sub16_imm, imm_usedef, false, { reg = Reg::phys(5); byte(0x66); rex_opt(); if (is_imm8(2)) { byte(0x83); modrm(); imm_n(1); } else { byte(0x81); modrm(); imm_n(2); } })
+imm_binop_x86_inst(Sub32Imm, sub32_imm, imm_usedef, false, { reg = Reg::phys(5); rex_opt(); if (is_imm8(4)) { byte(0x83); modrm(); imm_n(1); } else { byte(0x81); modrm(); imm_n(4); } })
+imm_binop_x86_inst(Sub64Imm, sub64_imm, imm_usedef, true, { reg = Reg::phys(5); rex_w(); if (is_imm8(8)) { byte(0x83); modrm(); imm_n(1); } else { byte(0x81); modrm(); imm_n(4); } })
+
+x86_inst(IMul32Imm, imul32_imm, mov_usedef, false, { rex_opt(); if (is_imm8(4)) { byte(0x6b); modrm(); imm_n(1); } else { byte(0x69); modrm(); imm_n(4); } })
+x86_inst(IMul64Imm, imul64_imm, mov_usedef, true, { rex_w(); if (is_imm8(8)) { byte(0x6b); modrm(); imm_n(1); } else { byte(0x69); modrm(); imm_n(4); } })
+
+binop_x86_inst(And8, and8, binop_usedef, false, { rex(); byte(0x22); modrm(); })
+binop_x86_inst(And16, and16, binop_usedef, false, { byte(0x66); rex_opt(); byte(0x23); modrm(); })
+binop_x86_inst(And32, and32, binop_usedef, false, { rex_opt(); byte(0x23); modrm(); })
 binop_x86_inst(And64, and64, binop_usedef, true, { rex_w(); byte(0x23); modrm(); })
+binop_x86_inst(Or8, or8, binop_usedef, false, { rex(); byte(0x0a); modrm(); })
+binop_x86_inst(Or16, or16, binop_usedef, false, { byte(0x66); rex_opt(); byte(0x0b); modrm(); })
+binop_x86_inst(Or32, or32, binop_usedef, false, { rex_opt(); byte(0x0b); modrm(); })
 binop_x86_inst(Or64, or64, binop_usedef, true, { rex_w(); byte(0x0b); modrm(); })
+binop_x86_inst(Xor8, xor8, binop_usedef, false, { rex(); byte(0x32); modrm(); })
+binop_x86_inst(Xor16, xor16, binop_usedef, false, { byte(0x66); rex_opt(); byte(0x33); modrm(); })
+binop_x86_inst(Xor32, xor32, binop_usedef, false, { rex_opt(); byte(0x33); modrm(); })
 binop_x86_inst(Xor64, xor64, binop_usedef, true, { rex_w(); byte(0x33); modrm(); })
 
-imm_binop_x86_inst(And64Imm, and64_imm, imm_usedef, true, { reg = Reg::phys(4); rex_w(); byte(0x81); modrm(); imm_n(4); })
-imm_binop_x86_inst(Or64Imm, or64_imm, imm_usedef, true, { reg = Reg::phys(1); rex_w(); byte(0x81); modrm(); imm_n(4); })
-imm_binop_x86_inst(Xor64Imm, xor64_imm, imm_usedef, true, { reg = Reg::phys(6); rex_w(); byte(0x81); modrm(); imm_n(4); })
+// BMI1: reg = ~vvvv & rm
+vex_x86_inst(AndN32, andn32, vex_usedef, false, { vex(0b00, false); byte(0xf2); modrm(); })
+vex_x86_inst(AndN64, andn64, vex_usedef, true, { vex(0b00, true); byte(0xf2); modrm(); })
+
+imm_binop_x86_inst(And8Imm, and8_imm, imm_usedef, false, { reg = Reg::phys(4); rex(); byte(0x80); modrm(); imm_n(1); })
+imm_binop_x86_inst(And16Imm, and16_imm, imm_usedef, false, { reg = Reg::phys(4); byte(0x66); rex_opt(); if (is_imm8(2)) { byte(0x83); modrm(); imm_n(1); } else { byte(0x81); modrm(); imm_n(2); } })
+imm_binop_x86_inst(And32Imm, and32_imm, imm_usedef, false, { reg = Reg::phys(4); rex_opt(); if (is_imm8(4)) { byte(0x83); modrm(); imm_n(1); } else { byte(0x81); modrm(); imm_n(4); } })
+imm_binop_x86_inst(And64Imm, and64_imm, imm_usedef, true, { reg = Reg::phys(4); rex_w(); if (is_imm8(8)) { byte(0x83); modrm(); imm_n(1); } else { byte(0x81); modrm(); imm_n(4); } })
+imm_binop_x86_inst(Or8Imm, or8_imm, imm_usedef, false, { reg = Reg::phys(1); rex(); byte(0x80); modrm(); imm_n(1); })
+imm_binop_x86_inst(Or16Imm, or16_imm, imm_usedef, false, { reg = Reg::phys(1); byte(0x66); rex_opt(); if (is_imm8(2)) { byte(0x83); modrm(); imm_n(1); } else { byte(0x81); modrm(); imm_n(2); } })
+imm_binop_x86_inst(Or32Imm, or32_imm, imm_usedef, false, { reg = Reg::phys(1); rex_opt(); if (is_imm8(4)) { byte(0x83); modrm(); imm_n(1); } else { byte(0x81); modrm(); imm_n(4); } })
+imm_binop_x86_inst(Or64Imm, or64_imm, imm_usedef, true, { reg = Reg::phys(1); rex_w(); if (is_imm8(8)) { byte(0x83); modrm(); imm_n(1); } else { byte(0x81); modrm(); imm_n(4); } })
+imm_binop_x86_inst(Xor8Imm, xor8_imm, imm_usedef, false, { reg = Reg::phys(6); rex(); byte(0x80); modrm(); imm_n(1); })
+imm_binop_x86_inst(Xor16Imm, xor16_imm, imm_usedef, false, { reg = Reg::phys(6); byte(0x66); rex_opt(); if (is_imm8(2)) { byte(0x83); modrm(); imm_n(1); } else { byte(0x81); modrm(); imm_n(2); } })
+imm_binop_x86_inst(Xor32Imm, xor32_imm, imm_usedef, false, { reg = Reg::phys(6); rex_opt(); if (is_imm8(4)) { byte(0x83); modrm(); imm_n(1); } else { byte(0x81); modrm(); imm_n(4); } })
+imm_binop_x86_inst(Xor64Imm, xor64_imm, imm_usedef, true, { reg = Reg::phys(6); rex_w(); if (is_imm8(8)) { byte(0x83); modrm(); imm_n(1); } else { byte(0x81); modrm(); imm_n(4); } })
 
 unop_x86_inst(Shl64, shl64, binop_usedef, true, { reg = Reg::phys(4); rex_w(); byte(0xd3); modrm(); })
 
@@ -123,6 +165,13 @@ unop_x86_inst(Sar16, sar16, binop_usedef, true, { reg = Reg::phys(7); byte(0x66)
 unop_x86_inst(Sar32, sar32, binop_usedef, true, { reg = Reg::phys(7); rex_opt(); byte(0xd3); modrm(); })
 unop_x86_inst(Sar64, sar64, binop_usedef, true, { reg = Reg::phys(7); rex_w(); byte(0xd3); modrm(); })
 
+// BMI2 shifts: reg = rm shifted by vvvv
+vex_x86_inst(ShlX64, shlx64, vex_usedef, true, { vex(0b01, true); byte(0xf7); modrm(); })
+vex_x86_inst(ShrX32, shrx32, vex_usedef, false, { vex(0b11, false); byte(0xf7); modrm(); })
+vex_x86_inst(ShrX64, shrx64, vex_usedef, true, { vex(0b11, true); byte(0xf7); modrm(); })
+vex_x86_inst(SarX32, sarx32, vex_usedef, false, { vex(0b10, false); byte(0xf7); modrm(); })
+vex_x86_inst(SarX64, sarx64, vex_usedef, true, { vex(0b10, true); byte(0xf7); modrm(); })
+
 imm_binop_x86_inst(Shl64Imm, shl64_imm, imm_usedef, true, { reg = Reg::phys(4); rex_w(); byte(0xc1); modrm(); imm_n(1); })
 
 imm_binop_x86_inst(Shr8Imm, shr8_imm, imm_usedef, true, { reg = Reg::phys(5); rex(); byte(0xc0); modrm(); imm_n(1); })
@@ -140,32 +189,91 @@ rev_binop_x86_inst(Cmp16, cmp16, cmp_usedef, false, { byte(0x66); rex_opt(); byt
 rev_binop_x86_inst(Cmp32, cmp32, cmp_usedef, false, { rex_opt(); byte(0x39); modrm(); })
 rev_binop_x86_inst(Cmp64, cmp64, cmp_usedef, true, { rex_w(); byte(0x39); modrm(); })
 
+binop_x86_inst(Cmp8RM, cmp8_rm, cmp_usedef, false, { rex(); byte(0x3a); modrm(); })
+binop_x86_inst(Cmp16RM, cmp16_rm, cmp_usedef, false, { byte(0x66); rex_opt(); byte(0x3b); modrm(); })
+binop_x86_inst(Cmp32RM, cmp32_rm, cmp_usedef, false, { rex_opt(); byte(0x3b); modrm(); })
+binop_x86_inst(Cmp64RM, cmp64_rm, cmp_usedef, true, { rex_w(); byte(0x3b); modrm(); })
+
 imm_binop_x86_inst(Cmp8Imm, cmp8_imm, cmp_imm_usedef, false, { reg = Reg::phys(7); rex(); byte(0x80); modrm(); imm_n(1); })
-imm_binop_x86_inst(Cmp16Imm, cmp16_imm, cmp_imm_usedef, false, { reg = Reg::phys(7); byte(0x66); rex_opt(); byte(0x81); modrm(); imm_n(2); })
-imm_binop_x86_inst(Cmp32Imm, cmp32_imm, cmp_imm_usedef, false, { reg = Reg::phys(7); rex_opt(); byte(0x81); modrm(); imm_n(4); })
-imm_binop_x86_inst(Cmp64Imm, cmp64_imm, cmp_imm_usedef, true, { reg = Reg::phys(7); rex_w(); byte(0x81); modrm(); imm_n(4); })
+imm_binop_x86_inst(Cmp16Imm, cmp16_imm, cmp_imm_usedef, false, { reg = Reg::phys(7); byte(0x66); rex_opt(); if (is_imm8(2)) { byte(0x83); modrm(); imm_n(1); } else { byte(0x81); modrm(); imm_n(2); } })
+imm_binop_x86_inst(Cmp32Imm, cmp32_imm, cmp_imm_usedef, false, { reg = Reg::phys(7); rex_opt(); if (is_imm8(4)) { byte(0x83); modrm(); imm_n(1); } else { byte(0x81); modrm(); imm_n(4); } })
+imm_binop_x86_inst(Cmp64Imm, cmp64_imm, cmp_imm_usedef, true, { reg = Reg::phys(7); rex_w(); if (is_imm8(8)) { byte(0x83); modrm(); imm_n(1); } else { byte(0x81); modrm(); imm_n(4); } })
 
+binop_x86_inst(Test8, test8, cmp_usedef, false, { rex(); byte(0x84); modrm(); })
+binop_x86_inst(Test16, test16, cmp_usedef, false, { byte(0x66); rex_opt(); byte(0x85); modrm(); })
+binop_x86_inst(Test32, test32, cmp_usedef, false, { rex_opt(); byte(0x85); modrm(); })
 binop_x86_inst(Test64, test64, cmp_usedef, true, { rex_w(); byte(0x85); modrm(); })
+
 imm_binop_x86_inst(Test8Imm, test8_imm, cmp_imm_usedef, false, { reg = Reg::phys(0); rex(); byte(0xf6); modrm(); imm_n(1); })
+imm_binop_x86_inst(Test16Imm, test16_imm, cmp_imm_usedef, false, { reg = Reg::phys(0); byte(0x66); rex_opt(); byte(0xf7); modrm(); imm_n(2); })
+imm_binop_x86_inst(Test32Imm, test32_imm, cmp_imm_usedef, false, { reg = Reg::phys(0); rex_opt(); byte(0xf7); modrm(); imm_n(4); })
+imm_binop_x86_inst(Test64Imm, test64_imm, cmp_imm_usedef, true, { reg = Reg::phys(0); rex_w(); byte(0xf7); modrm(); imm_n(4); })
 
 unop_x86_inst(SetE8, sete8, { def(rm); }, false, { rex(); byte(0x0f); byte(0x94); modrm(); })
+unop_x86_inst(SetNE8, setne8, { def(rm); }, false, { rex(); byte(0x0f); byte(0x95); modrm(); })
 unop_x86_inst(SetL8, setl8, { def(rm); }, false, { rex(); byte(0x0f); byte(0x9c); modrm(); })
+unop_x86_inst(SetGE8, setge8, { def(rm); }, false, { rex(); byte(0x0f); byte(0x9d); modrm(); })
+unop_x86_inst(SetLE8, setle8, { def(rm); }, false, { rex(); byte(0x0f); byte(0x9e); modrm(); })
+unop_x86_inst(SetG8, setg8, { def(rm); }, false, { rex(); byte(0x0f); byte(0x9f); modrm(); })
 unop_x86_inst(SetB8, setb8, { def(rm); }, false, { rex(); byte(0x0f); byte(0x92); modrm(); })
+unop_x86_inst(SetAE8, setae8, { def(rm); }, false, { rex(); byte(0x0f); byte(0x93); modrm(); })
+unop_x86_inst(SetBE8, setbe8, { def(rm); }, false, { rex(); byte(0x0f); byte(0x96); modrm(); })
+unop_x86_inst(SetA8, seta8, { def(rm); }, false, { rex(); byte(0x0f); byte(0x97); modrm(); })
 
 binop_x86_inst(CMovNZ64, cmovnz64, binop_usedef, true, { rex_w(); byte(0x0f); byte(0x45); modrm(); })
 binop_x86_inst(CMovE64, cmove64, binop_usedef, true, { rex_w(); byte(0x0f); byte(0x44); modrm(); })
 binop_x86_inst(CMovL64, cmovl64, binop_usedef, true, { rex_w(); byte(0x0f); byte(0x4c); modrm(); })
+binop_x86_inst(CMovGE64, cmovge64, binop_usedef, true, { rex_w(); byte(0x0f); byte(0x4d); modrm(); })
+binop_x86_inst(CMovLE64, cmovle64, binop_usedef, true, { rex_w(); byte(0x0f); byte(0x4e); modrm(); })
+binop_x86_inst(CMovG64, cmovg64, binop_usedef, true, { rex_w(); byte(0x0f); byte(0x4f); modrm(); })
 binop_x86_inst(CMovB64, cmovb64, binop_usedef, true, { rex_w(); byte(0x0f); byte(0x42); modrm(); })
-
-jmp_x86_inst(Jmp, jmp, {}, true, { byte(0xe9); imm_n(4); })
-jmp_x86_inst(JNE, jne, {}, true, { byte(0x0f); byte(0x85); imm_n(4); })
-jmp_x86_inst(JE, je, {}, true, { byte(0x0f); byte(0x84); imm_n(4); })
-jmp_x86_inst(JL, jl, {}, true, { byte(0x0f); byte(0x8c); imm_n(4); })
-jmp_x86_inst(JGE, jge, {}, true, { byte(0x0f); byte(0x8d); imm_n(4); })
-jmp_x86_inst(JB, jb, {}, true, { byte(0x0f); byte(0x82); imm_n(4); })
-jmp_x86_inst(JAE, jae, {}, true, { byte(0x0f); byte(0x83); imm_n(4); })
+binop_x86_inst(CMovAE64, cmovae64, binop_usedef, true, { rex_w(); byte(0x0f); byte(0x43); modrm(); })
+binop_x86_inst(CMovBE64, cmovbe64, binop_usedef, true, { rex_w(); byte(0x0f); byte(0x46); modrm(); })
+binop_x86_inst(CMovA64, cmova64, binop_usedef, true, { rex_w(); byte(0x0f); byte(0x47); modrm(); })
+
+binop_x86_inst(MovAPS, movaps, mov_usedef, false, { rex_opt(); byte(0x0f); byte(0x28); modrm(); })
+
+binop_x86_inst(MovSS, movss, mov_usedef, false, { byte(0xf3); rex_opt(); byte(0x0f); byte(0x10); modrm(); })
+binop_x86_inst(MovSD, movsd, mov_usedef, false, { byte(0xf2); rex_opt(); byte(0x0f); byte(0x10); modrm(); })
+
+rev_binop_x86_inst(MovSSMem, movss_mem, mov_mem_usedef, false, { byte(0xf3); rex_opt(); byte(0x0f); byte(0x11); modrm(); })
+rev_binop_x86_inst(MovSDMem, movsd_mem, mov_mem_usedef, false, { byte(0xf2); rex_opt(); byte(0x0f); byte(0x11); modrm(); })
+
+binop_x86_inst(MovQToXMM, movq_to_xmm, mov_usedef, true, { byte(0x66); rex_w(); byte(0x0f); byte(0x6e); modrm(); })
+rev_binop_x86_inst(MovQFromXMM, movq_from_xmm, mov_mem_usedef, true, { byte(0x66); rex_w(); byte(0x0f); byte(0x7e); modrm(); })
+
+binop_x86_inst(AddSS, addss, binop_usedef, false, { byte(0xf3); rex_opt(); byte(0x0f); byte(0x58); modrm(); })
+binop_x86_inst(AddSD, addsd, binop_usedef, false, { byte(0xf2); rex_opt(); byte(0x0f); byte(0x58); modrm(); })
+binop_x86_inst(SubSS, subss, binop_usedef, false, { byte(0xf3); rex_opt(); byte(0x0f); byte(0x5c); modrm(); })
+binop_x86_inst(SubSD, subsd, binop_usedef, false, { byte(0xf2); rex_opt(); byte(0x0f); byte(0x5c); modrm(); })
+binop_x86_inst(MulSS, mulss, binop_usedef, false, { byte(0xf3); rex_opt(); byte(0x0f); byte(0x59); modrm(); })
+binop_x86_inst(MulSD, mulsd, binop_usedef, false, { byte(0xf2); rex_opt(); byte(0x0f); byte(0x59); modrm(); })
+binop_x86_inst(DivSS, divss, binop_usedef, false, { byte(0xf3); rex_opt(); byte(0x0f); byte(0x5e); modrm(); })
+binop_x86_inst(DivSD, divsd, binop_usedef, false, { byte(0xf2); rex_opt(); byte(0x0f); byte(0x5e); modrm(); })
+
+binop_x86_inst(UComISS, ucomiss, cmp_usedef, false, { rex_opt(); byte(0x0f); byte(0x2e); modrm(); })
+binop_x86_inst(UComISD, ucomisd, cmp_usedef, false, { byte(0x66); rex_opt(); byte(0x0f); byte(0x2e); modrm(); })
+
+binop_x86_inst(CvtSI2SS64, cvtsi2ss64, mov_usedef, true, { byte(0xf3); rex_w(); byte(0x0f); byte(0x2a); modrm(); })
+binop_x86_inst(CvtSI2SD64, cvtsi2sd64, mov_usedef, true, { byte(0xf2); rex_w(); byte(0x0f); byte(0x2a); modrm(); })
+binop_x86_inst(CvtTSS2SI64, cvttss2si64, mov_usedef, true, { byte(0xf3); rex_w(); byte(0x0f); byte(0x2c); modrm(); })
+binop_x86_inst(CvtTSD2SI64, cvttsd2si64, mov_usedef, true, { byte(0xf2); rex_w(); byte(0x0f); byte(0x2c); modrm(); })
+
+jmp_x86_inst(Jmp, jmp, {}, true, { if (is_short) { byte(0xeb); imm_n(1); } else { byte(0xe9); imm_n(4); } })
+jmp_x86_inst(JNE, jne, {}, true, { if (is_short) { byte(0x75); imm_n(1); } else { byte(0x0f); byte(0x85); imm_n(4); } })
+jmp_x86_inst(JE, je, {}, true, { if (is_short) { byte(0x74); imm_n(1); } else { byte(0x0f); byte(0x84); imm_n(4); } })
+jmp_x86_inst(JL, jl, {}, true, { if (is_short) { byte(0x7c); imm_n(1); } else { byte(0x0f); byte(0x8c); imm_n(4); } })
+jmp_x86_inst(JGE, jge, {}, true, { if (is_short) { byte(0x7d); imm_n(1); } else { byte(0x0f); byte(0x8d); imm_n(4); } })
+jmp_x86_inst(JLE, jle, {}, true, { if (is_short) { byte(0x7e); imm_n(1); } else { byte(0x0f); byte(0x8e); imm_n(4); } })
+jmp_x86_inst(JG, jg, {}, true, { if (is_short) { byte(0x7f); imm_n(1); } else { byte(0x0f); byte(0x8f); imm_n(4); } })
+jmp_x86_inst(JB, jb, {}, true, { if (is_short) { byte(0x72); imm_n(1); } else { byte(0x0f); byte(0x82); imm_n(4); } })
+jmp_x86_inst(JAE, jae, {}, true, { if (is_short) { byte(0x73); imm_n(1); } else { byte(0x0f); byte(0x83); imm_n(4); } })
+jmp_x86_inst(JBE, jbe, {}, true, { if (is_short) { byte(0x76); imm_n(1); } else { byte(0x0f); byte(0x86); imm_n(4); } })
+jmp_x86_inst(JA, ja, {}, true, { if (is_short) { byte(0x77); imm_n(1); } else { byte(0x0f); byte(0x87); imm_n(4); } })
 
 op0_x86_inst(Ret, ret, {}, true, { byte(0xc3); })
+// Patchable jmp rel32 to the following ret, the displacement is 4 byte aligned
+x86_inst(LinkRet, link_ret, {}, true, { while ((buffer.size() + 1) % 4 != 0) { byte(0x90); } byte(0xe9); for (size_t it = 0; it < 4; it++) { byte(0x00); } byte(0xc3); })
 
 x86_inst(Call, call, { use(rm); }, true, { reg = Reg::phys(2); rex_w(); byte(0xff); modrm(); })
 
@@ -177,4 +285,5 @@ x86_inst(Comment, comment, {}, false, { })
 #undef imm_binop_x86_inst
 #undef jmp_x86_inst
 #undef unop_x86_inst
+#undef vex_x86_inst
 #undef op0_x86_inst